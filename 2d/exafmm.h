@@ -16,6 +16,7 @@ namespace exafmm {
     real_t q;                                                   //!< Charge
     real_t p;                                                   //!< Potential
     real_t F[2];                                                //!< Force
+    int IBODY;                                                  //!< Initial body numbering for sorting back
   };
   typedef std::vector<Body> Bodies;                             //!< Vector of bodies
 
@@ -36,12 +37,12 @@ namespace exafmm {
   };
   typedef std::vector<Cell> Cells;                              //!< Vector of cells
 
-  //! Global variables
-  int P;                                                        //!< Order of expansions
-  int ncrit;                                                    //!< Number of bodies per leaf cell
-  real_t theta;                                                 //!< Multipole acceptance criterion
-  real_t dX[2];                                                 //!< Distance vector
-#pragma omp threadprivate(dX)                                   //!< Make global variables private
+  //! Parameters of one FMM solve, passed to the tree construction, traversals and kernels
+  struct FMM {
+    int P = 10;                                                 //!< Order of expansions
+    int ncrit = 64;                                             //!< Number of bodies per leaf cell
+    real_t theta = .4;                                          //!< Multipole acceptance criterion
+  };
 }
 
 #endif
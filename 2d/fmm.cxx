@@ -6,13 +6,17 @@
 #elif EXAFMM_LAZY
 #include "traverse_lazy.h"
 #endif
+#if EXAFMM_AUTOTUNE
+#include "autotune.h"
+#endif
 using namespace exafmm;
 
 int main(int argc, char ** argv) {
   const int numBodies = 100000;                                 // Number of bodies
-  P = 10;                                                       // Order of expansions
-  ncrit = 8;                                                    // Number of bodies per leaf cell
-  theta = 0.4;                                                  // Multipole acceptance criterion
+  FMM fmm;                                                      // Parameters of this solve
+  fmm.P = 10;                                                   // Order of expansions
+  fmm.ncrit = 8;                                                // Number of bodies per leaf cell
+  fmm.theta = 0.4;                                              // Multipole acceptance criterion
 
   printf("--- %-16s ------------\n", "FMM Profiling");          // Start profiling
   //! Initialize bodie
@@ -28,27 +32,34 @@ int main(int argc, char ** argv) {
     average += bodies[b].q;                                     //  Accumulate charge
     bodies[b].p = 0;                                            //  Clear potential
     for (int d=0; d<2; d++) bodies[b].F[d] = 0;                 //  Clear force
+    bodies[b].IBODY = b;                                        //  Initial body numbering
   }                                                             // End loop over bodies
   average /= bodies.size();                                     // Average charge
   for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
     bodies[b].q -= average;                                     // Charge neutral
   }                                                             // End loop over bodies
   stop("Initialize bodies");                                    // Stop timer
+#if EXAFMM_AUTOTUNE
+  start("Autotune ncrit");                                      // Start timer
+  fmm.ncrit = tuneNcrit(bodies, fmm);                           // Tune ncrit with trial evaluations
+  stop("Autotune ncrit");                                       // Stop timer
+  printf("%-20s : %d\n", "ncrit", fmm.ncrit);                   // Print tuned ncrit
+#endif
 
   //! Build tree
   start("Build tree");                                          // Start timer
-  Cells cells = buildTree(bodies);                              // Build tree
+  Cells cells = buildTree(bodies, fmm);                         // Build tree
   stop("Build tree");                                           // Stop timer
 
   //! FMM evaluation
   start("P2M & M2M");                                           // Start timer
-  upwardPass(cells);                                            // Upward pass for P2M, M2M
+  upwardPass(cells, fmm);                                       // Upward pass for P2M, M2M
   stop("P2M & M2M");                                            // Stop timer
   start("M2L & P2P");                                           // Start timer
-  horizontalPass(cells, cells);                                 // Horizontal pass for M2L, P2P
+  horizontalPass(cells, cells, fmm);                            // Horizontal pass for M2L, P2P
   stop("M2L & P2P");                                            // Stop timer
   start("L2L & L2P");                                           // Start timer
-  downwardPass(cells);                                          // Downward pass for L2L, L2P
+  downwardPass(cells, fmm);                                     // Downward pass for L2L, L2P
   stop("L2L & L2P");                                            // Stop timer
 
   //! Direct N-Body
@@ -2,7 +2,8 @@
 using namespace exafmm;
 
 int main(int argc, char ** argv) {
-  P = atoi(argv[1]);
+  FMM fmm;
+  fmm.P = atoi(argv[1]);
 
   // P2M
   Bodies jbodies(1);
@@ -15,8 +16,8 @@ int main(int argc, char ** argv) {
   Cj->R = 1;
   Cj->BODY = &jbodies[0];
   Cj->NBODY = jbodies.size();
-  Cj->M.resize(P, 0.0);
-  P2M(Cj);
+  Cj->M.resize(fmm.P, 0.0);
+  P2M(Cj, fmm);
 
   // M2M
   Cell * CJ = &cells[1];
@@ -25,16 +26,16 @@ int main(int argc, char ** argv) {
   CJ->X[0] = 4;
   CJ->X[1] = 0;
   CJ->R = 2;
-  CJ->M.resize(P, 0.0);
-  M2M(CJ);
+  CJ->M.resize(fmm.P, 0.0);
+  M2M(CJ, fmm);
 
   // M2L
   Cell * CI = &cells[2];
   CI->X[0] = -4;
   CI->X[1] = 0;
   CI->R = 2;
-  CI->L.resize(P, 0.0);
-  M2L(CI, CJ);
+  CI->L.resize(fmm.P, 0.0);
+  M2L(CI, CJ, fmm);
 
   // L2L
   Cell * Ci = &cells[3];
@@ -43,8 +44,8 @@ int main(int argc, char ** argv) {
   Ci->X[0] = -3;
   Ci->X[1] = 1;
   Ci->R = 1;
-  Ci->L.resize(P, 0.0);
-  L2L(CI);
+  Ci->L.resize(fmm.P, 0.0);
+  L2L(CI, fmm);
 
   // L2P
   Bodies bodies(1);
@@ -55,7 +56,7 @@ int main(int argc, char ** argv) {
   for (int d=0; d<2; d++) bodies[0].F[d] = 0;
   Ci->BODY = &bodies[0];
   Ci->NBODY = bodies.size();
-  L2P(Ci);
+  L2P(Ci, fmm);
 
   // P2P
   Bodies bodies2(1);
@@ -10,6 +10,7 @@ namespace exafmm {
 
   //!< P2P kernel between cells Ci and Cj
   void P2P(Cell * Ci, Cell * Cj) {
+    real_t dX[2];                                               // Distance vector
     Body * Bi = Ci->BODY;                                       // Target body pointer
     Body * Bj = Cj->BODY;                                       // Source body pointer
     for (int i=0; i<Ci->NBODY; i++) {                           // Loop over target bodies
@@ -30,12 +31,13 @@ namespace exafmm {
   }
 
   //!< P2M kernel for cell C
-  void P2M(Cell * C) {
+  void P2M(Cell * C, const FMM & fmm) {
+    real_t dX[2];                                               // Distance vector
     for (Body * B=C->BODY; B!=C->BODY+C->NBODY; B++) {          // Loop over bodies
       for (int d=0; d<2; d++) dX[d] = B->X[d] - C->X[d];        //  Get distance vector
       complex_t Z(dX[0],dX[1]), powZ(1.0, 0.0);                 //  Convert to complex plane
       C->M[0] += B->q;                                          //  Add constant term
-      for (int n=1; n<P; n++) {                                 //  Loop over coefficients
+      for (int n=1; n<fmm.P; n++) {                             //  Loop over coefficients
         powZ *= Z / real_t(n);                                  //   Store z^n / n!
         C->M[n] += powZ * B->q;                                 //   Add to coefficient
       }                                                         //  End loop
@@ -43,10 +45,11 @@ namespace exafmm {
   }
 
   //!< M2M kernel for one parent cell Ci
-  void M2M(Cell * Ci) {
+  void M2M(Cell * Ci, const FMM & fmm) {
+    real_t dX[2];                                               // Distance vector
     for (Cell * Cj=Ci->CHILD; Cj!=Ci->CHILD+Ci->NCHILD; Cj++) { // Loop over child cells
       for (int d=0; d<2; d++) dX[d] = Cj->X[d] - Ci->X[d];      //  Get distance vector
-      for (int k=0; k<P; k++) {                                 //  Loop over coefficients
+      for (int k=0; k<fmm.P; k++) {                             //  Loop over coefficients
         complex_t Z(dX[0],dX[1]), powZ(1.0, 0.0);               //   z^0 = 1
         Ci->M[k] += Cj->M[k];                                   //   Add constant term
         for (int n=1; n<=k; n++) {                              //   Loop over k-l
@@ -57,29 +60,35 @@ namespace exafmm {
     }                                                           // End loop
   }
 
+  //! Estimated cost of one M2L in P2P body pairs, the number of terms its loops add up
+  inline real_t costM2L(const FMM & fmm) {
+    return real_t(fmm.P) * fmm.P;                               // Cost of O(P^2) M2L
+  }
+
   //!< M2L kernel between cells Ci and Cj
-  void M2L(Cell * Ci, Cell * Cj) {
+  void M2L(Cell * Ci, Cell * Cj, const FMM & fmm) {
+    real_t dX[2];                                               // Distance vector
     for (int d=0; d<2; d++) dX[d] = Ci->X[d] - Cj->X[d];        // Get distance vector
     complex_t Z(dX[0],dX[1]), powZn(1.0, 0.0), powZnk(1.0, 0.0), invZ(powZn/Z);// Convert to complex plane
     Ci->L[0] += -Cj->M[0] * log(Z);                             // Log term (for 0th order)
     Ci->L[0] += Cj->M[1] * invZ;                                // Constant term
     powZn = invZ;                                               // 1/z term
-    for (int k=2; k<P; k++) {                                   // Loop over coefficients
+    for (int k=2; k<fmm.P; k++) {                               // Loop over coefficients
       powZn *= real_t(k-1) * invZ;                              //  Store (k-1)! / z^k
       Ci->L[0] += Cj->M[k] * powZn;                             //  Add to coefficient
     }                                                           // End loop
     Ci->L[1] += -Cj->M[0] * invZ;                               // Constant term (for 1st order)
     powZn = invZ;                                               // 1/z term
-    for (int k=1; k<P; k++) {                                   // Loop over coefficients
+    for (int k=1; k<fmm.P; k++) {                               // Loop over coefficients
       powZn *= real_t(k) * invZ;                                //  Store (k)! / z^k
       Ci->L[1] += -Cj->M[k] * powZn;                            //  Add to coefficient
     }                                                           // End loop
     real_t Cnk = -1;                                            // Fix sign term
-    for (int n=2; n<P; n++) {                                   // Loop over
+    for (int n=2; n<fmm.P; n++) {                               // Loop over
       Cnk *= -1;                                                //  Flip sign
       powZnk *= invZ;                                           //  Store 1 / z^n
       powZn = Cnk * powZnk;                                     //  Combine terms
-      for (int k=0; k<P; k++) {                                 //  Loop over
+      for (int k=0; k<fmm.P; k++) {                             //  Loop over
         powZn *= real_t(n+k-1) * invZ;                          //   (n+k-1)! / z^k
         Ci->L[n] += Cj->M[k] * powZn;                           //   Add to coefficient
       }                                                         //  End loop
@@ -88,14 +97,15 @@ namespace exafmm {
   }
 
   //!< L2L kernel for one parent cell Cj
-  void L2L(Cell * Cj) {
+  void L2L(Cell * Cj, const FMM & fmm) {
+    real_t dX[2];                                               // Distance vector
     for (Cell * Ci=Cj->CHILD; Ci<Cj->CHILD+Cj->NCHILD; Ci++) {  // Loop over child cells
       for (int d=0; d<2; d++) dX[d] = Ci->X[d] - Cj->X[d];      //  Get distance vector
       complex_t Z(dX[0],dX[1]);                                 //  Convert to complex plane
-      for (int l=0; l<P; l++) {                                 //  Loop over coefficients
+      for (int l=0; l<fmm.P; l++) {                             //  Loop over coefficients
         complex_t powZ(1.0, 0.0);                               //   z^0 = 1
         Ci->L[l] += Cj->L[l];                                   //   Add constant term
-        for (int k=1; k<P-l; k++) {                             //   Loop over coefficients
+        for (int k=1; k<fmm.P-l; k++) {                         //   Loop over coefficients
           powZ *= Z / real_t(k);                                //    Store z^k / k!
           Ci->L[l] += Cj->L[l+k] * powZ;                        //    Add to coefficient
         }                                                       //   End loop
@@ -104,17 +114,18 @@ namespace exafmm {
   }
 
   //!< L2P kernel for cell C
-  void L2P(Cell * C) {
+  void L2P(Cell * C, const FMM & fmm) {
+    real_t dX[2];                                               // Distance vector
     for (Body * B=C->BODY; B!=C->BODY+C->NBODY; B++) {          // Loop over bodies
       for (int d=0; d<2; d++) dX[d] = B->X[d] - C->X[d];        //  Get distance vector
       complex_t Z(dX[0],dX[1]), powZ(1.0, 0.0);                 //  Convert to complex plane
       B->p += std::real(C->L[0]);                               //  Add constant term
       B->F[0] += std::real(C->L[1]);                            //  Add constant term
       B->F[1] -= std::imag(C->L[1]);                            //  Add constant term
-      for (int n=1; n<P; n++) {                                 //  Loop over coefficients
+      for (int n=1; n<fmm.P; n++) {                             //  Loop over coefficients
         powZ *= Z / real_t(n);                                  //   Store z^n / n!
         B->p += std::real(C->L[n] * powZ);                      //   Add real part to solution
-        if (n < P-1) {                                          //   Condition for force accumulation
+        if (n < fmm.P-1) {                                      //   Condition for force accumulation
           B->F[0] += std::real(C->L[n+1] * powZ);               //    Add real part to solution
           B->F[1] -= std::imag(C->L[n+1] * powZ);               //    Add real part to solution
         }                                                       //   End condition for force accumulation
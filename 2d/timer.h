@@ -7,6 +7,12 @@ namespace exafmm {
   static timeval t;                                             //!< Time value
   static std::map<std::string,timeval> timer;                   //!< Map of timer event name to time value
 
+  //! Get time of day in seconds
+  double getTime() {
+    gettimeofday(&t, NULL);                                     // Get time of day in seconds and microseconds
+    return double(t.tv_sec) + double(t.tv_usec) * 1e-6;         // Combine seconds and microseconds
+  }
+
   //! Start timer for given event
   void start(std::string event) {
     gettimeofday(&t, NULL);                                     // Get time of day in seconds and microseconds
@@ -4,69 +4,70 @@
 
 namespace exafmm {
   //! Recursive call to post-order tree traversal for upward pass
-  void upwardPass(Cell * Ci) {
+  void upwardPass(Cell * Ci, const FMM & fmm) {
     for (Cell * Cj=Ci->CHILD; Cj!=Ci->CHILD+Ci->NCHILD; Cj++) { // Loop over child cells
 #pragma omp task untied if(Cj->NBODY > 100)                     //  Start OpenMP task if large enough task
-      upwardPass(Cj);                                           //  Recursive call for child cell
+      upwardPass(Cj, fmm);                                      //  Recursive call for child cell
     }                                                           // End loop over child cells
 #pragma omp taskwait                                            // Synchronize OpenMP tasks
-    Ci->M.resize(P, 0.0);                                       // Allocate and initialize multipole coefs
-    Ci->L.resize(P, 0.0);                                       // Allocate and initialize local coefs
-    if (Ci->NCHILD == 0) P2M(Ci);                               // P2M kernel
-    M2M(Ci);                                                    // M2M kernel
+    Ci->M.resize(fmm.P, 0.0);                                   // Allocate and initialize multipole coefs
+    Ci->L.resize(fmm.P, 0.0);                                   // Allocate and initialize local coefs
+    if (Ci->NCHILD == 0) P2M(Ci, fmm);                          // P2M kernel
+    M2M(Ci, fmm);                                               // M2M kernel
   }
 
   //! Upward pass interface
-  void upwardPass(Cells & cells) {
+  void upwardPass(Cells & cells, const FMM & fmm) {
 #pragma omp parallel                                            // Start OpenMP
 #pragma omp single nowait                                       // Start OpenMP single region with nowait
-    upwardPass(&cells[0]);                                      // Pass root cell to recursive call
+    upwardPass(&cells[0], fmm);                                 // Pass root cell to recursive call
   }
 
   //! Recursive call to dual tree traversal for horizontal pass
-  void horizontalPass(Cell * Ci, Cell * Cj) {
+  void horizontalPass(Cell * Ci, Cell * Cj, const FMM & fmm) {
+    real_t dX[2];                                               // Distance vector
     for (int d=0; d<2; d++) dX[d] = Ci->X[d] - Cj->X[d];        // Distance vector from source to target
-    real_t R2 = norm(dX) * theta * theta;                       // Scalar distance squared
+    real_t R2 = norm(dX) * fmm.theta * fmm.theta;               // Scalar distance squared
     if (R2 > (Ci->R + Cj->R) * (Ci->R + Cj->R)) {               // If distance is far enough
-      M2L(Ci, Cj);                                              //  M2L kernel
+      M2L(Ci, Cj, fmm);                                         //  M2L kernel
     } else if (Ci->NCHILD == 0 && Cj->NCHILD == 0) {            // Else if both cells are leafs
       P2P(Ci, Cj);                                              //  P2P kernel
     } else if (Cj->NCHILD == 0 || (Ci->R >= Cj->R && Ci->NCHILD != 0)) {// Else if Cj is leaf or Ci is larger
       for (Cell * ci=Ci->CHILD; ci!=Ci->CHILD+Ci->NCHILD; ci++) {// Loop over Ci's children
 #pragma omp task untied if(ci->NBODY > 100)                     //   Start OpenMP task if large enough task
-        horizontalPass(ci, Cj);                                 //   Recursive call to target child cells
+        horizontalPass(ci, Cj, fmm);                            //   Recursive call to target child cells
       }                                                         //  End loop over Ci's children
     } else {                                                    // Else if Ci is leaf or Cj is larger
       for (Cell * cj=Cj->CHILD; cj!=Cj->CHILD+Cj->NCHILD; cj++) {//  Loop over Cj's children
-        horizontalPass(Ci, cj);                                 //   Recursive call to source child cells
+        horizontalPass(Ci, cj, fmm);                            //   Recursive call to source child cells
       }                                                         //  End loop over Cj's children
     }                                                           // End if for leafs and Ci Cj size
 #pragma omp taskwait                                            // Synchronize OpenMP tasks
   }
 
   //! Horizontal pass interface
-  void horizontalPass(Cells & icells, Cells & jcells) {
+  void horizontalPass(Cells & icells, Cells & jcells, const FMM & fmm) {
 #pragma omp parallel                                            // Start OpenMP
 #pragma omp single nowait                                       // Start OpenMP single region with nowait
-    horizontalPass(&icells[0], &jcells[0]);                     // Pass root cell to recursive call
+    horizontalPass(&icells[0], &jcells[0], fmm);                // Pass root cell to recursive call
   }
 
   //! Recursive call to pre-order tree traversal for downward pass
-  void downwardPass(Cell * Cj) {
-    L2L(Cj);                                                    // L2L kernel
-    if (Cj->NCHILD == 0) L2P(Cj);                               // L2P kernel
+  void downwardPass(Cell * Cj, const FMM & fmm) {
+    L2L(Cj, fmm);                                               // L2L kernel
+    if (Cj->NCHILD == 0) L2P(Cj, fmm);                          // L2P kernel
     for (Cell * Ci=Cj->CHILD; Ci!=Cj->CHILD+Cj->NCHILD; Ci++) { // Loop over child cells
 #pragma omp task untied if(Ci->NBODY > 100)                     //  Start OpenMP task if large enough task
-      downwardPass(Ci);                                         //  Recursive call for child cell
+      downwardPass(Ci, fmm);                                    //  Recursive call for child cell
     }                                                           // End loop over child cells
 #pragma omp taskwait                                            // Synchronize OpenMP tasks
   }
 
   //! Downward pass interface
-  void downwardPass(Cells & cells) {
+  void downwardPass(Cells & cells, const FMM & fmm) {
 #pragma omp parallel                                            // Start OpenMP
 #pragma omp single nowait                                       // Start OpenMP single region with nowait
-    downwardPass(&cells[0]);                                    // Pass root cell to recursive call
+    downwardPass(&cells[0], fmm);                               // Pass root cell to recursive call
   }
 
   //! Direct summation
@@ -1,53 +1,76 @@
 #ifndef traverse_lazy_h
 #define traverse_lazy_h
+#include <algorithm>
 #include "exafmm.h"
 
 namespace exafmm {
   //! Recursive call to post-order tree traversal for upward pass
-  void upwardPass(Cell * Ci) {
+  void upwardPass(Cell * Ci, const FMM & fmm) {
     for (Cell * Cj=Ci->CHILD; Cj!=Ci->CHILD+Ci->NCHILD; Cj++) { // Loop over child cells
 #pragma omp task untied if(Cj->NBODY > 100)                     //  Start OpenMP task if large enough task
-      upwardPass(Cj);                                           //  Recursive call for child cell
+      upwardPass(Cj, fmm);                                      //  Recursive call for child cell
     }                                                           // End loop over child cells
 #pragma omp taskwait                                            // Synchronize OpenMP tasks
-    Ci->M.resize(P, 0.0);                                       // Allocate and initialize multipole coefs
-    Ci->L.resize(P, 0.0);                                       // Allocate and initialize local coefs
-    if (Ci->NCHILD == 0) P2M(Ci);                               // P2M kernel
-    M2M(Ci);                                                    // M2M kernel
+    Ci->M.resize(fmm.P, 0.0);                                   // Allocate and initialize multipole coefs
+    Ci->L.resize(fmm.P, 0.0);                                   // Allocate and initialize local coefs
+    if (Ci->NCHILD == 0) P2M(Ci, fmm);                          // P2M kernel
+    M2M(Ci, fmm);                                               // M2M kernel
   }
 
   //! Upward pass interface
-  void upwardPass(Cells & cells) {
+  void upwardPass(Cells & cells, const FMM & fmm) {
 #pragma omp parallel                                            // Start OpenMP
 #pragma omp single nowait                                       // Start OpenMP single region with nowait
-    upwardPass(&cells[0]);                                      // Pass root cell to recursive call
+    upwardPass(&cells[0], fmm);                                 // Pass root cell to recursive call
   }
 
   //! Recursive call to dual tree traversal for list construction
-  void getList(Cell * Ci, Cell * Cj) {
+  void getList(Cell * Ci, Cell * Cj, const FMM & fmm) {
+    real_t dX[2];                                               // Distance vector
     for (int d=0; d<2; d++) dX[d] = Ci->X[d] - Cj->X[d];        // Distance vector from source to target
-    real_t R2 = norm(dX) * theta * theta;                       // Scalar distance squared
+    real_t R2 = norm(dX) * fmm.theta * fmm.theta;               // Scalar distance squared
     if (R2 > (Ci->R + Cj->R) * (Ci->R + Cj->R)) {               // If distance is far enough
       Ci->listM2L.push_back(Cj);                                //  Add to M2L list
     } else if (Ci->NCHILD == 0 && Cj->NCHILD == 0) {            // Else if both cells are leafs
       Ci->listP2P.push_back(Cj);                                //  Add to P2P list
     } else if (Cj->NCHILD == 0 || (Ci->R >= Cj->R && Ci->NCHILD != 0)) {// Else if Cj is leaf or Ci is larger
       for (Cell * ci=Ci->CHILD; ci!=Ci->CHILD+Ci->NCHILD; ci++) {// Loop over Ci's children
-        getList(ci, Cj);                                        //   Recursive call to target child cells
+        getList(ci, Cj, fmm);                                   //   Recursive call to target child cells
       }                                                         //  End loop over Ci's children
     } else {                                                    // Else if Ci is leaf or Cj is larger
       for (Cell * cj=Cj->CHILD; cj!=Cj->CHILD+Cj->NCHILD; cj++) {//  Loop over Cj's children
-        getList(Ci, cj);                                        //   Recursive call to source child cells
+        getList(Ci, cj, fmm);                                   //   Recursive call to source child cells
       }                                                         //  End loop over Cj's children
     }                                                           // End if for leafs and Ci Cj size
   }
 
-  //! Evaluate M2L, P2P kernels
-  void evaluate(Cells & cells) {
+  //! Order of target cells in descending order of the estimated cost of their lists in P2P body pairs
+  std::vector<int> sortCells(Cells & cells, const FMM & fmm) {
+    int ncell = cells.size();                                   // Number of cells
+    std::vector<real_t> cost(ncell);                            // Estimated cost of lists of each cell
+#pragma omp parallel for
+    for (int i=0; i<ncell; i++) {                               // Loop over cells
+      cost[i] = cells[i].listM2L.size() * costM2L(fmm);         //  Cost of M2L list
+      for (size_t j=0; j<cells[i].listP2P.size(); j++) {        //  Loop over P2P list
+        cost[i] += real_t(cells[i].NBODY) * cells[i].listP2P[j]->NBODY;// Cost of P2P
+      }                                                         //  End loop over P2P list
+    }                                                           // End loop over cells
+    std::vector<int> order(ncell);                              // Order of cells
+    for (int i=0; i<ncell; i++) order[i] = i;                   // Initialize order of cells
+    std::stable_sort(order.begin(), order.end(), [&](int i, int j) {// Sort cells
+      return cost[i] > cost[j];                                 //  In descending order of cost
+    });
+    return order;                                               // Return order of cells
+  }
+
+  //! Evaluate M2L, P2P kernels, most costly lists first so that the dynamic schedule ends with short lists
+  void evaluate(Cells & cells, const FMM & fmm) {
+    std::vector<int> order = sortCells(cells, fmm);             // Cells in descending order of cost
 #pragma omp parallel for schedule(dynamic)
-    for (size_t i=0; i<cells.size(); i++) {                     // Loop over cells
+    for (size_t n=0; n<order.size(); n++) {                     // Loop over cells, most costly first
+      int i = order[n];                                         //  Cell index
       for (size_t j=0; j<cells[i].listM2L.size(); j++) {        //  Loop over M2L list
-        M2L(&cells[i],cells[i].listM2L[j]);                     //   M2L kernel
+        M2L(&cells[i],cells[i].listM2L[j], fmm);                //   M2L kernel
       }                                                         //  End loop over M2L list
       for (size_t j=0; j<cells[i].listP2P.size(); j++) {        //  Loop over P2P list
         P2P(&cells[i],cells[i].listP2P[j]);                     //   P2P kernel
@@ -56,27 +79,27 @@ namespace exafmm {
   }
 
   //! Horizontal pass interface
-  void horizontalPass(Cells & icells, Cells & jcells) {
-    getList(&icells[0], &jcells[0]);                            // Pass root cell to recursive call
-    evaluate(icells);                                           // Evaluate M2L & P2P kernels
+  void horizontalPass(Cells & icells, Cells & jcells, const FMM & fmm) {
+    getList(&icells[0], &jcells[0], fmm);                       // Pass root cell to recursive call
+    evaluate(icells, fmm);                                      // Evaluate M2L & P2P kernels
   }
 
   //! Recursive call to pre-order traversal for downward pass
-  void downwardPass(Cell * Cj) {
-    L2L(Cj);                                                    // L2L kernel
-    if (Cj->NCHILD == 0) L2P(Cj);                               // L2P kernel
+  void downwardPass(Cell * Cj, const FMM & fmm) {
+    L2L(Cj, fmm);                                               // L2L kernel
+    if (Cj->NCHILD == 0) L2P(Cj, fmm);                          // L2P kernel
     for (Cell * Ci=Cj->CHILD; Ci!=Cj->CHILD+Cj->NCHILD; Ci++) { // Loop over child cells
 #pragma omp task untied if(Ci->NBODY > 100)                     //  Start OpenMP task if large enough task
-      downwardPass(Ci);                                         //  Recursive call for child cell
+      downwardPass(Ci, fmm);                                    //  Recursive call for child cell
     }                                                           // End loop over child cells
 #pragma omp taskwait                                            // Synchronize OpenMP tasks
   }
 
   //! Downward pass interface
-  void downwardPass(Cells & cells) {
+  void downwardPass(Cells & cells, const FMM & fmm) {
 #pragma omp parallel                                            // Start OpenMP
 #pragma omp single nowait                                       // Start OpenMP single region with nowait
-    downwardPass(&cells[0]);                                    // Pass root cell to recursive call
+    downwardPass(&cells[0], fmm);                               // Pass root cell to recursive call
   }
 
   //! Direct summation
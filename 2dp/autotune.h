@@ -0,0 +1,87 @@
+#ifndef autotune_h
+#define autotune_h
+#include <fstream>
+#include <string>
+#include <unistd.h>
+#include <omp.h>
+#include "build_tree.h"
+#include "timer.h"
+#if EXAFMM_EAGER
+#include "traverse_eager.h"
+#elif EXAFMM_LAZY
+#include "traverse_lazy.h"
+#endif
+
+namespace exafmm {
+  const char * ncritCache = "ncrit.dat";                        //!< File of tuned ncrit for each machine and parameters
+
+  //! Key of tuned ncrit: host name, P, theta and number of threads
+  std::string ncritKey(const FMM & fmm) {
+    char host[256];                                             // Host name
+    if (gethostname(host, sizeof(host)) != 0) host[0] = 0;      // Get host name
+    host[sizeof(host)-1] = 0;                                   // Terminate host name
+    char key[512];                                              // Key of tuned ncrit
+    snprintf(key, sizeof(key), "%s %d %g %d", host, fmm.P, fmm.theta, omp_get_max_threads());// Combine parameters into key
+    return key;                                                 // Return key
+  }
+
+  //! Read tuned ncrit from cache file, returns 0 if there is no entry for this key
+  int readNcrit(std::string key) {
+    std::ifstream file(ncritCache);                             // Open cache file
+    std::string line;                                           // Line of cache file
+    while (std::getline(file, line)) {                          // Loop over lines
+      size_t pos = line.rfind(' ');                             //  Position of separator before ncrit
+      if (pos != std::string::npos && line.substr(0, pos) == key) {// If key matches
+        return atoi(line.c_str() + pos + 1);                    //   Return tuned ncrit
+      }                                                         //  End if for key
+    }                                                           // End loop over lines
+    return 0;                                                   // No entry for key
+  }
+
+  //! Append tuned ncrit to cache file
+  void writeNcrit(std::string key, int n) {
+    std::ofstream file(ncritCache, std::ios::app);              // Open cache file for appending
+    file << key << " " << n << std::endl;                       // Write key and tuned ncrit
+  }
+
+  //! Time a trial FMM evaluation on a copy of bodies with the given ncrit
+  double timeFMM(Bodies & bodies, const FMM & fmm, int n) {
+    FMM plan = fmm;                                             // Copy parameters
+    plan.ncrit = n;                                             // Set trial ncrit
+    Bodies trial = bodies;                                      // Copy bodies, so that they are not permuted
+    double tic = getTime();                                     // Start timer
+    Cells cells = buildTree(trial, plan);                       // Build tree
+    upwardPass(cells, plan);                                    // Upward pass for P2M, M2M
+    horizontalPass(cells, cells, plan);                         // Horizontal pass for M2L, P2P
+    downwardPass(cells, plan);                                  // Downward pass for L2L, L2P
+    double toc = getTime();                                     // Stop timer
+    return toc - tic;                                           // Return elapsed time
+  }
+
+  //! Find ncrit that minimizes the time of trial evaluations, by doubling or halving ncrit from its current value
+  int tuneNcrit(Bodies & bodies, const FMM & fmm) {
+    std::string key = ncritKey(fmm);                            // Key of tuned ncrit
+    int best = readNcrit(key);                                  // Look up tuned ncrit
+    if (best) return best;                                      // Return cached ncrit
+    best = fmm.ncrit;                                           // Start from current ncrit
+    timeFMM(bodies, fmm, best);                                 // Warm up
+    double tbest = timeFMM(bodies, fmm, best);                  // Time of current ncrit
+    bool larger = false;                                        // Flag for improvement with larger ncrit
+    for (int n=best*2; n<=int(bodies.size()); n*=2) {           // Loop over larger ncrit
+      double t = timeFMM(bodies, fmm, n);                       //  Time of trial ncrit
+      if (t >= tbest) break;                                    //  Stop if slower
+      best = n;                                                 //  Update best ncrit
+      tbest = t;                                                //  Update best time
+      larger = true;                                            //  Larger ncrit was faster
+    }                                                           // End loop over larger ncrit
+    for (int n=best/2; !larger && n>=4; n/=2) {                 // Loop over smaller ncrit
+      double t = timeFMM(bodies, fmm, n);                       //  Time of trial ncrit
+      if (t >= tbest) break;                                    //  Stop if slower
+      best = n;                                                 //  Update best ncrit
+      tbest = t;                                                //  Update best time
+    }                                                           // End loop over smaller ncrit
+    writeNcrit(key, best);                                      // Cache tuned ncrit
+    return best;                                                // Return tuned ncrit
+  }
+}
+#endif
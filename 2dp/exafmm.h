@@ -1,5 +1,6 @@
 #ifndef exafmm_h
 #define exafmm_h
+#include <cmath>
 #include <complex>
 #include <cstdio>
 #include <cstdlib>
@@ -16,6 +17,7 @@ namespace exafmm {
     real_t q;                                                   //!< Charge
     real_t p;                                                   //!< Potential
     real_t F[2];                                                //!< Force
+    int IBODY;                                                  //!< Initial body numbering for sorting back
   };
   typedef std::vector<Body> Bodies;                             //!< Vector of bodies
 
@@ -38,15 +40,14 @@ namespace exafmm {
   };
   typedef std::vector<Cell> Cells;                              //!< Vector of cells
 
-  //! Global variables
-  int P;                                                        //!< Order of expansions
-  int ncrit;                                                    //!< Number of bodies per leaf cell
-  int images;                                                   //!< Number of periodic image sublevels
-  int iX[2];                                                    //!< 2-D periodic index
-  real_t cycle;                                                 //!< Cycle of periodic boundary condition
-  real_t theta;                                                 //!< Multipole acceptance criterion
-  real_t dX[2];                                                 //!< Distance vector
-#pragma omp threadprivate(iX,dX)                                //!< Make global variables private
+  //! Parameters of one FMM solve, passed to the tree construction, traversals and kernels
+  struct FMM {
+    int P = 10;                                                 //!< Order of expansions
+    int ncrit = 64;                                             //!< Number of bodies per leaf cell
+    int images = 0;                                             //!< Number of periodic image sublevels
+    real_t cycle = 2 * M_PI;                                    //!< Cycle of periodic boundary condition
+    real_t theta = .4;                                          //!< Multipole acceptance criterion
+  };
 }
 
 #endif
@@ -0,0 +1,141 @@
+#ifndef accuracy_h
+#define accuracy_h
+#include <cmath>
+#include "kernel.h"
+#include "timer.h"
+#if EXAFMM_EAGER
+#include "traverse_eager.h"
+#elif EXAFMM_LAZY
+#include "traverse_lazy.h"
+#endif
+
+namespace exafmm {
+  const real_t errorC = 0.18;                                   //!< Constant of error model, 2.3x the fitted 0.078 to cover its spread
+  const real_t errorA = 0.944;                                  //!< Exponent of theta in error model
+  const real_t errorB = 0.156;                                  //!< Exponent of 1 - theta in error model
+
+  //! Predicted relative L2 error of potential, C (theta^A / (1 - theta)^B)^P fitted to uniform bodies with ncrit 64
+  real_t predictError(real_t theta, int P) {
+    return errorC * std::pow(std::pow(theta, errorA) / std::pow(1 - theta, errorB), P);
+  }
+
+  //! Count M2L pairs and P2P body pairs of a dual tree traversal with the given theta
+  void countInteractions(Cell * Ci, Cell * Cj, real_t theta, double & nM2L, double & nP2P) {
+    real_t dX[3];                                               // Distance vector
+    for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d];        // Distance vector from source to target
+    real_t R2 = norm(dX) * theta * theta;                       // Scalar distance squared
+    if (R2 > (Ci->R + Cj->R) * (Ci->R + Cj->R)) {               // If distance is far enough
+      nM2L++;                                                   //  Count M2L pair
+    } else if (Ci->NCHILD == 0 && Cj->NCHILD == 0) {            // Else if both cells are leafs
+      nP2P += double(Ci->NBODY) * Cj->NBODY;                    //  Count P2P body pairs
+    } else if (Cj->NCHILD == 0 || (Ci->R >= Cj->R && Ci->NCHILD != 0)) {// If Cj is leaf or Ci is larger
+      for (Cell * ci=Ci->CHILD; ci!=Ci->CHILD+Ci->NCHILD; ci++) {// Loop over Ci's children
+        countInteractions(ci, Cj, theta, nM2L, nP2P);           //   Recursive call to target child cells
+      }                                                         //  End loop over Ci's children
+    } else {                                                    // Else if Ci is leaf or Cj is larger
+      for (Cell * cj=Cj->CHILD; cj!=Cj->CHILD+Cj->NCHILD; cj++) {// Loop over Cj's children
+        countInteractions(Ci, cj, theta, nM2L, nP2P);           //   Recursive call to source child cells
+      }                                                         //  End loop over Cj's children
+    }                                                           // End if for leafs and Ci Cj size
+  }
+
+  //! Time of one M2L of order P between two cells
+  double timeM2L(const FMM & fmm, int P) {
+    const int nrep = 100;                                       // Number of repetitions
+    FMM plan = fmm;                                             // Copy parameters
+    plan.P = P;                                                 // Set trial order
+    initKernel(plan);                                           // Initialize kernel tables of trial order
+    Cells cells(2);                                             // Pair of cells
+    for (int d=0; d<3; d++) cells[0].X[d] = 0;                  // Center of target cell
+    cells[1].X[0] = 1, cells[1].X[1] = .5, cells[1].X[2] = .25; // Center of source cell
+    cells[0].R = cells[1].R = .2;                               // Radius of cells
+    initCoefs(cells, plan);                                     // Allocate coefs
+    std::fill(cells.coefs.begin(), cells.coefs.end(), 1.0);     // Initialize coefs
+    double tic = getTime();                                     // Start timer
+    for (int i=0; i<nrep; i++) M2L(&cells[0], &cells[1], plan); // Repeat M2L kernel
+    double toc = getTime();                                     // Stop timer
+    return (toc - tic) / nrep;                                  // Return time of one M2L
+  }
+
+  //! Time of P2P per body pair between two leafs of ncrit bodies
+  double timeP2P(const FMM & fmm) {
+    const int nrep = 10;                                        // Number of repetitions
+    int n = fmm.ncrit;                                          // Number of bodies per cell
+    Bodies bodies(2 * n);                                       // Bodies of both cells
+    srand48(0);                                                 // Set seed for random number generator
+    for (size_t b=0; b<bodies.size(); b++) {                    // Loop over bodies
+      for (int d=0; d<3; d++) bodies[b].X[d] = drand48() + (b >= size_t(n));// Initialize positions
+      for (int k=0; k<NRHS; k++) {                              //  Loop over right-hand sides
+        charge(bodies[b], k) = drand48() - .5;                  //   Initialize charge
+        potential(bodies[b], k) = 0;                            //   Clear potential
+        for (int d=0; d<3; d++) force(bodies[b], k)[d] = 0;     //   Clear force
+      }                                                         //  End loop over right-hand sides
+    }                                                           // End loop over bodies
+    Cells cells(2);                                             // Pair of cells
+    cells[0].BODY = &bodies[0];                                 // First body of target cell
+    cells[1].BODY = &bodies[n];                                 // First body of source cell
+    cells[0].NBODY = cells[1].NBODY = n;                        // Number of bodies of cells
+    double tic = getTime();                                     // Start timer
+    for (int i=0; i<nrep; i++) P2P(&cells[0], &cells[1], fmm);  // Repeat P2P kernel
+    double toc = getTime();                                     // Stop timer
+    return (toc - tic) / nrep / n / n;                          // Return time per body pair
+  }
+
+  //! Choose theta and P of least predicted cost whose predicted error meets the tolerance
+  //! Cost is M2L pairs and P2P body pairs of the tree of cells times kernel times measured on this machine
+  //! Returns false if no candidate meets the tolerance, leaving fmm at the candidate of least predicted error
+  bool selectAccuracy(Cells & cells, FMM & fmm, real_t tolerance) {
+    const int maxP = 20;                                        // Highest order with an instantiated kernel
+    std::vector<double> tM2L(maxP + 1, 0);                      // Time of M2L of each order
+    double tP2P = timeP2P(fmm);                                 // Time of P2P per body pair
+    double best = 0;                                            // Least predicted cost
+    real_t minError = 0;                                        // Least predicted error of all candidates
+    for (real_t theta=.3; theta<.71; theta+=.05) {              // Loop over candidate theta
+      int P = 4;                                                //  Lowest instantiated order
+      while (P < maxP && predictError(theta, P) > tolerance) P++;// Lowest order that meets tolerance
+      if (predictError(theta, P) > tolerance) {                 //  If theta cannot meet tolerance
+        if (best == 0 && (minError == 0 || predictError(theta, P) < minError)) {// If no candidate met it yet
+          minError = predictError(theta, P);                    //    Update least error
+          fmm.theta = theta;                                    //    Fall back to most accurate theta
+          fmm.P = P;                                            //    Fall back to most accurate order
+        }                                                       //   End if for least error
+        continue;                                               //   Skip theta
+      }                                                         //  End if for tolerance
+      double nM2L = 0, nP2P = 0;                                //  Number of interactions
+      countInteractions(&cells[0], &cells[0], theta, nM2L, nP2P);// Count interactions of theta
+      if (tM2L[P] == 0) tM2L[P] = timeM2L(fmm, P);              //  Time M2L of this order once
+      double cost = nM2L * tM2L[P] + nP2P * tP2P;               //  Predicted cost
+      if (best == 0 || cost < best) {                           //  If cost is the least so far
+        best = cost;                                            //   Update least cost
+        fmm.theta = theta;                                      //   Update theta
+        fmm.P = P;                                              //   Update order
+      }                                                         //  End if for least cost
+    }                                                           // End loop over candidate theta
+    return best != 0;                                           // Whether a candidate met the tolerance
+  }
+
+  //! Relative L2 error of potential at numSamples bodies against direct summation over all bodies
+  real_t sampleError(Bodies & bodies, int numSamples) {
+    int stride = std::max(int(bodies.size()) / numSamples, 1);  // Stride of sampling
+    Bodies samples;                                             // Sampled targets
+    for (size_t b=0; b<bodies.size(); b+=stride) {              // Loop over sampled bodies
+      samples.push_back(bodies[b]);                             //  Copy body
+      for (int k=0; k<NRHS; k++) {                              //  Loop over right-hand sides
+        potential(samples.back(), k) = 0;                       //   Clear potential
+        for (int d=0; d<3; d++) force(samples.back(), k)[d] = 0;//   Clear force
+      }                                                         //  End loop over right-hand sides
+    }                                                           // End loop over sampled bodies
+    direct(samples, bodies);                                    // Direct summation to samples
+    real_t dif = 0, nrm = 0;
+    for (size_t i=0; i<samples.size(); i++) {                   // Loop over samples
+      for (int k=0; k<NRHS; k++) {                              //  Loop over right-hand sides
+        real_t p = potential(bodies[i*stride], k);              //   Potential by FMM
+        real_t p2 = potential(samples[i], k);                   //   Potential by direct summation
+        dif += (p - p2) * (p - p2);                             //   Difference of potential
+        nrm += p2 * p2;                                         //   Value of potential
+      }                                                         //  End loop over right-hand sides
+    }                                                           // End loop over samples
+    return std::sqrt(dif / nrm);                                // Return relative L2 error
+  }
+}
+#endif
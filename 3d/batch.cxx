@@ -0,0 +1,67 @@
+#include "batch.h"
+#include "timer.h"
+using namespace exafmm;
+
+int main(int argc, char ** argv) {
+  const int numSystems = 100;                                   // Number of independent systems
+  FMM fmm;                                                      // Parameters and tables of all systems
+  fmm.P = 10;                                                   // Order of expansions
+  fmm.ncrit = 64;                                               // Number of bodies per leaf cell
+  fmm.theta = 0.4;                                              // Multipole acceptance criterion
+  initKernel(fmm);                                              // Initialize kernel
+
+  printf("--- %-16s ------------\n", "Batch Profiling");        // Start profiling
+  //! Initialize bodies
+  start("Initialize bodies");                                   // Start timer
+  std::vector<Bodies> systems(numSystems);                      // Bodies of each system
+  srand48(0);                                                   // Set seed for random number generator
+  for (int s=0; s<numSystems; s++) {                            // Loop over systems
+    systems[s].resize(500 + lrand48() % 1000);                  //  Between 500 and 1500 bodies
+    for (size_t b=0; b<systems[s].size(); b++) {                //  Loop over bodies
+      for (int d=0; d<3; d++) {                                 //   Loop over dimension
+        systems[s][b].X[d] = drand48() * 2 * M_PI - M_PI;       //    Initialize positions
+      }                                                         //   End loop over dimension
+      systems[s][b].q = drand48() - .5;                         //   Initialize charge
+      systems[s][b].p = 0;                                      //   Clear potential
+      for (int d=0; d<3; d++) systems[s][b].F[d] = 0;           //   Clear force
+      systems[s][b].IBODY = b;                                  //   Initial body numbering
+    }                                                           //  End loop over bodies
+  }                                                             // End loop over systems
+  std::vector<Bodies> systems2 = systems;                       // Copy systems for solving one by one
+  stop("Initialize bodies");                                    // Stop timer
+
+  //! FMM of all systems at once
+  start("Batch FMM");                                           // Start timer
+  Cells cells;                                                  // Cells and coefs of all systems
+  evaluateBatch(systems, cells, fmm);                           // Build trees and evaluate all systems
+  stop("Batch FMM");                                            // Stop timer
+
+  //! FMM of one system after another
+  start("One by one FMM");                                      // Start timer
+  for (int s=0; s<numSystems; s++) {                            // Loop over systems
+    Cells cells2 = buildTree(systems2[s], fmm);                 //  Build tree
+    upwardPass(cells2, fmm);                                    //  Upward pass for P2M, M2M
+    horizontalPass(cells2, cells2, fmm);                        //  Horizontal pass for M2L, P2P
+    downwardPass(cells2, fmm);                                  //  Downward pass for L2L, L2P
+  }                                                             // End loop over systems
+  stop("One by one FMM");                                       // Stop timer
+
+  //! Verify result
+  real_t pDif = 0, pNrm = 0, FDif = 0, FNrm = 0;
+  for (int s=0; s<numSystems; s++) {                            // Loop over systems
+    Bodies & bodies = systems[s];                               //  Bodies of batch solve
+    Bodies & bodies2 = systems2[s];                             //  Bodies of one by one solve
+    for (size_t b=0; b<bodies.size(); b++) {                    //  Loop over bodies & bodies2
+      pDif += (bodies[b].p - bodies2[b].p) * (bodies[b].p - bodies2[b].p);// Difference of potential
+      pNrm += bodies2[b].p * bodies2[b].p;                      //   Value of potential
+      for (int d=0; d<3; d++) {                                 //   Loop over dimension
+        FDif += (bodies[b].F[d] - bodies2[b].F[d]) * (bodies[b].F[d] - bodies2[b].F[d]);// Difference of force
+        FNrm += bodies2[b].F[d] * bodies2[b].F[d];              //    Value of force
+      }                                                         //   End loop over dimension
+    }                                                           //  End loop over bodies & bodies2
+  }                                                             // End loop over systems
+  printf("--- %-16s ------------\n", "Batch vs. loop");         // Print message
+  printf("%-20s : %8.5e s\n","Rel. L2 Error (p)", sqrt(pDif/pNrm));// Print potential error
+  printf("%-20s : %8.5e s\n","Rel. L2 Error (F)", sqrt(FDif/FNrm));// Print force error
+  return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef batch_h
+#define batch_h
+#include "build_tree.h"
+#include "kernel.h"
+#include "traverse_eager.h"
+
+namespace exafmm {
+  //! Build nodes of the tree of one system of a batch, using the calling task instead of a new parallel region
+  Node * buildSystem(Bodies & bodies, real_t & R0, const FMM & fmm) {
+    real_t Xmin[3], Xmax[3], X0[3];                             // Min, max and center of domain
+    for (int d=0; d<3; d++) Xmin[d] = Xmax[d] = bodies[0].X[d]; // Initialize Xmin, Xmax
+    for (size_t b=0; b<bodies.size(); b++) {                    // Loop over bodies
+      for (int d=0; d<3; d++) Xmin[d] = fmin(bodies[b].X[d], Xmin[d]);//  Update Xmin
+      for (int d=0; d<3; d++) Xmax[d] = fmax(bodies[b].X[d], Xmax[d]);//  Update Xmax
+    }                                                           // End loop over bodies
+    getRoot(Xmin, Xmax, R0, X0);                                // Get root cell of domain
+    Bodies buffer = bodies;                                     // Copy bodies to buffer
+    return buildNodes(&bodies[0], &buffer[0], 0, bodies.size(), X0, R0, fmm.ncrit);// Build nodes recursively
+  }
+
+  //! Evaluate one system of a batch on its cells, which already point to their coefs
+  void evaluateSystem(Cell * C0, const FMM & fmm) {
+    real_t spawn = spawnCost(costExpansion(C0, fmm));           // Cost of a task of the upward and downward pass
+    upwardPass(C0, fmm, spawn);                                 // Upward pass for P2M, M2M
+    initCost(C0, C0, fmm);                                      // Estimate cost of target subtrees
+    horizontalPass(C0, C0, fmm, spawnCost(C0->COST));           // Horizontal pass for M2L, P2P
+    downwardPass(C0, fmm, spawn);                               // Downward pass for L2L, L2P
+  }
+
+  //! FMM of many independent systems in one parallel region, with the cells and coefs of all systems in one arena
+  void evaluateBatch(std::vector<Bodies> & systems, Cells & cells, const FMM & fmm) {
+    int nsystem = systems.size();                               // Number of systems
+    std::vector<Node*> roots(nsystem, NULL);                    // Root node of each system
+    std::vector<real_t> R0(nsystem);                            // Radius of root cell of each system
+    std::vector<int> offset(nsystem + 1, 0);                    // Offset of root cell of each system
+#pragma omp parallel                                            // Start OpenMP
+#pragma omp single nowait                                       // Start OpenMP single region with nowait
+    {
+      for (int s=0; s<nsystem; s++) {                           //  Loop over systems
+        if (systems[s].empty()) continue;                       //   Skip systems without bodies
+#pragma omp task untied shared(systems, roots, R0)              //   Start OpenMP task for each system
+        roots[s] = buildSystem(systems[s], R0[s], fmm);         //   Build nodes of system
+      }                                                         //  End loop over systems
+#pragma omp taskwait                                            //  Synchronize OpenMP tasks
+      for (int s=0; s<nsystem; s++) {                           //  Loop over systems
+        offset[s+1] = offset[s] + (roots[s] ? roots[s]->NNODE : 0);// Offset of cells of next system
+      }                                                         //  End loop over systems
+      cells.resize(offset[nsystem]);                            //  Allocate cells of all systems at once
+      size_t size = 2 * NRHS * cells.size() * fmm.NTERM;        //  Number of coefs of all systems
+      if (cells.coefs.size() != size) allocateUntouched(cells.coefs, size);// Allocate coefs of all systems, cleared by their tasks
+      for (int s=0; s<nsystem; s++) {                           //  Loop over systems
+        if (!roots[s]) continue;                                //   Skip systems without bodies
+#pragma omp task untied shared(systems, roots, R0, offset, cells)//  Start OpenMP task for each system
+        {
+          Cell * C0 = &cells[offset[s]];                        //    Root cell of system
+          complex_t * coefs = &cells.coefs[2*NRHS*offset[s]*fmm.NTERM];// Coefs of system
+          std::fill(coefs, coefs + 2*NRHS*(offset[s+1]-offset[s])*fmm.NTERM, 0.0);// Clear coefs in the task that owns them
+          nodes2cells(roots[s], C0, C0+1, &systems[s][0], R0[s]);//   Convert nodes to cells recursively
+          setCoefs(C0, offset[s+1] - offset[s], coefs, fmm);    //    Point cells to coefs
+          evaluateSystem(C0, fmm);                              //    Evaluate FMM of system
+        }
+      }                                                         //  End loop over systems
+    }                                                           // End OpenMP
+  }
+}
+#endif
@@ -3,96 +3,266 @@
 #include "exafmm.h"
 
 namespace exafmm {
+  const int nspawn = 1000;                                      //!< Threshold of NBODY for spawning new OpenMP tasks
+
+  //! Structure of temporary octree nodes used during tree construction
+  struct Node {
+    int IBODY;                                                  //!< Index of first body in node
+    int NBODY;                                                  //!< Number of descendant bodies
+    int NNODE;                                                  //!< Number of descendant nodes including itself
+    Node * CHILD[8];                                            //!< Pointers of child nodes
+    real_t X[3];                                                //!< Node center
+  };
+
+  //! Get center and radius of root cell from min, max of domain
+  void getRoot(real_t * Xmin, real_t * Xmax, real_t & R0, real_t * X0) {
+    for (int d=0; d<3; d++) X0[d] = (Xmax[d] + Xmin[d]) / 2;    // Calculate center of domain
+    R0 = 0;                                                     // Initialize localRadius
+    for (int d=0; d<3; d++) {                                   // Loop over dimensions
+      R0 = fmax(X0[d] - Xmin[d], R0);                           //  Calculate min distance from center
+      R0 = fmax(Xmax[d] - X0[d], R0);                           //  Calculate max distance from center
+    }                                                           // End loop over dimensions
+    R0 *= 1.00001;                                              // Add some leeway to radius
+  }
+
   //! Get bounding box of bodies
   void getBounds(Bodies & bodies, real_t & R0, real_t * X0) {
     real_t Xmin[3], Xmax[3];                                    // Min, max of domain
     for (int d=0; d<3; d++) Xmin[d] = Xmax[d] = bodies[0].X[d]; // Initialize Xmin, Xmax
+#pragma omp parallel for reduction(min:Xmin[:3]) reduction(max:Xmax[:3])
     for (size_t b=0; b<bodies.size(); b++) {                    // Loop over range of bodies
       for (int d=0; d<3; d++) Xmin[d] = fmin(bodies[b].X[d], Xmin[d]);//  Update Xmin
       for (int d=0; d<3; d++) Xmax[d] = fmax(bodies[b].X[d], Xmax[d]);//  Update Xmax
     }                                                           // End loop over range of bodies
-    for (int d=0; d<3; d++) X0[d] = (Xmax[d] + Xmin[d]) / 2;    // Calculate center of domain
-    R0 = 0;                                                     // Initialize localRadius
-    for (int d=0; d<3; d++) {                                   // Loop over dimensions
-      R0 = fmax(X0[d] - Xmin[d], R0);                           //  Calculate min distance from center
-      R0 = fmax(Xmax[d] - X0[d], R0);                           //  Calculate max distance from center
-    }                                                           // End loop over dimensions
-    R0 *= 1.00001;                                              // Add some leeway to radius
+    getRoot(Xmin, Xmax, R0, X0);                                // Get root cell of domain
   }
 
-  //! Build cells of tree adaptively using a top-down approach based on recursion
-  void buildCells(Body * bodies, Body * buffer, int begin, int end, Cell * cell, Cells & cells,
-                  real_t * X, real_t R, int level=0, bool direction=false) {
-    //! Create a tree cell
-    cell->BODY = bodies + begin;                                // Pointer of first body in cell
-    if(direction) cell->BODY = buffer + begin;                  // Pointer of first body in cell
-    cell->NBODY = end - begin;                                  // Number of bodies in cell
-    cell->NCHILD = 0;                                           // Initialize counter for child cells
-    for (int d=0; d<3; d++) cell->X[d] = X[d];                  // Center position of cell
-    cell->R = R / (1 << level);                                 // Cell radius
-    //! If cell is a leaf
+  //! Count number of bodies in each octant for a block of bodies
+  void countBodies(Body * bodies, int begin, int end, real_t * X, int * size) {
+    for (int i=0; i<8; i++) size[i] = 0;                        // Initialize octant counter
+    real_t x[3];                                                // Coordinates of bodies
+    for (int i=begin; i<end; i++) {                             // Loop over bodies in block
+      for (int d=0; d<3; d++) x[d] = bodies[i].X[d];            //  Position of body
+      int octant = (x[0] > X[0]) + ((x[1] > X[1]) << 1) + ((x[2] > X[2]) << 2);// Which octant body belongs to
+      size[octant]++;                                           //  Increment body count in octant
+    }                                                           // End loop over bodies in block
+  }
+
+  //! Sort a block of bodies by octant
+  void moveBodies(Body * bodies, Body * buffer, int begin, int end, real_t * X, int * counter) {
+    real_t x[3];                                                // Coordinates of bodies
+    for (int i=begin; i<end; i++) {                             // Loop over bodies in block
+      for (int d=0; d<3; d++) x[d] = bodies[i].X[d];            //  Position of body
+      int octant = (x[0] > X[0]) + ((x[1] > X[1]) << 1) + ((x[2] > X[2]) << 2);// Which octant body belongs to
+      for (int d=0; d<3; d++) buffer[counter[octant]].X[d] = bodies[i].X[d];// Permute bodies coordinates out-of-place according to octant
+      for (int k=0; k<NRHS; k++) charge(buffer[counter[octant]], k) = charge(bodies[i], k);// Permute bodies sources out-of-place
+      buffer[counter[octant]].IBODY = bodies[i].IBODY;          //  Permute bodies numbering out-of-place according to octant
+      counter[octant]++;                                        //  Increment body count in octant
+    }                                                           // End loop over bodies in block
+  }
+
+  //! Build nodes of tree adaptively using a top-down approach based on recursion
+  Node * buildNodes(Body * bodies, Body * buffer, int begin, int end,
+                    real_t * X, real_t R, int ncrit, int level=0, bool direction=false) {
+    //! Create a tree node
+    Node * node = new Node;                                     // Allocate node in the memory of this task
+    node->IBODY = begin;                                        // Index of first body in node
+    node->NBODY = end - begin;                                  // Number of bodies in node
+    node->NNODE = 1;                                            // Initialize counter for descendant nodes
+    for (int i=0; i<8; i++) node->CHILD[i] = NULL;              // Initialize pointers of child nodes
+    for (int d=0; d<3; d++) node->X[d] = X[d];                  // Center position of node
+    //! If node is a leaf
     if (end - begin <= ncrit) {                                 // If number of bodies is less than threshold
       if (direction) {                                          //  If direction of data is from bodies to buffer
-        for (int i=begin; i<end; i++) {                         //   Loop over bodies in cell
+        for (int i=begin; i<end; i++) {                         //   Loop over bodies in node
           for (int d=0; d<3; d++) buffer[i].X[d] = bodies[i].X[d];//  Copy bodies coordinates to buffer
-          buffer[i].q = bodies[i].q;                            //    Copy bodies source to buffer
-        }                                                       //   End loop over bodies in cell
+          for (int k=0; k<NRHS; k++) charge(buffer[i], k) = charge(bodies[i], k);// Copy bodies sources to buffer
+          buffer[i].IBODY = bodies[i].IBODY;                    //    Copy bodies numbering to buffer
+        }                                                       //   End loop over bodies in node
       }                                                         //  End if for direction of data
-      return;                                                   //  Return without recursion
+      return node;                                              //  Return without recursion
     }                                                           // End if for number of bodies
-    //! Count number of bodies in each octant
-    int size[8] = {0,0,0,0,0,0,0,0};
-    real_t x[3];                                                // Coordinates of bodies
-    for (int i=begin; i<end; i++) {                             // Loop over bodies in cell
-      for (int d=0; d<3; d++) x[d] = bodies[i].X[d];            //  Position of body
-      int octant = (x[0] > X[0]) + ((x[1] > X[1]) << 1) + ((x[2] > X[2]) << 2);// Which octant body belongs to
-      size[octant]++;                                           //  Increment body count in octant
-    }                                                           // End loop over bodies in cell
+    //! Count number of bodies in each octant, one task per block of nspawn bodies
+    int nblock = (end - begin - 1) / nspawn + 1;                // Number of blocks of bodies
+    std::vector<int> sizes(8 * nblock);                         // Body count in each octant of each block
+    for (int b=0; b<nblock; b++) {                              // Loop over blocks
+#pragma omp task shared(sizes) if(nblock > 1)                   //  Start OpenMP task if there are several blocks
+      countBodies(bodies, begin+b*nspawn, std::min(begin+(b+1)*nspawn, end), X, &sizes[8*b]);
+    }                                                           // End loop over blocks
+#pragma omp taskwait                                            // Synchronize OpenMP tasks
     //! Exclusive scan to get offsets
+    int size[8] = {0,0,0,0,0,0,0,0};                            // Body count in each octant
+    for (int b=0; b<nblock; b++) {                              // Loop over blocks
+      for (int i=0; i<8; i++) size[i] += sizes[8*b+i];          //  Accumulate body count in octant
+    }                                                           // End loop over blocks
     int offset = begin;                                         // Offset of first octant
-    int offsets[8], counter[8];                                 // Offsets and counter for each octant
+    int offsets[8];                                             // Offsets for each octant
     for (int i=0; i<8; i++) {                                   // Loop over elements
       offsets[i] = offset;                                      //  Set value
       offset += size[i];                                        //  Increment offset
-      if (size[i]) cell->NCHILD++;                              //  Increment child cell counter
     }                                                           // End loop over elements
-    //! Sort bodies by octant
-    for (int i=0; i<8; i++) counter[i] = offsets[i];            // Copy offsets to counter
-    for (int i=begin; i<end; i++) {                             // Loop over bodies
-      for (int d=0; d<3; d++) x[d] = bodies[i].X[d];            //  Position of body
-      int octant = (x[0] > X[0]) + ((x[1] > X[1]) << 1) + ((x[2] > X[2]) << 2);// Which octant body belongs to`
-      for (int d=0; d<3; d++) buffer[counter[octant]].X[d] = bodies[i].X[d];// Permute bodies coordinates out-of-place according to octant
-      buffer[counter[octant]].q = bodies[i].q;                  //  Permute bodies sources out-of-place according to octant
-      counter[octant]++;                                        //  Increment body count in octant
-    }                                                           // End loop over bodies
+    for (int i=0; i<8; i++) {                                   // Loop over octants
+      int counter = offsets[i];                                 //  Offset of first block in octant
+      for (int b=0; b<nblock; b++) {                            //  Loop over blocks
+        int count = sizes[8*b+i];                               //   Body count of block in octant
+        sizes[8*b+i] = counter;                                 //   Replace count with offset of block in octant
+        counter += count;                                       //   Increment offset
+      }                                                         //  End loop over blocks
+    }                                                           // End loop over octants
+    //! Sort bodies by octant, one task per block of nspawn bodies
+    for (int b=0; b<nblock; b++) {                              // Loop over blocks
+#pragma omp task shared(sizes) if(nblock > 1)                   //  Start OpenMP task if there are several blocks
+      moveBodies(bodies, buffer, begin+b*nspawn, std::min(begin+(b+1)*nspawn, end), X, &sizes[8*b]);
+    }                                                           // End loop over blocks
+#pragma omp taskwait                                            // Synchronize OpenMP tasks
     //! Loop over children and recurse
-    real_t Xchild[3];                                           // Coordinates of children
-    cells.resize(cells.size()+cell->NCHILD);                    // Resize cell vector
-    Cell * child = &cells.back() - cell->NCHILD + 1;            // Pointer for first child cell
-    cell->CHILD = child;                                        // Point to first child cell
-    int c = 0;                                                  // Counter for child cells
     for (int i=0; i<8; i++) {                                   // Loop over children
-      for (int d=0; d<3; d++) Xchild[d] = X[d];                 //  Initialize center position of child cell
-      real_t r = R / (1 << (level + 1));                        //  Radius of cells for child's level
-      for (int d=0; d<3; d++) {                                 //  Loop over dimensions
-        Xchild[d] += r * (((i & 1 << d) >> d) * 2 - 1);         //   Shift center position to that of child cell
-      }                                                         //  End loop over dimensions
       if (size[i]) {                                            //  If child exists
-        buildCells(buffer, bodies, offsets[i], offsets[i] + size[i],// Recursive call for each child
-                   &child[c], cells, Xchild, R, level+1, !direction);
-        c++;                                                    //   Increment child cell counter
+        real_t Xchild[3];                                       //   Coordinates of child
+        real_t r = R / (1 << (level + 1));                      //   Radius of cells for child's level
+        for (int d=0; d<3; d++) {                               //   Loop over dimensions
+          Xchild[d] = X[d] + r * (((i & 1 << d) >> d) * 2 - 1); //    Shift center position to that of child node
+        }                                                       //   End loop over dimensions
+#pragma omp task untied if(size[i] > nspawn)                    //   Start OpenMP task if large enough task
+        node->CHILD[i] = buildNodes(buffer, bodies, offsets[i], offsets[i] + size[i],// Recursive call for each child
+                                    Xchild, R, ncrit, level+1, !direction);
       }                                                         //  End if for child
     }                                                           // End loop over children
+#pragma omp taskwait                                            // Synchronize OpenMP tasks
+    for (int i=0; i<8; i++) {                                   // Loop over children
+      if (node->CHILD[i]) node->NNODE += node->CHILD[i]->NNODE; //  Accumulate number of descendant nodes
+    }                                                           // End loop over children
+    return node;                                                // Return node
   }
 
-  Cells buildTree(Bodies & bodies) {
+  //! Convert nodes to cells of tree recursively, and free the nodes
+  void nodes2cells(Node * node, Cell * cell, Cell * child, Body * bodies, real_t R, int level=0) {
+    cell->BODY = bodies + node->IBODY;                          // Pointer of first body in cell
+    cell->NBODY = node->NBODY;                                  // Number of bodies in cell
+    cell->NCHILD = 0;                                           // Initialize counter for child cells
+    cell->CHILD = child;                                        // Pointer of first child cell
+    for (int d=0; d<3; d++) cell->X[d] = node->X[d];            // Center position of cell
+    cell->R = R / (1 << level);                                 // Cell radius
+    cell->R0 = cell->R;                                         // Cell radius when tree was built
+    for (int i=0; i<8; i++) {                                   // Loop over child nodes
+      if (node->CHILD[i]) cell->NCHILD++;                       //  Increment child cell counter
+    }                                                           // End loop over child nodes
+    Cell * grandchild = child + cell->NCHILD;                   // Pointer of first grandchild cell
+    for (int i=0; i<8; i++) {                                   // Loop over child nodes
+      Node * n = node->CHILD[i];                                //  Pointer of child node
+      if (n) {                                                  //  If child exists
+        int nnode = n->NNODE;                                   //   Number of cells in child's subtree
+#pragma omp task untied if(n->NBODY > nspawn)                   //   Start OpenMP task if large enough task
+        nodes2cells(n, child, grandchild, bodies, R, level+1);  //   Recursive call for each child
+        child++;                                                //   Increment child cell pointer
+        grandchild += nnode - 1;                                //   Skip cells of child's subtree
+      }                                                         //  End if for child
+    }                                                           // End loop over child nodes
+#pragma omp taskwait                                            // Synchronize OpenMP tasks
+    delete node;                                                // Free node
+  }
+
+  //! Split cells among threads by the bodies of their leafs, and move cells and bodies into blocks that each thread
+  //! touched first for its own range, so the cells and bodies of a subtree lie on the socket of the thread that owns it
+  void placeTree(Cells & cells, Bodies & bodies) {
+    int ncell = cells.size();                                   // Number of cells
+    partition(ncell, omp_get_max_threads(), [&](int i) {        // Split cells among threads
+      return cells[i].NCHILD == 0 ? cells[i].NBODY : 0;         //  By bodies of leafs
+    }, cells.owners);
+    Cells placed;                                               // Cells in the pages of their owners
+    Bodies sorted;                                              // Bodies in the pages of their owners
+    allocateUntouched(placed, ncell);                           // Allocate cells without writing them
+    allocateUntouched(sorted, bodies.size());                   // Allocate bodies without writing them
+    int nrange = cells.owners.size() - 1;                       // Number of ranges
+#pragma omp parallel                                            // Start OpenMP
+    for (int r=omp_get_thread_num(); r<nrange; r+=omp_get_num_threads()) {// Loop over ranges of this thread
+      for (int i=cells.owners[r]; i<cells.owners[r+1]; i++) {   //  Loop over cells of range
+        Cell * C = &placed[i];                                  //   Placed cell
+        *C = cells[i];                                          //   Copy cell
+        C->CHILD = &placed[0] + (cells[i].CHILD - &cells[0]);   //   Point to placed children
+        C->BODY = &sorted[0] + (cells[i].BODY - &bodies[0]);    //   Point to placed bodies
+        if (C->NCHILD != 0) continue;                           //   Skip bodies of cells that are not leafs
+        for (int b=0; b<C->NBODY; b++) C->BODY[b] = cells[i].BODY[b];// Copy bodies of leaf
+      }                                                         //  End loop over cells of range
+    }                                                           // End loop over ranges
+    cells.swap(placed);                                         // Placed cells replace cells, keeping ranges of threads
+    bodies.swap(sorted);                                        // Placed bodies replace bodies
+  }
+
+  //! Build tree in parallel; nodes are built first, since the final cell layout depends on subtree sizes
+  //! Cells and sorted bodies are then moved to the pages of the threads that own them
+  Cells buildTree(Bodies & bodies, const FMM & fmm) {
     real_t R0, X0[3];                                           // Radius and center root cell
     getBounds(bodies, R0, X0);                                  // Get bounding box from bodies
-    Bodies buffer = bodies;                                     // Copy bodies to buffer
-    Cells cells(1);                                             // Vector of cells
-    cells.reserve(bodies.size());                               // Reserve memory space
-    buildCells(&bodies[0], &buffer[0], 0, bodies.size(), &cells[0], cells, X0, R0);// Build tree recursively
-    return cells;                                               // Return pointer of root cell
+    Bodies buffer(bodies);                                      // Copy of bodies to sort into
+    Node * root;                                                // Root node
+#pragma omp parallel                                            // Start OpenMP
+#pragma omp single nowait                                       // Start OpenMP single region with nowait
+    root = buildNodes(&buffer[0], &bodies[0], 0, bodies.size(), X0, R0, fmm.ncrit);// Build nodes recursively
+    bodies.swap(buffer);                                        // Sorted bodies replace bodies
+    Cells cells(root->NNODE);                                   // Cells of tree
+#pragma omp parallel                                            // Start OpenMP
+#pragma omp single nowait                                       // Start OpenMP single region with nowait
+    nodes2cells(root, &cells[0], &cells[0]+1, &bodies[0], R0);  // Convert nodes to cells recursively
+    placeTree(cells, bodies);                                   // Move cells and bodies to their owners
+    cells.tree = newTree();                                     // New identity of tree
+    return cells;                                               // Return vector of cells
+  }
+
+  //! Scatter potential and force of bodies back to their initial order given by IBODY, with NRHS values per body
+  void scatterBodies(Bodies & bodies, real_t * p, real_t * F) {
+#pragma omp parallel for
+    for (size_t b=0; b<bodies.size(); b++) {                    // Loop over bodies in tree order
+      int i = bodies[b].IBODY;                                  //  Initial index of body
+      for (int k=0; k<NRHS; k++) {                              //  Loop over right-hand sides
+        p[NRHS*i+k] = potential(bodies[b], k);                  //   Copy potential to initial order
+        for (int d=0; d<3; d++) F[3*(NRHS*i+k)+d] = force(bodies[b], k)[d];// Copy force to initial order
+      }                                                         //  End loop over right-hand sides
+    }                                                           // End loop over bodies
+  }
+
+  //! Refit cells bottom-up to current body positions, and return max ratio of radius to built radius
+  real_t refitCells(Cell * C) {
+    real_t Xmin[3], Xmax[3];                                    // Min, max of cell
+    if (C->NCHILD == 0) {                                       // If cell is a leaf
+      for (int d=0; d<3; d++) Xmin[d] = Xmax[d] = C->BODY[0].X[d];//  Initialize Xmin, Xmax
+      for (Body * B=C->BODY; B!=C->BODY+C->NBODY; B++) {        //  Loop over bodies in cell
+        for (int d=0; d<3; d++) Xmin[d] = fmin(B->X[d], Xmin[d]);//   Update Xmin
+        for (int d=0; d<3; d++) Xmax[d] = fmax(B->X[d], Xmax[d]);//   Update Xmax
+      }                                                         //  End loop over bodies in cell
+    }                                                           // End if for leaf
+    real_t growth[8] = {0,0,0,0,0,0,0,0};                       // Radius growth of child cells
+    for (int i=0; i<C->NCHILD; i++) {                           // Loop over child cells
+#pragma omp task untied shared(growth) if(C->CHILD[i].NBODY > 100)//  Start OpenMP task if large enough task
+      growth[i] = refitCells(&C->CHILD[i]);                     //  Recursive call for child cell
+    }                                                           // End loop over child cells
+#pragma omp taskwait                                            // Synchronize OpenMP tasks
+    real_t maxGrowth = 0;                                       // Max radius growth in subtree
+    for (int i=0; i<C->NCHILD; i++) {                           // Loop over child cells
+      Cell * Cc = &C->CHILD[i];                                 //  Pointer of child cell
+      if (i == 0) for (int d=0; d<3; d++) Xmin[d] = Xmax[d] = Cc->X[d];// Initialize Xmin, Xmax
+      for (int d=0; d<3; d++) Xmin[d] = fmin(Cc->X[d] - Cc->R, Xmin[d]);// Update Xmin
+      for (int d=0; d<3; d++) Xmax[d] = fmax(Cc->X[d] + Cc->R, Xmax[d]);// Update Xmax
+      maxGrowth = fmax(growth[i], maxGrowth);                   //  Update max radius growth
+    }                                                           // End loop over child cells
+    for (int d=0; d<3; d++) C->X[d] = (Xmax[d] + Xmin[d]) / 2;  // Center of bounding box
+    C->R = 0;                                                   // Initialize cell radius
+    for (int d=0; d<3; d++) C->R = fmax((Xmax[d] - Xmin[d]) / 2, C->R);// Radius of bounding box
+    return fmax(C->R / C->R0, maxGrowth);                       // Return max radius growth
+  }
+
+  //! Refit tree to moved bodies keeping its topology and body order, and rebuild it once radii grow too much
+  bool refitTree(Cells & cells, Bodies & bodies, const FMM & fmm, real_t maxGrowth=1.5) {
+    real_t growth;                                              // Max ratio of radius to built radius
+#pragma omp parallel                                            // Start OpenMP
+#pragma omp single nowait                                       // Start OpenMP single region with nowait
+    growth = refitCells(&cells[0]);                             // Refit cells recursively
+    if (growth <= maxGrowth) {                                  // If quality has not degraded
+      cells.tree = newTree();                                   //  Lists built for the old cells no longer hold
+      return false;                                             //  Keep tree
+    }                                                           // End if for quality
+    cells = buildTree(bodies, fmm);                             // Else rebuild tree
+    return true;                                                // Report rebuild
   }
 }
 
@@ -1,23 +1,158 @@
 #ifndef exafmm_h
 #define exafmm_h
+#include <algorithm>
+#include <atomic>
 #include <complex>
 #include <cstdlib>
 #include <cstdio>
+#include <new>
+#include <utility>
 #include <vector>
+#include <omp.h>
+#if EXAFMM_HUGEPAGE
+#include <sys/mman.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(EXAFMM_DISPATCH)
+#define EXAFMM_DISPATCH 1                                       //!< Dispatch hot kernels on CPU features at runtime
+#endif
+#if EXAFMM_DISPATCH
+#define EXAFMM_CLONES __attribute__((target_clones("avx512f","avx2","default")))
+#else
+#define EXAFMM_CLONES
+#endif
+#ifndef EXAFMM_NRHS
+#define EXAFMM_NRHS 1                                           //!< Number of charge vectors evaluated in one traversal
+#endif
 
 namespace exafmm {
   //! Basic type definitions
   typedef double real_t;                                        //!< Floating point type
   typedef std::complex<real_t> complex_t;                       //!< Complex type
 
+  const int NRHS = EXAFMM_NRHS;                                 //!< Number of right-hand sides
+
+  //! Tag to create an element without writing it, so that the thread that owns it writes it first
+  struct Untouched {};
+
+  //! Allocator of bodies, cells and coefs; EXAFMM_HUGEPAGE backs large blocks with huge pages
+  template<typename T>
+  struct Allocator {
+    typedef T value_type;                                       //!< Type of elements
+    Allocator() {}
+    template<typename U> Allocator(const Allocator<U> &) {}
+
+    //! Allocate n elements, aligned to huge pages if the block spans at least one
+    T * allocate(size_t n) {
+      size_t bytes = n * sizeof(T);                             // Size of block
+      void * p = NULL;                                          // Pointer to block
+#if EXAFMM_HUGEPAGE
+      const size_t hugePage = size_t(2) << 20;                  // Size of huge page
+      if (bytes >= hugePage) {                                  // If block spans a huge page
+        bytes = (bytes + hugePage - 1) / hugePage * hugePage;   //  Round up to whole huge pages
+        if (posix_memalign(&p, hugePage, bytes)) throw std::bad_alloc();// Align to huge page
+        madvise(p, bytes, MADV_HUGEPAGE);                       //  Ask for huge pages before first touch
+        return static_cast<T*>(p);
+      }                                                         // End if for huge page
+#endif
+      p = std::malloc(bytes);                                   // Allocate block
+      if (!p) throw std::bad_alloc();                           // Out of memory
+      return static_cast<T*>(p);
+    }
+
+    void deallocate(T * p, size_t) { std::free(p); }
+
+    //! Leave an element created from the Untouched tag unwritten; bodies, cells and coefs are implicit-lifetime types
+    template<typename U>
+    void construct(U *, Untouched) {}
+
+    template<typename U, typename... Args>
+    void construct(U * p, Args&&... args) { ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+  };
+
+  //! Blocks of any allocator can be freed by any other
+  template<typename T, typename U>
+  bool operator==(const Allocator<T> &, const Allocator<U> &) { return true; }
+  template<typename T, typename U>
+  bool operator!=(const Allocator<T> &, const Allocator<U> &) { return false; }
+
+  //! Split n items into contiguous ranges, one per thread, of about the same cumulative cost; begin gets the first
+  //! item of each range and n at the end. Cells in tree order follow subtrees, so ranges hold whole subtrees
+  template<typename C>
+  void partition(int n, int nthreads, const C & cost, std::vector<int> & begin) {
+    begin.assign(nthreads + 1, n);                              // Ranges past the last item are empty
+    real_t total = 0, sum = 0;                                  // Total cost and cost of items before i
+    for (int i=0; i<n; i++) total += cost(i);                   // Accumulate total cost
+    begin[0] = 0;                                               // First range starts at first item
+    for (int i=0, t=1; i<n && t<nthreads; i++) {                // Loop over items until all ranges have started
+      while (t < nthreads && sum >= total * t / nthreads) begin[t++] = i;// Start ranges whose share is reached
+      sum += cost(i);                                           //  Add cost of item
+    }                                                           // End loop over items
+  }
+
+  //! Clear n elements that were allocated untouched, so each page is placed on the socket of the thread that owns it
+  //! Element i belongs to item i / stride and thread t owns the items from owners[t] to owners[t+1]; without owners
+  //! each thread owns one static chunk. Ownership only holds across passes if threads are pinned (see README)
+  template<typename T>
+  void firstTouch(T * data, size_t n, const std::vector<int> & owners=std::vector<int>(), size_t stride=1) {
+    if (owners.empty()) {                                       // If no thread owns the items
+#pragma omp parallel for schedule(static)
+      for (size_t i=0; i<n; i++) data[i] = T();                 //  Clear element in the thread of its chunk
+      return;
+    }                                                           // End if for owners
+    int nrange = owners.size() - 1;                             // Number of ranges
+#pragma omp parallel                                            // Start OpenMP
+    for (int r=omp_get_thread_num(); r<nrange; r+=omp_get_num_threads()) {// Loop over ranges of this thread
+      for (size_t i=owners[r]*stride; i<owners[r+1]*stride; i++) data[i] = T();// Clear element in the thread that owns it
+    }                                                           // End loop over ranges
+  }
+
+  //! Replace v by n elements that are left unwritten, so that the threads that own them write them first and the OS
+  //! places their pages on the socket of those threads; the caller must write every element
+  template<typename V>
+  void allocateUntouched(V & v, size_t n) {
+    V block;                                                    // New block
+    block.reserve(n);                                           // Allocate block
+    for (size_t i=0; i<n; i++) block.emplace_back(Untouched()); // Create elements without writing them
+    v.swap(block);                                              // Replace v by block
+  }
+
   //! Structure of bodies
   struct Body {
     real_t X[3];                                                //!< Position
+#if EXAFMM_NRHS > 1
+    real_t q[NRHS];                                             //!< Charge of each right-hand side
+    real_t p[NRHS];                                             //!< Potential of each right-hand side
+    real_t F[NRHS][3];                                          //!< Force of each right-hand side
+#else
     real_t q;                                                   //!< Charge
     real_t p;                                                   //!< Potential
     real_t F[3];                                                //!< Force
+#endif
+    int IBODY;                                                  //!< Initial body numbering for sorting back
   };
-  typedef std::vector<Body> Bodies;                             //!< Vector of bodies
+
+  //! Charge, potential and force of right-hand side k of a body, so that kernels are written once for any NRHS
+#if EXAFMM_NRHS > 1
+  inline real_t & charge(Body & B, int k) { return B.q[k]; }
+  inline real_t & potential(Body & B, int k) { return B.p[k]; }
+  inline real_t * force(Body & B, int k) { return B.F[k]; }
+#else
+  inline real_t & charge(Body & B, int) { return B.q; }
+  inline real_t & potential(Body & B, int) { return B.p; }
+  inline real_t * force(Body & B, int) { return B.F; }
+#endif
+  typedef std::vector<Body, Allocator<Body> > Bodies;           //!< Vector of bodies
+
+  //! Outputs of an evaluation
+  enum {
+    POTENTIAL = 1,                                              //!< Potential
+    FORCE = 2                                                   //!< Force
+  };
+
+  //! Tag that specializes the P2P and L2P kernels at compile time for a combination o of outputs
+  template<int o>
+  struct Output {};
 
   //! Structure of cells
   struct Cell {
@@ -27,21 +162,66 @@ namespace exafmm {
     Body * BODY;                                                //!< Pointer of first body
     real_t X[3];                                                //!< Cell center
     real_t R;                                                   //!< Cell radius
+    real_t R0;                                                  //!< Cell radius when tree was built
+    real_t COST;                                                //!< Estimated cost of interactions of the subtree as targets
+    complex_t * M;                                              //!< Multipole expansion coefs
+    complex_t * L;                                              //!< Local expansion coefs
+  };
+
+  //! New identity of a tree, distinct from the identities of all earlier trees
+  inline long newTree() {
+    static std::atomic<long> count(0);                          // Number of identities handed out
+    return ++count;                                             // Next identity
+  }
+
+  //! Vector of cells, which also owns the expansion coefs of all its cells in one block
+  //! Thread t owns the cells from owners[t] to owners[t+1], which it touched first along with their bodies and coefs;
+  //! every pass runs the work of a cell in its owner first
+  struct Cells : public std::vector<Cell, Allocator<Cell> > {
+    using std::vector<Cell, Allocator<Cell> >::vector;          //!< Constructors of vector of cells
+    std::vector<complex_t, Allocator<complex_t> > coefs;        //!< Multipole and local coefs of all cells, touched first by their owners
+    std::vector<int> owners;                                    //!< First cell of the range of each thread, empty if no thread owns them
+    long tree = 0;                                              //!< Identity of the tree, renewed by buildTree and refitTree, 0 for no tree
+
+    //! Thread whose range holds cell C, -1 if no thread owns C or it is not a cell of this vector
+    int owner(const Cell * C) const {
+      if (owners.empty() || C < data() || C >= data() + size()) return -1;// Cell of another tree or a copy
+      return std::upper_bound(owners.begin(), owners.end(), int(C - data())) - owners.begin() - 1;
+    }
+  };
+
+#if EXAFMM_LAZY
+  //! Interaction lists of all target cells in CSR format with source cell indices
+  struct Lists {
+    std::vector<int> offsetM2L;                                 //!< Offset of M2L list of each target cell
+    std::vector<int> listM2L;                                   //!< M2L source cell indices
+    std::vector<int> offsetP2P;                                 //!< Offset of P2P list of each target cell
+    std::vector<int> listP2P;                                   //!< P2P source cell indices
+    long itree = 0;                                             //!< Identity of the target tree the lists were built for
+    long jtree = 0;                                             //!< Identity of the source tree the lists were built for
+    int ncrit = 0;                                              //!< Number of bodies per leaf cell of the tree
+    real_t skin = 0;                                            //!< Skin margin the lists were built with
+    std::vector<real_t> Xi0;                                    //!< Target body positions when lists were built
+    std::vector<real_t> Xj0;                                    //!< Source body positions when lists were built
+  };
+#endif
+
+  //! Parameters, kernel tables and interaction lists of one FMM solve
+  struct FMM {
+    int P = 10;                                                 //!< Order of expansions
+    int NTERM = 0;                                              //!< Number of coefficients of one right-hand side
+    int ncrit = 64;                                             //!< Number of bodies per leaf cell
+    real_t theta = .4;                                          //!< Multipole acceptance criterion
+    int output = POTENTIAL | FORCE;                             //!< Outputs to evaluate
+    real_t eps = 0;                                             //!< Tolerance of M2L truncation (0 runs every M2L at P)
+    std::vector<real_t> factorial;                              //!< Factorials up to 2P-1
+    std::vector<real_t> Anm;                                    //!< sqrt((n+m)! (n-m)!) to normalize coefs for rotations
+    std::vector<real_t> octantD;                                //!< Wigner d-matrices of the eight diagonal directions
+    std::vector<complex_t> octantEim;                           //!< exp(i m phi) of the eight diagonal directions
 #if EXAFMM_LAZY
-    std::vector<Cell*> listM2L;                                 //!< M2L interaction list
-    std::vector<Cell*> listP2P;                                 //!< P2P interaction list
+    real_t skin = 0;                                            //!< Verlet skin for reusing interaction lists
+    Lists lists;                                                //!< Interaction lists of the last horizontal pass
 #endif
-    std::vector<complex_t> M;                                   //!< Multipole expansion coefs
-    std::vector<complex_t> L;                                   //!< Local expansion coefs
   };
-  typedef std::vector<Cell> Cells;                              //!< Vector of cells
-
-  //! Global variables
-  int P;                                                        //!< Order of expansions
-  int NTERM;                                                    //!< Number of coefficients
-  int ncrit;                                                    //!< Number of bodies per leaf cell
-  real_t theta;                                                 //!< Multipole acceptance criterion
-  real_t dX[3];                                                 //!< Distance vector
-#pragma omp threadprivate(dX)                                   //!< Make global variables private
 }
 #endif
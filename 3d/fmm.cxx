@@ -1,4 +1,7 @@
 #include "build_tree.h"
+#if EXAFMM_KEY
+#include "build_tree_key.h"
+#endif
 #include "kernel.h"
 #include "timer.h"
 #if EXAFMM_EAGER
@@ -6,15 +9,23 @@
 #elif EXAFMM_LAZY
 #include "traverse_lazy.h"
 #endif
+#if EXAFMM_AUTOTUNE
+#include "autotune.h"
+#endif
+#if EXAFMM_ACCURACY
+#include "accuracy.h"
+#endif
 using namespace exafmm;
 
 int main(int argc, char ** argv) {
-  const int numBodies = 10000;                                  // Number of bodies
-  P = 10;                                                       // Order of expansions
-  ncrit = 64;                                                   // Number of bodies per leaf cell
-  theta = 0.4;                                                  // Multipole acceptance criterion
+  const int numBodies = argc > 1 ? atoi(argv[1]) : 10000;       // Number of bodies
+  FMM fmm;                                                      // Parameters and tables of this solve
+  fmm.P = 10;                                                   // Order of expansions
+  fmm.ncrit = 64;                                               // Number of bodies per leaf cell
+  fmm.theta = 0.4;                                              // Multipole acceptance criterion
 
   printf("--- %-16s ------------\n", "FMM Profiling");          // Start profiling
+  printf("%-20s : %s\n", "SIMD", simdVariant());                // Print dispatched kernel variant
   //! Initialize bodies
   start("Initialize bodies");                                   // Start timer
   Bodies bodies(numBodies);                                     // Initialize bodies
@@ -28,29 +39,103 @@ int main(int argc, char ** argv) {
     average += bodies[b].q;                                     //  Accumulate charge
     bodies[b].p = 0;                                            //  Clear potential
     for (int d=0; d<3; d++) bodies[b].F[d] = 0;                 //  Clear force
+    bodies[b].IBODY = b;                                        //  Initial body numbering
   }                                                             // End loop over bodies
   average /= bodies.size();                                     // Average charge
   for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
     bodies[b].q -= average;                                     // Charge neutral
   }                                                             // End loop over bodies
   stop("Initialize bodies");                                    // Stop timer
+#if EXAFMM_AUTOTUNE
+  start("Autotune ncrit");                                      // Start timer
+  initKernel(fmm);                                              // Initialize kernel
+  fmm.ncrit = tuneNcrit(bodies, fmm);                           // Tune ncrit with trial evaluations
+  stop("Autotune ncrit");                                       // Stop timer
+  printf("%-20s : %d\n", "ncrit", fmm.ncrit);                   // Print tuned ncrit
+#endif
 
   //! Build tree
   start("Build tree");                                          // Start timer
-  Cells cells = buildTree(bodies);                              // Build tree
+#if EXAFMM_KEY
+  Cells cells = buildTreeKey(bodies, fmm);                      // Build tree from sorted keys
+#else
+  Cells cells = buildTree(bodies, fmm);                         // Build tree
+#endif
   stop("Build tree");                                           // Stop timer
+#if EXAFMM_ACCURACY
+  start("Select theta & P");                                    // Start timer
+  const real_t tolerance = 1e-5;                                // Relative error tolerance of potential
+  if (!selectAccuracy(cells, fmm, tolerance)) {                 // Choose theta and P of least cost for tolerance
+    fprintf(stderr, "Warning: tolerance %g is out of reach, using the most accurate theta and P\n", tolerance);
+  }                                                             // End if for unreachable tolerance
+  stop("Select theta & P");                                     // Stop timer
+  printf("%-20s : %g\n", "theta", fmm.theta);                   // Print selected theta
+  printf("%-20s : %d\n", "P", fmm.P);                           // Print selected order
+#endif
 
   //! FMM evaluation
+#if EXAFMM_DATAFLOW
+  start("Dataflow FMM");                                        // Start timer
+  initKernel(fmm);                                              // Initialize kernel
+  dataflowPass(cells, fmm);                                     // All passes as one graph of tasks
+  stop("Dataflow FMM");                                         // Stop timer
+#else
   start("P2M & M2M");                                           // Start timer
-  initKernel();                                                 // Initialize kernel
-  upwardPass(cells);                                            // Upward pass for P2M, M2M
+  initKernel(fmm);                                              // Initialize kernel
+  upwardPass(cells, fmm);                                       // Upward pass for P2M, M2M
   stop("P2M & M2M");                                            // Stop timer
   start("M2L & P2P");                                           // Start timer
-  horizontalPass(cells, cells);                                 // Horizontal pass for M2L, P2P
+  horizontalPass(cells, cells, fmm);                            // Horizontal pass for M2L, P2P
   stop("M2L & P2P");                                            // Stop timer
   start("L2L & L2P");                                           // Start timer
-  downwardPass(cells);                                          // Downward pass for L2L, L2P
+  downwardPass(cells, fmm);                                     // Downward pass for L2L, L2P
   stop("L2L & L2P");                                            // Stop timer
+#endif
+#if EXAFMM_ACCURACY
+  start("Error estimate");                                      // Start timer
+  real_t estimate = sampleError(bodies, 100);                   // Error at sampled bodies
+  stop("Error estimate");                                       // Stop timer
+#endif
+
+  //! FMM at probe points with a target tree of their own
+  start("Build probe tree");                                    // Start timer
+  const int numGrid = 10;                                       // Number of probe points per dimension
+  Bodies probes(numGrid * numGrid * numGrid);                   // Probe points on a grid
+  for (size_t b=0; b<probes.size(); b++) {                      // Loop over probes
+    int ix[3] = {int(b % numGrid), int(b / numGrid % numGrid), int(b / numGrid / numGrid)};// Grid index
+    for (int d=0; d<3; d++) {                                   //  Loop over dimension
+      probes[b].X[d] = (ix[d] + .5) * 2 * M_PI / numGrid - M_PI;//   Initialize positions
+    }                                                           //  End loop over dimension
+    probes[b].q = 0;                                            //  Probes carry no charge
+    probes[b].p = 0;                                            //  Clear potential
+    for (int d=0; d<3; d++) probes[b].F[d] = 0;                 //  Clear force
+    probes[b].IBODY = b;                                        //  Initial probe numbering
+  }                                                             // End loop over probes
+#if EXAFMM_KEY
+  Cells pcells = buildTreeKey(probes, fmm);                     // Build probe tree from sorted keys
+#else
+  Cells pcells = buildTree(probes, fmm);                        // Build probe tree
+#endif
+  stop("Build probe tree");                                     // Stop timer
+  start("Probe evaluation");                                    // Start timer
+  initTargets(pcells, fmm);                                     // Clear local coefs of probe tree
+  horizontalPass(pcells, cells, fmm);                           // Horizontal pass for M2L, P2P to probes
+  downwardPass(pcells, fmm);                                    // Downward pass for L2L, L2P to probes
+  stop("Probe evaluation");                                     // Stop timer
+  const int numProbes = 10;                                     // Number of probes for checking answer
+  Bodies probes2(numProbes);                                    // Sampled probes for direct summation
+  for (int b=0; b<numProbes; b++) {                             // Loop over probe samples
+    probes2[b] = probes[b*(probes.size()/numProbes)];           //  Sample probes
+    probes2[b].p = 0;                                           //  Clear potential
+    for (int d=0; d<3; d++) probes2[b].F[d] = 0;                //  Clear force
+  }                                                             // End loop over probe samples
+  direct(probes2, bodies);                                      // Direct summation to sampled probes
+  real_t probeDif = 0, probeNrm = 0;
+  for (int b=0; b<numProbes; b++) {                             // Loop over probe samples
+    const Body & B = probes[b*(probes.size()/numProbes)];       //  Probe evaluated by FMM
+    probeDif += (B.p - probes2[b].p) * (B.p - probes2[b].p);    //  Difference of potential
+    probeNrm += probes2[b].p * probes2[b].p;                    //  Value of potential
+  }                                                             // End loop over probe samples
 
   //! Direct N-Body
   start("Direct N-Body");                                       // Start timer
@@ -83,5 +168,9 @@ int main(int argc, char ** argv) {
   printf("--- %-16s ------------\n", "FMM vs. direct");         // Print message
   printf("%-20s : %8.5e s\n","Rel. L2 Error (p)", sqrt(pDif/pNrm));// Print potential error
   printf("%-20s : %8.5e s\n","Rel. L2 Error (F)", sqrt(FDif/FNrm));// Print force error
+  printf("%-20s : %8.5e s\n","Probe L2 Error (p)", sqrt(probeDif/probeNrm));// Print potential error at probes
+#if EXAFMM_ACCURACY
+  printf("%-20s : %8.5e s\n","Est. L2 Error (p)", estimate);    // Print sampled error estimate
+#endif
   return 0;
 }
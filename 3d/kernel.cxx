@@ -2,14 +2,16 @@
 using namespace exafmm;
 
 int main(int argc, char ** argv) {
-  P = atoi(argv[1]);
-  initKernel();
+  FMM fmm;
+  fmm.P = atoi(argv[1]);
+  initKernel(fmm);
 
   // P2M
   Bodies jbodies(1);
   for (int d=0; d<3; d++) jbodies[0].X[d] = 2;
   jbodies[0].q = 1;
   Cells cells(4);
+  initCoefs(cells, fmm);
   Cell * Cj = &cells[0];
   Cj->X[0] = 3;
   Cj->X[1] = 1;
@@ -17,8 +19,7 @@ int main(int argc, char ** argv) {
   Cj->R = 1;
   Cj->BODY = &jbodies[0];
   Cj->NBODY = jbodies.size();
-  Cj->M.resize(NTERM, 0.0);
-  P2M(Cj);
+  P2M(Cj, fmm);
 
   // M2M
   Cell * CJ = &cells[1];
@@ -28,8 +29,7 @@ int main(int argc, char ** argv) {
   CJ->X[1] = 0;
   CJ->X[2] = 0;
   CJ->R = 2;
-  CJ->M.resize(NTERM, 0.0);
-  M2M(CJ);
+  M2M(CJ, fmm);
 
   // M2L
   Cell * CI = &cells[2];
@@ -37,8 +37,7 @@ int main(int argc, char ** argv) {
   CI->X[1] = 0;
   CI->X[2] = 0;
   CI->R = 2;
-  CI->L.resize(NTERM, 0.0);
-  M2L(CI, CJ);
+  M2L(CI, CJ, fmm);
 
   // L2L
   Cell * Ci = &cells[3];
@@ -48,8 +47,7 @@ int main(int argc, char ** argv) {
   Ci->X[1] = 1;
   Ci->X[2] = 1;
   Ci->R = 1;
-  Ci->L.resize(NTERM, 0.0);
-  L2L(CI);
+  L2L(CI, fmm);
 
   // L2P
   Bodies bodies(1);
@@ -61,7 +59,7 @@ int main(int argc, char ** argv) {
   for (int d=0; d<3; d++) bodies[0].F[d] = 0;
   Ci->BODY = &bodies[0];
   Ci->NBODY = bodies.size();
-  L2P(Ci);
+  L2P(Ci, fmm);
 
   // P2P
   Bodies bodies2(1);
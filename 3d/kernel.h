@@ -1,9 +1,20 @@
 #ifndef kernel_h
 #define kernel_h
+#include <algorithm>
+#include <cfloat>
+#include <omp.h>
 #include "exafmm.h"
+#if EXAFMM_DISPATCH
+#include <immintrin.h>
+#endif
 
 namespace exafmm {
   const complex_t I(0.,1.);                                     //!< Imaginary unit
+  const int nblock = 256;                                       //!< Number of source bodies gathered at once in P2P
+  const int NSIMD = 8;                                          //!< Padding of source blocks for the widest SIMD variant
+  const real_t costSpawn = 1e5;                                 //!< Least estimated cost of a task in P2P body pairs, which amortizes its overhead
+  const int taskPerThread = 16;                                 //!< Number of tasks per thread that a pass is split into
+  const int bodySpawn = 100;                                    //!< Least number of target bodies of a task of a tree walk
 
   //!< L2 norm of vector X
   inline real_t norm(real_t * X) {
@@ -11,12 +22,12 @@ namespace exafmm {
   }
 
   //! Odd or even
-  inline int oddOrEven(int n) {
+  constexpr int oddOrEven(int n) {
     return (((n) & 1) == 1) ? -1 : 1;                           // Odd: -1, Even: 1
   }
 
   //! i^2n
-  inline int ipow2n(int n) {
+  constexpr int ipow2n(int n) {
     return (n >= 0) ? 1 : oddOrEven(n);                         // i^2n
   }
 
@@ -39,8 +50,11 @@ namespace exafmm {
       - std::sin(theta) / r * spherical[1];
   }
 
-  //! Evaluate solid harmonics \f$ r^n Y_{n}^{m} \f$
-  void evalMultipole(real_t rho, real_t alpha, real_t beta, complex_t * Ynm, complex_t * YnmTheta) {
+  //! Evaluate solid harmonics \f$ r^n Y_{n}^{m} \f$, and their theta derivative if force is an output
+  template<int Pt, int o>
+  void evalMultipole(real_t rho, real_t alpha, real_t beta, complex_t * Ynm, complex_t * YnmTheta, const FMM & fmm,
+                     Output<o>) {
+    const int P = Pt ? Pt : fmm.P;                              // Order of expansions, a constant unless Pt is 0
     real_t x = std::cos(alpha);                                 // x = cos(alpha)
     real_t y = std::sin(alpha);                                 // y = sin(alpha)
     real_t invY = y == 0 ? 0 : 1 / y;                           // 1 / y
@@ -57,7 +71,7 @@ namespace exafmm {
       Ynm[nmn] = std::conj(Ynm[npn]);                           //  Use conjugate relation for m < 0
       real_t p1 = p;                                            //  Pnm-1
       p = x * (2 * m + 1) * p1;                                 //  Pnm using recurrence relation
-      YnmTheta[npn] = rhom * (p - (m + 1) * x * p1) * invY * eim; //  theta derivative of r^n * Ynm
+      if constexpr (o & FORCE) YnmTheta[npn] = rhom * (p - (m + 1) * x * p1) * invY * eim;// theta derivative
       rhom *= rho;                                              //  rho^m
       real_t rhon = rhom;                                       //  rho^n
       for (int n=m+1; n<P; n++) {                               //  Loop over n in Ynm
@@ -69,7 +83,7 @@ namespace exafmm {
         real_t p2 = p1;                                         //   Pnm-2
         p1 = p;                                                 //   Pnm-1
         p = (x * (2 * n + 1) * p1 - (n + m) * p2) / (n - m + 1);//   Pnm using recurrence relation
-        YnmTheta[npm] = rhon * ((n - m + 1) * p - (n + 1) * x * p1) * invY * eim;// theta derivative
+        if constexpr (o & FORCE) YnmTheta[npm] = rhon * ((n - m + 1) * p - (n + 1) * x * p1) * invY * eim;// theta derivative
         rhon *= rho;                                            //   Update rho^n
       }                                                         //  End loop over n in Ynm
       rhom /= -(2 * m + 2) * (2 * m + 1);                       //  Update factorial
@@ -80,7 +94,9 @@ namespace exafmm {
   }
 
   //! Evaluate singular harmonics \f$ r^{-n-1} Y_n^m \f$
-  void evalLocal(real_t rho, real_t alpha, real_t beta, complex_t * Ynm) {
+  template<int Pt>
+  void evalLocal(real_t rho, real_t alpha, real_t beta, complex_t * Ynm, const FMM & fmm) {
+    const int P = Pt ? Pt : fmm.P;                              // Order of expansions, a constant unless Pt is 0
     real_t x = std::cos(alpha);                                 // x = cos(alpha)
     real_t y = std::sin(alpha);                                 // y = sin(alpha)
     real_t fact = 1;                                            // Initialize 2 * m + 1
@@ -115,174 +131,884 @@ namespace exafmm {
     }                                                           // End loop over m in Ynm
   }
 
-  void initKernel() {
-    NTERM = P * (P + 1) / 2;                                    // Calculate number of coefficients
+  //! Wigner small d-matrices d^n_{m'm}(beta) for n < P, using Risbo's recursion over half-integer degrees
+  //! Block n starts at n(4n^2-1)/3 and stores d^n_{m'm} at (n-m')(2n+1)+(n-m)
+  template<int Pt>
+  void wignerD(real_t beta, real_t * D, const FMM & fmm) {
+    const int P = Pt ? Pt : fmm.P;                              // Order of expansions, a constant unless Pt is 0
+    const int W = 2 * P;                                        // Row stride of matrices padded with zeros
+    real_t buf[2*W*W], sq[W];                                   // Matrices of previous and current degree
+    real_t c = std::cos(beta / 2);                              // cos(beta / 2)
+    real_t s = std::sin(beta / 2);                              // sin(beta / 2)
+    for (int i=0; i<W; i++) sq[i] = std::sqrt(real_t(i));       // Square roots of integers
+    for (int i=0; i<2*W*W; i++) buf[i] = 0;                     // Zero padding around matrices
+    real_t * d = buf, * d2 = buf + W * W;                       // Old and new matrix
+    d[W+1] = D[0] = 1;                                          // d^0 = 1
+    for (int J=1; J<W-1; J++) {                                 // Loop over twice the degree
+      real_t invJ = real_t(1) / J;                              //  1 / J
+      for (int i=0; i<=J; i++) {                                //  Loop over rows of new matrix
+        real_t * o = d + (i + 1) * W + 1;                       //   Row i of old matrix
+        real_t a = sq[J-i] * invJ, b = sq[i] * invJ;            //   Row weights
+        for (int k=0; k<=J; k++) {                              //   Loop over columns of new matrix
+          d2[(i+1)*W+k+1] = a * (c * sq[J-k] * o[k] - s * sq[k] * o[k-1])
+            + b * (s * sq[J-k] * o[k-W] + c * sq[k] * o[k-W-1]);//    Gather from four old elements
+        }                                                       //   End loop over columns of new matrix
+      }                                                         //  End loop over rows of new matrix
+      std::swap(d, d2);                                         //  Swap new matrix to old
+      if (J % 2 == 0) {                                         //  If degree is an integer
+        int n = J / 2, w = J + 1;                               //   Degree and size of matrix
+        real_t * Dn = D + n * (4 * n * n - 1) / 3;              //   Block of this degree
+        for (int i=0; i<w; i++) {                               //   Loop over rows
+          for (int k=0; k<w; k++) Dn[i*w+k] = d[(i+1)*W+k+1];   //    Store matrix without padding
+        }                                                       //   End loop over rows
+      }                                                         //  End if for integer degree
+    }                                                           // End loop over degree
   }
 
-  void P2P(Cell * Ci, Cell * Cj) {
+  //! Rotate coefs into the frame whose z axis is (theta, phi); Anm scales multipoles and 1 / Anm scales locals
+  template<int Pt>
+  void rotate(complex_t * C, complex_t * Cr, const real_t * D, const complex_t * eim, bool local, const FMM & fmm) {
+    const int P = Pt ? Pt : fmm.P;                              // Order of expansions, a constant unless Pt is 0
+    complex_t f[2*P];                                           // Coefs of one degree for m from -n to n
+    for (int n=0; n<P; n++) {                                   // Loop over n in Cnm
+      int w = 2 * n + 1;                                        //  Size of d-matrix of degree n
+      const real_t * Dn = D + n * (4 * n * n - 1) / 3;          //  d-matrix of degree n
+      for (int m=0; m<=n; m++) {                                //  Loop over m in Cnm
+        int nms = n * (n + 1) / 2 + m;                          //   Index of Cnm
+        complex_t g = eim[m] * C[nms] * (local ? 1 / fmm.Anm[nms] : fmm.Anm[nms]);// Rotate by phi and normalize
+        f[n+m] = g;                                             //   Coef of positive m
+        f[n-m] = real_t(oddOrEven(m)) * std::conj(g);           //   Coef of negative m from symmetry
+      }                                                         //  End loop over m in Cnm
+      for (int m=0; m<=n; m++) {                                //  Loop over m in rotated Cnm
+        int nms = n * (n + 1) / 2 + m;                          //   Index of Cnm
+        complex_t c = 0;                                        //   Initialize rotated coef
+        for (int i=0; i<w; i++) c += Dn[i*w+n-m] * f[n-(i-n)];  //   Rotate by theta with column n-m of d-matrix
+        Cr[nms] = c * (local ? fmm.Anm[nms] : 1 / fmm.Anm[nms]);//   Undo normalization
+      }                                                         //  End loop over m in rotated Cnm
+    }                                                           // End loop over n in Cnm
+  }
+
+  //! Rotate coefs back from the frame whose z axis is (theta, phi) and add them to C
+  template<int Pt>
+  void rotateBack(complex_t * Cr, complex_t * C, const real_t * D, const complex_t * eim, bool local, const FMM & fmm) {
+    const int P = Pt ? Pt : fmm.P;                              // Order of expansions, a constant unless Pt is 0
+    complex_t f[2*P];                                           // Coefs of one degree for m from -n to n
+    for (int n=0; n<P; n++) {                                   // Loop over n in Cnm
+      int w = 2 * n + 1;                                        //  Size of d-matrix of degree n
+      const real_t * Dn = D + n * (4 * n * n - 1) / 3;          //  d-matrix of degree n
+      for (int m=0; m<=n; m++) {                                //  Loop over m in rotated Cnm
+        int nms = n * (n + 1) / 2 + m;                          //   Index of Cnm
+        complex_t g = Cr[nms] * (local ? 1 / fmm.Anm[nms] : fmm.Anm[nms]);// Normalize rotated coef
+        f[n+m] = g;                                             //   Coef of positive m
+        f[n-m] = real_t(oddOrEven(m)) * std::conj(g);           //   Coef of negative m from symmetry
+      }                                                         //  End loop over m in rotated Cnm
+      for (int m=0; m<=n; m++) {                                //  Loop over m in Cnm
+        int nms = n * (n + 1) / 2 + m;                          //   Index of Cnm
+        complex_t c = 0;                                        //   Initialize coef
+        for (int i=0; i<w; i++) c += Dn[(n-m)*w+i] * f[n-(i-n)];//   Rotate back by theta with row n-m of d-matrix
+        C[nms] += std::conj(eim[m]) * c * (local ? fmm.Anm[nms] : 1 / fmm.Anm[nms]);// Rotate back by phi and add
+      }                                                         //  End loop over m in Cnm
+    }                                                           // End loop over n in Cnm
+  }
+
+  //! Get angles, Wigner d-matrices and exp(i m phi) of the frame whose z axis is dX
+  template<int Pt>
+  real_t rotation(real_t * dX, real_t * D, complex_t * eim, const FMM & fmm) {
+    const int P = Pt ? Pt : fmm.P;                              // Order of expansions, a constant unless Pt is 0
+    real_t rho, theta, phi;                                     // Spherical coordinates of dX
+    cart2sph(dX, rho, theta, phi);                              // Get spherical coordinates
+    wignerD<Pt>(theta, D, fmm);                                 // d-matrices of polar angle
+    complex_t ei = std::exp(I * phi);                           // exp(i * phi)
+    eim[0] = 1;                                                 // exp(i * 0 * phi)
+    for (int m=1; m<P; m++) eim[m] = eim[m-1] * ei;             // exp(i * m * phi)
+    return rho;
+  }
+
+  //! SIMD level of this CPU, chosen by the same dispatcher as EXAFMM_CLONES (0: scalar, 1: AVX2, 2: AVX-512)
+#if EXAFMM_DISPATCH
+  __attribute__((target("default"))) int simdLevel() { return 0; }
+  __attribute__((target("avx2,fma"))) int simdLevel() { return 1; }
+  __attribute__((target("avx512f"))) int simdLevel() { return 2; }
+#else
+  int simdLevel() { return 0; }
+#endif
+
+  //! Report the SIMD variant that the dispatched kernels run on this CPU
+  const char * simdVariant() {
+    const char * names[3] = {"Scalar", "AVX2", "AVX-512"};
+    return names[simdLevel()];
+  }
+
+  //! Sum potential and force on one target from a block of sources in SoA layout
+  template<int o>
+  void P2PScalar(real_t * Xi, real_t * Xj, real_t * Yj, real_t * Zj, real_t * Qj, int nj,
+                 real_t & pot, real_t & ax, real_t & ay, real_t & az) {
+    for (int j=0; j<nj; j++) {
+      real_t dx = Xi[0] - Xj[j];
+      real_t dy = Xi[1] - Yj[j];
+      real_t dz = Xi[2] - Zj[j];
+      real_t R2 = dx * dx + dy * dy + dz * dz;
+      if (R2 != 0) {
+        real_t invR2 = 1.0 / R2;
+        real_t invR = Qj[j] * sqrt(invR2);
+        if constexpr (o & POTENTIAL) pot += invR;
+        if constexpr (o & FORCE) {
+          invR2 *= invR;
+          ax += dx * invR2;
+          ay += dy * invR2;
+          az += dz * invR2;
+        }
+      }
+    }
+  }
+
+#if EXAFMM_DISPATCH
+  //! 1 / sqrt(R2) from a float rsqrt estimate and two Newton steps; lanes whose R2 overflows or underflows float, where the
+  //! estimate is 0 or infinite, take an exact square root and division instead, which costs nothing while no lane does
+  __attribute__((target("avx2,fma")))
+  inline __m256d rsqrtAVX2(__m256d R2) {
+    __m256d half = _mm256_set1_pd(0.5);
+    __m256d three = _mm256_set1_pd(1.5);
+    __m256d invR = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(R2)));// 12-bit estimate of 1 / R
+    __m256d hR2 = _mm256_mul_pd(half, R2);
+    invR = _mm256_mul_pd(invR, _mm256_fnmadd_pd(hR2, _mm256_mul_pd(invR, invR), three));// Newton step
+    invR = _mm256_mul_pd(invR, _mm256_fnmadd_pd(hR2, _mm256_mul_pd(invR, invR), three));// Newton step
+    __m256d small = _mm256_cmp_pd(R2, _mm256_set1_pd(FLT_MIN), _CMP_LT_OQ);// Underflows float
+    __m256d large = _mm256_cmp_pd(R2, _mm256_set1_pd(FLT_MAX), _CMP_GT_OQ);// Overflows float
+    __m256d self = _mm256_cmp_pd(R2, _mm256_setzero_pd(), _CMP_EQ_OQ);// Self interaction, masked by the caller
+    __m256d out = _mm256_andnot_pd(self, _mm256_or_pd(small, large));// Lanes out of range of float
+    if (_mm256_movemask_pd(out)) {                              // If any lane is out of range
+      __m256d exact = _mm256_div_pd(_mm256_set1_pd(1), _mm256_sqrt_pd(R2));// Exact 1 / R
+      invR = _mm256_blendv_pd(invR, exact, out);                //  Replace estimate of lanes out of range
+    }                                                           // End if for out of range
+    return invR;
+  }
+
+  //! AVX2 variant of the block P2P with float rsqrt and two Newton steps
+  template<int o>
+  __attribute__((target("avx2,fma")))
+  void P2PAVX2(real_t * Xi, real_t * Xj, real_t * Yj, real_t * Zj, real_t * Qj, int nj,
+               real_t & pot, real_t & ax, real_t & ay, real_t & az) {
+    __m256d zero = _mm256_setzero_pd();
+    __m256d xi = _mm256_set1_pd(Xi[0]);
+    __m256d yi = _mm256_set1_pd(Xi[1]);
+    __m256d zi = _mm256_set1_pd(Xi[2]);
+    __m256d pv = zero, axv = zero, ayv = zero, azv = zero;
+    for (int j=0; j<nj; j+=4) {
+      __m256d dx = _mm256_sub_pd(xi, _mm256_load_pd(Xj+j));
+      __m256d dy = _mm256_sub_pd(yi, _mm256_load_pd(Yj+j));
+      __m256d dz = _mm256_sub_pd(zi, _mm256_load_pd(Zj+j));
+      __m256d R2 = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dz, dz)));
+      __m256d mask = _mm256_cmp_pd(R2, zero, _CMP_NEQ_OQ);      // Skip self interaction
+      __m256d invR = rsqrtAVX2(R2);                             // 1 / R
+      invR = _mm256_and_pd(invR, mask);
+      __m256d invR2 = _mm256_mul_pd(invR, invR);
+      invR = _mm256_mul_pd(invR, _mm256_load_pd(Qj+j));
+      if constexpr (o & POTENTIAL) pv = _mm256_add_pd(pv, invR);
+      if constexpr (o & FORCE) {
+        invR = _mm256_mul_pd(invR, invR2);
+        axv = _mm256_fmadd_pd(dx, invR, axv);
+        ayv = _mm256_fmadd_pd(dy, invR, ayv);
+        azv = _mm256_fmadd_pd(dz, invR, azv);
+      }
+    }
+    real_t sum[4][4];
+    _mm256_storeu_pd(sum[0], pv);
+    _mm256_storeu_pd(sum[1], axv);
+    _mm256_storeu_pd(sum[2], ayv);
+    _mm256_storeu_pd(sum[3], azv);
+    for (int k=0; k<4; k++) {
+      pot += sum[0][k];
+      ax += sum[1][k];
+      ay += sum[2][k];
+      az += sum[3][k];
+    }
+  }
+
+  //! AVX-512 variant of the block P2P with rsqrt14 and two Newton steps
+  template<int o>
+  __attribute__((target("avx512f")))
+  void P2PAVX512(real_t * Xi, real_t * Xj, real_t * Yj, real_t * Zj, real_t * Qj, int nj,
+                 real_t & pot, real_t & ax, real_t & ay, real_t & az) {
+    __m512d zero = _mm512_setzero_pd();
+    __m512d half = _mm512_set1_pd(0.5);
+    __m512d three = _mm512_set1_pd(1.5);
+    __m512d xi = _mm512_set1_pd(Xi[0]);
+    __m512d yi = _mm512_set1_pd(Xi[1]);
+    __m512d zi = _mm512_set1_pd(Xi[2]);
+    __m512d pv = zero, axv = zero, ayv = zero, azv = zero;
+    for (int j=0; j<nj; j+=8) {
+      __m512d dx = _mm512_sub_pd(xi, _mm512_load_pd(Xj+j));
+      __m512d dy = _mm512_sub_pd(yi, _mm512_load_pd(Yj+j));
+      __m512d dz = _mm512_sub_pd(zi, _mm512_load_pd(Zj+j));
+      __m512d R2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dz, dz)));
+      __mmask8 mask = _mm512_cmp_pd_mask(R2, zero, _CMP_NEQ_OQ);// Skip self interaction
+      __m512d invR = _mm512_maskz_rsqrt14_pd(mask, R2);         // 14-bit estimate of 1 / R
+      __m512d hR2 = _mm512_mul_pd(half, R2);
+      invR = _mm512_mul_pd(invR, _mm512_fnmadd_pd(hR2, _mm512_mul_pd(invR, invR), three));// Newton step
+      invR = _mm512_mul_pd(invR, _mm512_fnmadd_pd(hR2, _mm512_mul_pd(invR, invR), three));// Newton step
+      __m512d invR2 = _mm512_mul_pd(invR, invR);
+      invR = _mm512_mul_pd(invR, _mm512_load_pd(Qj+j));
+      if constexpr (o & POTENTIAL) pv = _mm512_add_pd(pv, invR);
+      if constexpr (o & FORCE) {
+        invR = _mm512_mul_pd(invR, invR2);
+        axv = _mm512_fmadd_pd(dx, invR, axv);
+        ayv = _mm512_fmadd_pd(dy, invR, ayv);
+        azv = _mm512_fmadd_pd(dz, invR, azv);
+      }
+    }
+    real_t sum[4][8];
+    _mm512_storeu_pd(sum[0], pv);
+    _mm512_storeu_pd(sum[1], axv);
+    _mm512_storeu_pd(sum[2], ayv);
+    _mm512_storeu_pd(sum[3], azv);
+    for (int k=0; k<8; k++) {
+      pot += sum[0][k];
+      ax += sum[1][k];
+      ay += sum[2][k];
+      az += sum[3][k];
+    }
+  }
+#endif
+
+#if EXAFMM_NRHS > 1
+  //! Sum potential and force of all right-hand sides on one target from a block of sources; Qj holds NRHS charges per source
+  template<int o>
+  EXAFMM_CLONES
+  void P2P(int, real_t * Xi, real_t * Xj, real_t * Yj, real_t * Zj, real_t * Qj, int nj,
+           real_t * pot, real_t * ax, real_t * ay, real_t * az) {
+    for (int j=0; j<nj; j++) {
+      real_t dx = Xi[0] - Xj[j];
+      real_t dy = Xi[1] - Yj[j];
+      real_t dz = Xi[2] - Zj[j];
+      real_t R2 = dx * dx + dy * dy + dz * dz;
+      if (R2 != 0) {
+        real_t invR2 = 1.0 / R2;
+        real_t invR = sqrt(invR2);
+        real_t invR3 = invR2 * invR;
+        for (int k=0; k<NRHS; k++) {
+          real_t q = Qj[j*NRHS+k];
+          if constexpr (o & POTENTIAL) pot[k] += q * invR;
+          if constexpr (o & FORCE) {
+            ax[k] += dx * q * invR3;
+            ay[k] += dy * q * invR3;
+            az[k] += dz * q * invR3;
+          }
+        }
+      }
+    }
+  }
+#else
+  //! Block P2P of the SIMD level of this CPU
+  template<int o>
+  void P2P(int simd, real_t * Xi, real_t * Xj, real_t * Yj, real_t * Zj, real_t * Qj, int nj,
+           real_t * pot, real_t * ax, real_t * ay, real_t * az) {
+#if EXAFMM_DISPATCH
+    if (simd == 2) return P2PAVX512<o>(Xi, Xj, Yj, Zj, Qj, nj, *pot, *ax, *ay, *az);
+    if (simd == 1) return P2PAVX2<o>(Xi, Xj, Yj, Zj, Qj, nj, *pot, *ax, *ay, *az);
+#endif
+    P2PScalar<o>(Xi, Xj, Yj, Zj, Qj, nj, *pot, *ax, *ay, *az);
+  }
+#endif
+
+  template<int o>
+  void P2P(Cell * Ci, Cell * Cj, Output<o>) {
     Body * Bi = Ci->BODY;
     Body * Bj = Cj->BODY;
     int ni = Ci->NBODY;
     int nj = Cj->NBODY;
-    for (int i=0; i<ni; i++) {
-      real_t pot = 0;
-      real_t ax = 0;
-      real_t ay = 0;
-      real_t az = 0;
-      for (int j=0; j<nj; j++) {
-        for (int d=0; d<3; d++) dX[d] = Bi[i].X[d] - Bj[j].X[d];
-        real_t R2 = norm(dX);
-        if (R2 != 0) {
-          real_t invR2 = 1.0 / R2;
-          real_t invR = Bj[j].q * sqrt(invR2);
-          for (int d=0; d<3; d++) dX[d] *= invR2 * invR;
-          pot += invR;
-          ax += dX[0];
-          ay += dX[1];
-          az += dX[2];
+    int simd = simdLevel();
+    alignas(64) real_t Xj[nblock], Yj[nblock], Zj[nblock], Qj[nblock*NRHS];
+    for (int jb=0; jb<nj; jb+=nblock) {
+      int nb = std::min(nblock, nj - jb);
+      int nv = (nb + NSIMD - 1) / NSIMD * NSIMD;
+      for (int j=0; j<nb; j++) {
+        Xj[j] = Bj[jb+j].X[0];
+        Yj[j] = Bj[jb+j].X[1];
+        Zj[j] = Bj[jb+j].X[2];
+        for (int k=0; k<NRHS; k++) Qj[j*NRHS+k] = charge(Bj[jb+j], k);
+      }
+      for (int j=nb; j<nv; j++) {
+        Xj[j] = Yj[j] = Zj[j] = 0;
+        for (int k=0; k<NRHS; k++) Qj[j*NRHS+k] = 0;
+      }
+      for (int i=0; i<ni; i++) {
+        real_t pot[NRHS], ax[NRHS], ay[NRHS], az[NRHS];
+        for (int k=0; k<NRHS; k++) pot[k] = ax[k] = ay[k] = az[k] = 0;
+        P2P<o>(simd, Bi[i].X, Xj, Yj, Zj, Qj, nv, pot, ax, ay, az);
+        for (int k=0; k<NRHS; k++) {
+          real_t * F = force(Bi[i], k);
+          if constexpr (o & POTENTIAL) potential(Bi[i], k) += pot[k];
+          if constexpr (o & FORCE) {
+            F[0] -= ax[k];
+            F[1] -= ay[k];
+            F[2] -= az[k];
+          }
+        }
+      }
+    }
+  }
+
+  //! Mutual block P2P that also accumulates the reaction of target qi on each source
+  template<int o>
+  void P2PScalar(real_t * Xi, real_t qi, real_t * Xj, real_t * Yj, real_t * Zj, real_t * Qj,
+                 real_t * Pj, real_t * FXj, real_t * FYj, real_t * FZj, int nj,
+                 real_t & pot, real_t & ax, real_t & ay, real_t & az) {
+    for (int j=0; j<nj; j++) {
+      real_t dx = Xi[0] - Xj[j];
+      real_t dy = Xi[1] - Yj[j];
+      real_t dz = Xi[2] - Zj[j];
+      real_t R2 = dx * dx + dy * dy + dz * dz;
+      if (R2 != 0) {
+        real_t invR2 = 1.0 / R2;
+        real_t invR = sqrt(invR2);
+        real_t invR3 = invR2 * invR;
+        if constexpr (o & POTENTIAL) {
+          pot += Qj[j] * invR;
+          Pj[j] += qi * invR;
+        }
+        if constexpr (o & FORCE) {
+          ax += dx * Qj[j] * invR3;
+          ay += dy * Qj[j] * invR3;
+          az += dz * Qj[j] * invR3;
+          FXj[j] += dx * qi * invR3;
+          FYj[j] += dy * qi * invR3;
+          FZj[j] += dz * qi * invR3;
+        }
+      }
+    }
+  }
+
+#if EXAFMM_DISPATCH
+  //! AVX2 variant of the mutual block P2P
+  template<int o>
+  __attribute__((target("avx2,fma")))
+  void P2PAVX2(real_t * Xi, real_t qi, real_t * Xj, real_t * Yj, real_t * Zj, real_t * Qj,
+               real_t * Pj, real_t * FXj, real_t * FYj, real_t * FZj, int nj,
+               real_t & pot, real_t & ax, real_t & ay, real_t & az) {
+    __m256d zero = _mm256_setzero_pd();
+    __m256d xi = _mm256_set1_pd(Xi[0]);
+    __m256d yi = _mm256_set1_pd(Xi[1]);
+    __m256d zi = _mm256_set1_pd(Xi[2]);
+    __m256d qiv = _mm256_set1_pd(qi);
+    __m256d pv = zero, axv = zero, ayv = zero, azv = zero;
+    for (int j=0; j<nj; j+=4) {
+      __m256d dx = _mm256_sub_pd(xi, _mm256_load_pd(Xj+j));
+      __m256d dy = _mm256_sub_pd(yi, _mm256_load_pd(Yj+j));
+      __m256d dz = _mm256_sub_pd(zi, _mm256_load_pd(Zj+j));
+      __m256d R2 = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dz, dz)));
+      __m256d mask = _mm256_cmp_pd(R2, zero, _CMP_NEQ_OQ);      // Skip self interaction
+      __m256d invR = rsqrtAVX2(R2);                             // 1 / R
+      invR = _mm256_and_pd(invR, mask);
+      __m256d qj = _mm256_load_pd(Qj+j);
+      if constexpr (o & POTENTIAL) {
+        pv = _mm256_fmadd_pd(qj, invR, pv);
+        _mm256_store_pd(Pj+j, _mm256_fmadd_pd(qiv, invR, _mm256_load_pd(Pj+j)));
+      }
+      if constexpr (o & FORCE) {
+        __m256d invR3 = _mm256_mul_pd(invR, _mm256_mul_pd(invR, invR));
+        __m256d f = _mm256_mul_pd(qj, invR3);
+        axv = _mm256_fmadd_pd(dx, f, axv);
+        ayv = _mm256_fmadd_pd(dy, f, ayv);
+        azv = _mm256_fmadd_pd(dz, f, azv);
+        f = _mm256_mul_pd(qiv, invR3);
+        _mm256_store_pd(FXj+j, _mm256_fmadd_pd(dx, f, _mm256_load_pd(FXj+j)));
+        _mm256_store_pd(FYj+j, _mm256_fmadd_pd(dy, f, _mm256_load_pd(FYj+j)));
+        _mm256_store_pd(FZj+j, _mm256_fmadd_pd(dz, f, _mm256_load_pd(FZj+j)));
+      }
+    }
+    real_t sum[4][4];
+    _mm256_storeu_pd(sum[0], pv);
+    _mm256_storeu_pd(sum[1], axv);
+    _mm256_storeu_pd(sum[2], ayv);
+    _mm256_storeu_pd(sum[3], azv);
+    for (int k=0; k<4; k++) {
+      pot += sum[0][k];
+      ax += sum[1][k];
+      ay += sum[2][k];
+      az += sum[3][k];
+    }
+  }
+
+  //! AVX-512 variant of the mutual block P2P
+  template<int o>
+  __attribute__((target("avx512f")))
+  void P2PAVX512(real_t * Xi, real_t qi, real_t * Xj, real_t * Yj, real_t * Zj, real_t * Qj,
+                 real_t * Pj, real_t * FXj, real_t * FYj, real_t * FZj, int nj,
+                 real_t & pot, real_t & ax, real_t & ay, real_t & az) {
+    __m512d zero = _mm512_setzero_pd();
+    __m512d half = _mm512_set1_pd(0.5);
+    __m512d three = _mm512_set1_pd(1.5);
+    __m512d xi = _mm512_set1_pd(Xi[0]);
+    __m512d yi = _mm512_set1_pd(Xi[1]);
+    __m512d zi = _mm512_set1_pd(Xi[2]);
+    __m512d qiv = _mm512_set1_pd(qi);
+    __m512d pv = zero, axv = zero, ayv = zero, azv = zero;
+    for (int j=0; j<nj; j+=8) {
+      __m512d dx = _mm512_sub_pd(xi, _mm512_load_pd(Xj+j));
+      __m512d dy = _mm512_sub_pd(yi, _mm512_load_pd(Yj+j));
+      __m512d dz = _mm512_sub_pd(zi, _mm512_load_pd(Zj+j));
+      __m512d R2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dz, dz)));
+      __mmask8 mask = _mm512_cmp_pd_mask(R2, zero, _CMP_NEQ_OQ);// Skip self interaction
+      __m512d invR = _mm512_maskz_rsqrt14_pd(mask, R2);         // 14-bit estimate of 1 / R
+      __m512d hR2 = _mm512_mul_pd(half, R2);
+      invR = _mm512_mul_pd(invR, _mm512_fnmadd_pd(hR2, _mm512_mul_pd(invR, invR), three));// Newton step
+      invR = _mm512_mul_pd(invR, _mm512_fnmadd_pd(hR2, _mm512_mul_pd(invR, invR), three));// Newton step
+      __m512d qj = _mm512_load_pd(Qj+j);
+      if constexpr (o & POTENTIAL) {
+        pv = _mm512_fmadd_pd(qj, invR, pv);
+        _mm512_store_pd(Pj+j, _mm512_fmadd_pd(qiv, invR, _mm512_load_pd(Pj+j)));
+      }
+      if constexpr (o & FORCE) {
+        __m512d invR3 = _mm512_mul_pd(invR, _mm512_mul_pd(invR, invR));
+        __m512d f = _mm512_mul_pd(qj, invR3);
+        axv = _mm512_fmadd_pd(dx, f, axv);
+        ayv = _mm512_fmadd_pd(dy, f, ayv);
+        azv = _mm512_fmadd_pd(dz, f, azv);
+        f = _mm512_mul_pd(qiv, invR3);
+        _mm512_store_pd(FXj+j, _mm512_fmadd_pd(dx, f, _mm512_load_pd(FXj+j)));
+        _mm512_store_pd(FYj+j, _mm512_fmadd_pd(dy, f, _mm512_load_pd(FYj+j)));
+        _mm512_store_pd(FZj+j, _mm512_fmadd_pd(dz, f, _mm512_load_pd(FZj+j)));
+      }
+    }
+    real_t sum[4][8];
+    _mm512_storeu_pd(sum[0], pv);
+    _mm512_storeu_pd(sum[1], axv);
+    _mm512_storeu_pd(sum[2], ayv);
+    _mm512_storeu_pd(sum[3], azv);
+    for (int k=0; k<8; k++) {
+      pot += sum[0][k];
+      ax += sum[1][k];
+      ay += sum[2][k];
+      az += sum[3][k];
+    }
+  }
+#endif
+
+#if EXAFMM_NRHS > 1
+  //! Mutual block P2P of all right-hand sides; qi, Qj and the reactions hold NRHS values per body
+  template<int o>
+  EXAFMM_CLONES
+  void P2P(int, real_t * Xi, real_t * qi, real_t * Xj, real_t * Yj, real_t * Zj, real_t * Qj,
+           real_t * Pj, real_t * FXj, real_t * FYj, real_t * FZj, int nj,
+           real_t * pot, real_t * ax, real_t * ay, real_t * az) {
+    for (int j=0; j<nj; j++) {
+      real_t dx = Xi[0] - Xj[j];
+      real_t dy = Xi[1] - Yj[j];
+      real_t dz = Xi[2] - Zj[j];
+      real_t R2 = dx * dx + dy * dy + dz * dz;
+      if (R2 != 0) {
+        real_t invR2 = 1.0 / R2;
+        real_t invR = sqrt(invR2);
+        real_t invR3 = invR2 * invR;
+        for (int k=0; k<NRHS; k++) {
+          real_t q = Qj[j*NRHS+k];
+          if constexpr (o & POTENTIAL) {
+            pot[k] += q * invR;
+            Pj[j*NRHS+k] += qi[k] * invR;
+          }
+          if constexpr (o & FORCE) {
+            ax[k] += dx * q * invR3;
+            ay[k] += dy * q * invR3;
+            az[k] += dz * q * invR3;
+            FXj[j*NRHS+k] += dx * qi[k] * invR3;
+            FYj[j*NRHS+k] += dy * qi[k] * invR3;
+            FZj[j*NRHS+k] += dz * qi[k] * invR3;
+          }
         }
       }
-      Bi[i].p += pot;
-      Bi[i].F[0] -= ax;
-      Bi[i].F[1] -= ay;
-      Bi[i].F[2] -= az;
     }
   }
+#else
+  //! Mutual block P2P of the SIMD level of this CPU
+  template<int o>
+  void P2P(int simd, real_t * Xi, real_t * qi, real_t * Xj, real_t * Yj, real_t * Zj, real_t * Qj,
+           real_t * Pj, real_t * FXj, real_t * FYj, real_t * FZj, int nj,
+           real_t * pot, real_t * ax, real_t * ay, real_t * az) {
+#if EXAFMM_DISPATCH
+    if (simd == 2) return P2PAVX512<o>(Xi, *qi, Xj, Yj, Zj, Qj, Pj, FXj, FYj, FZj, nj, *pot, *ax, *ay, *az);
+    if (simd == 1) return P2PAVX2<o>(Xi, *qi, Xj, Yj, Zj, Qj, Pj, FXj, FYj, FZj, nj, *pot, *ax, *ay, *az);
+#endif
+    P2PScalar<o>(Xi, *qi, Xj, Yj, Zj, Qj, Pj, FXj, FYj, FZj, nj, *pot, *ax, *ay, *az);
+  }
+#endif
 
-  void P2M(Cell * C) {
+  //! Mutual P2P kernel; the reaction on the bodies of Cj is accumulated into Rj instead of Cj->BODY,
+  //! as potential and force of each right-hand side, 4 NRHS values per body
+  template<int o>
+  void P2P(Cell * Ci, Cell * Cj, real_t * Rj, Output<o>) {
+    Body * Bi = Ci->BODY;
+    int ni = Ci->NBODY;
+    int nj = Cj->NBODY;
+    int simd = simdLevel();
+    alignas(64) real_t Xj[nblock], Yj[nblock], Zj[nblock], Qj[nblock*NRHS];
+    alignas(64) real_t Pj[nblock*NRHS], FXj[nblock*NRHS], FYj[nblock*NRHS], FZj[nblock*NRHS];
+    for (int jb=0; jb<nj; jb+=nblock) {
+      int nb = std::min(nblock, nj - jb);
+      int nv = (nb + NSIMD - 1) / NSIMD * NSIMD;
+      for (int j=0; j<nb; j++) {
+        Xj[j] = Cj->BODY[jb+j].X[0];
+        Yj[j] = Cj->BODY[jb+j].X[1];
+        Zj[j] = Cj->BODY[jb+j].X[2];
+        for (int k=0; k<NRHS; k++) Qj[j*NRHS+k] = charge(Cj->BODY[jb+j], k);
+      }
+      for (int j=nb; j<nv; j++) {
+        Xj[j] = Yj[j] = Zj[j] = 0;
+        for (int k=0; k<NRHS; k++) Qj[j*NRHS+k] = 0;
+      }
+      for (int j=0; j<nv*NRHS; j++) {
+        Pj[j] = FXj[j] = FYj[j] = FZj[j] = 0;
+      }
+      for (int i=0; i<ni; i++) {
+        real_t qi[NRHS], pot[NRHS], ax[NRHS], ay[NRHS], az[NRHS];
+        for (int k=0; k<NRHS; k++) {
+          qi[k] = charge(Bi[i], k);
+          pot[k] = ax[k] = ay[k] = az[k] = 0;
+        }
+        P2P<o>(simd, Bi[i].X, qi, Xj, Yj, Zj, Qj, Pj, FXj, FYj, FZj, nv, pot, ax, ay, az);
+        for (int k=0; k<NRHS; k++) {
+          real_t * F = force(Bi[i], k);
+          if constexpr (o & POTENTIAL) potential(Bi[i], k) += pot[k];
+          if constexpr (o & FORCE) {
+            F[0] -= ax[k];
+            F[1] -= ay[k];
+            F[2] -= az[k];
+          }
+        }
+      }
+      for (int j=0; j<nb; j++) {
+        for (int k=0; k<NRHS; k++) {
+          real_t * R = Rj + 4 * ((jb + j) * NRHS + k);
+          if constexpr (o & POTENTIAL) R[0] += Pj[j*NRHS+k];
+          if constexpr (o & FORCE) {
+            R[1] += FXj[j*NRHS+k];
+            R[2] += FYj[j*NRHS+k];
+            R[3] += FZj[j*NRHS+k];
+          }
+        }
+      }
+    }
+  }
+
+  template<int Pt>
+  EXAFMM_CLONES
+  void P2M(Cell * C, const FMM & fmm) {
+    const int P = Pt ? Pt : fmm.P;                              // Order of expansions, a constant unless Pt is 0
+    const int NTERM = P * (P + 1) / 2;                          // Number of coefficients
     complex_t Ynm[P*P], YnmTheta[P*P];
+    real_t dX[3];
     for (Body * B=C->BODY; B!=C->BODY+C->NBODY; B++) {
       for (int d=0; d<3; d++) dX[d] = B->X[d] - C->X[d];
       real_t rho, alpha, beta;
       cart2sph(dX, rho, alpha, beta);
-      evalMultipole(rho, alpha, -beta, Ynm, YnmTheta);
+      evalMultipole<Pt>(rho, alpha, -beta, Ynm, YnmTheta, fmm, Output<POTENTIAL>());
       for (int n=0; n<P; n++) {
         for (int m=0; m<=n; m++) {
           int nm  = n * n + n + m;
           int nms = n * (n + 1) / 2 + m;
-          C->M[nms] += B->q * Ynm[nm];
+          for (int k=0; k<NRHS; k++) C->M[k*NTERM+nms] += charge(*B, k) * Ynm[nm];
         }
       }
     }
   }
 
-  void M2M(Cell * Ci) {
-    complex_t Ynm[P*P], YnmTheta[P*P];
+  void initKernel(FMM & fmm) {
+    int P = fmm.P;                                              // Order of expansions
+    fmm.NTERM = P * (P + 1) / 2;                                // Calculate number of coefficients
+    fmm.factorial.resize(2 * P);                                // Allocate factorials
+    fmm.factorial[0] = 1;                                       // 0!
+    for (int n=1; n<2*P; n++) fmm.factorial[n] = fmm.factorial[n-1] * n;// n!
+    fmm.Anm.resize(fmm.NTERM);                                  // Allocate normalization of coefs
+    for (int n=0; n<P; n++) {                                   // Loop over n
+      for (int m=0; m<=n; m++) {                                //  Loop over m
+        fmm.Anm[n*(n+1)/2+m] = std::sqrt(fmm.factorial[n+m] * fmm.factorial[n-m]);// sqrt((n+m)! (n-m)!)
+      }                                                         //  End loop over m
+    }                                                           // End loop over n
+    int nD = P * (4 * P * P - 1) / 3;                           // Size of Wigner d-matrices
+    fmm.octantD.resize(8 * nD);                                 // Allocate d-matrices of octants
+    fmm.octantEim.resize(8 * P);                                // Allocate exp(i m phi) of octants
+    for (int oct=0; oct<8; oct++) {                             // Loop over octants
+      real_t dX[3];                                             //  Diagonal direction of octant
+      for (int d=0; d<3; d++) dX[d] = (oct >> d & 1) ? 1 : -1;  //  Diagonal of octant
+      rotation<0>(dX, &fmm.octantD[oct*nD], &fmm.octantEim[oct*P], fmm);// Cache rotation of octant
+    }                                                           // End loop over octants
+  }
+
+  //! Point the multipole and local coefs of ncell cells to consecutive blocks of coefs, NTERM for each right-hand side
+  void setCoefs(Cell * cells, int ncell, complex_t * coefs, const FMM & fmm) {
+    for (int i=0; i<ncell; i++) {                               // Loop over cells
+      cells[i].M = coefs + 2 * i * NRHS * fmm.NTERM;            //  Multipole coefs of cell
+      cells[i].L = cells[i].M + NRHS * fmm.NTERM;               //  Local coefs of cell
+    }                                                           // End loop over cells
+  }
+
+  //! Allocate the coefs of all cells of a tree in one block, reusing it if its size has not changed
+  //! A new block is cleared by the threads that own the cells, so the coefs lie on the socket of their cells
+  void initCoefs(Cells & cells, const FMM & fmm) {
+    size_t size = 2 * NRHS * cells.size() * fmm.NTERM;          // Number of coefs of all cells
+    if (cells.coefs.size() != size) {                           // If block cannot be reused
+      allocateUntouched(cells.coefs, size);                     //  Allocate coefs without writing them
+      firstTouch(&cells.coefs[0], size, cells.owners, 2 * NRHS * fmm.NTERM);// Clear coefs in the threads that own their cells
+    }                                                           // End if for reuse
+    setCoefs(&cells[0], cells.size(), &cells.coefs[0], fmm);    // Point cells to their coefs
+  }
+
+  //! Allocate and clear the coefs of a tree of targets only, which needs no P2M or M2M
+  void initTargets(Cells & icells, const FMM & fmm) {
+    initCoefs(icells, fmm);                                     // Allocate coefs of all cells at once
+    std::fill(icells.coefs.begin(), icells.coefs.end(), 0.0);   // Initialize local coefs
+  }
+
+  //! Index of the cached rotation if dX is a geometric offset between a parent and a child of radius R, -1 otherwise
+  int octant(real_t * dX, real_t R) {
+    int oct = 0;                                                // Octant index
+    for (int d=0; d<3; d++) {                                   // Loop over dimensions
+      if (std::abs(std::abs(dX[d]) - R) > 1e-12 * R) return -1; //  Offset is not geometric (e.g. refit tree)
+      if (dX[d] > 0) oct |= 1 << d;                             //  Set bit of positive direction
+    }                                                           // End loop over dimensions
+    return oct;                                                 // Return octant index
+  }
+
+  template<int Pt>
+  void M2M(Cell * Ci, const FMM & fmm) {
+    const int P = Pt ? Pt : fmm.P;                              // Order of expansions, a constant unless Pt is 0
+    const int NTERM = P * (P + 1) / 2;                          // Number of coefficients
+    real_t Dbuf[P*(4*P*P-1)/3], dX[3];
+    complex_t eimbuf[P], Mr[NTERM], Mt[NTERM];
     for (Cell * Cj=Ci->CHILD; Cj!=Ci->CHILD+Ci->NCHILD; Cj++) {
       for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d];
-      real_t rho, alpha, beta;
-      cart2sph(dX, rho, alpha, beta);
-      evalMultipole(rho, alpha, beta, Ynm, YnmTheta);
-      for (int j=0; j<P; j++) {
-        for (int k=0; k<=j; k++) {
-          int jks = j * (j + 1) / 2 + k;
-          complex_t M = 0;
-          for (int n=0; n<=j; n++) {
-            for (int m=std::max(-n,-j+k+n); m<=std::min(k-1,n); m++) {
-              int jnkms = (j - n) * (j - n + 1) / 2 + k - m;
-              int nm    = n * n + n - m;
-              M += Cj->M[jnkms] * Ynm[nm] * real_t(ipow2n(m) * oddOrEven(n));
-            }
-            for (int m=k; m<=std::min(n,j+k-n); m++) {
-              int jnkms = (j - n) * (j - n + 1) / 2 - k + m;
-              int nm    = n * n + n - m;
-              M += std::conj(Cj->M[jnkms]) * Ynm[nm] * real_t(oddOrEven(k+n+m));
+      int oct = octant(dX, Cj->R);
+      const real_t * D = oct < 0 ? Dbuf : &fmm.octantD[oct*P*(4*P*P-1)/3];
+      const complex_t * eim = oct < 0 ? eimbuf : &fmm.octantEim[oct*P];
+      real_t rho = oct < 0 ? rotation<Pt>(dX, Dbuf, eimbuf, fmm) : std::sqrt(norm(dX));
+      real_t rhon[P];
+      rhon[0] = 1;
+      for (int n=1; n<P; n++) rhon[n] = rhon[n-1] * rho / n;
+      for (int r=0; r<NRHS; r++) {
+        rotate<Pt>(Cj->M + r * NTERM, Mr, D, eim, false, fmm);
+        for (int j=0; j<P; j++) {
+          for (int k=0; k<=j; k++) {
+            complex_t M = 0;
+            for (int n=0; n<=j-k; n++) {
+              M += Mr[(j-n)*(j-n+1)/2+k] * rhon[n];
             }
+            Mt[j*(j+1)/2+k] = M;
           }
-          Ci->M[jks] += M;
         }
+        rotateBack<Pt>(Mt, Ci->M + r * NTERM, D, eim, false, fmm);
       }
     }
   }
 
-  void M2L(Cell * Ci, Cell * Cj) {
-    complex_t Ynm2[4*P*P];
+  //! M2L truncated at order Pt (or fmm.P if Pt is 0); coefs keep the stride of fmm.P between right-hand sides
+  template<int Pt>
+  EXAFMM_CLONES
+  void M2L(Cell * Ci, Cell * Cj, const FMM & fmm) {
+    const int P = Pt ? Pt : fmm.P;                              // Order of expansions, a constant unless Pt is 0
+    const int NTERM = P * (P + 1) / 2;                          // Number of coefficients
+    real_t D[P*(4*P*P-1)/3], dX[3];
+    complex_t eim[P], Mr[NTERM], Lr[NTERM];
     for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d];
-    real_t rho, alpha, beta;
-    cart2sph(dX, rho, alpha, beta);
-    evalLocal(rho, alpha, beta, Ynm2);
-    for (int j=0; j<P; j++) {
-      real_t Cnm = oddOrEven(j);
-      for (int k=0; k<=j; k++) {
-        int jks = j * (j + 1) / 2 + k;
-        complex_t L = 0;
-        for (int n=0; n<P; n++) {
-          for (int m=-n; m<0; m++) {
-            int nms  = n * (n + 1) / 2 - m;
-            int jnkm = (j + n) * (j + n) + j + n + m - k;
-            L += std::conj(Cj->M[nms]) * Cnm * Ynm2[jnkm];
-          }
-          for (int m=0; m<=n; m++) {
-            int nms  = n * (n + 1) / 2 + m;
-            int jnkm = (j + n) * (j + n) + j + n + m - k;
-            real_t Cnm2 = Cnm * oddOrEven((k-m)*(k<m)+m);
-            L += Cj->M[nms] * Cnm2 * Ynm2[jnkm];
+    real_t rho = rotation<Pt>(dX, D, eim, fmm);
+    real_t invRn[P];
+    invRn[0] = 1 / rho;
+    for (int n=1; n<P; n++) invRn[n] = invRn[n-1] * n / rho;
+    for (int r=0; r<NRHS; r++) {
+      rotate<Pt>(Cj->M + r * fmm.NTERM, Mr, D, eim, false, fmm);
+      for (int j=0; j<P; j++) {
+        for (int k=0; k<=j; k++) {
+          complex_t L = 0;
+          for (int n=k; n<P-j; n++) {
+            L += Mr[n*(n+1)/2+k] * real_t(oddOrEven(n+k)) * invRn[j+n];
           }
+          Lr[j*(j+1)/2+k] = L;
         }
-        Ci->L[jks] += L;
       }
+      rotateBack<Pt>(Lr, Ci->L + r * fmm.NTERM, D, eim, true, fmm);
     }
   }
 
-  void L2L(Cell * Cj) {
-    complex_t Ynm[P*P], YnmTheta[P*P];
+  template<int Pt>
+  void L2L(Cell * Cj, const FMM & fmm) {
+    const int P = Pt ? Pt : fmm.P;                              // Order of expansions, a constant unless Pt is 0
+    const int NTERM = P * (P + 1) / 2;                          // Number of coefficients
+    real_t Dbuf[P*(4*P*P-1)/3], dX[3];
+    complex_t eimbuf[P], Lr[NTERM], Lt[NTERM];
     for (Cell * Ci=Cj->CHILD; Ci!=Cj->CHILD+Cj->NCHILD; Ci++) {
       for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d];
-      real_t rho, alpha, beta;
-      cart2sph(dX, rho, alpha, beta);
-      evalMultipole(rho, alpha, beta, Ynm, YnmTheta);
-      for (int j=0; j<P; j++) {
-        for (int k=0; k<=j; k++) {
-          int jks = j * (j + 1) / 2 + k;
-          complex_t L = 0;
-          for (int n=j; n<P; n++) {
-            for (int m=j+k-n; m<0; m++) {
-              int jnkm = (n - j) * (n - j) + n - j + m - k;
-              int nms  = n * (n + 1) / 2 - m;
-              L += std::conj(Cj->L[nms]) * Ynm[jnkm] * real_t(oddOrEven(k));
-            }
-            for (int m=0; m<=n; m++) {
-              if (n-j >= abs(m-k)) {
-                int jnkm = (n - j) * (n - j) + n - j + m - k;
-                int nms  = n * (n + 1) / 2 + m;
-                L += Cj->L[nms] * Ynm[jnkm] * real_t(oddOrEven((m-k)*(m<k)));
-              }
+      int oct = octant(dX, Ci->R);
+      const real_t * D = oct < 0 ? Dbuf : &fmm.octantD[oct*P*(4*P*P-1)/3];
+      const complex_t * eim = oct < 0 ? eimbuf : &fmm.octantEim[oct*P];
+      real_t rho = oct < 0 ? rotation<Pt>(dX, Dbuf, eimbuf, fmm) : std::sqrt(norm(dX));
+      real_t rhon[P];
+      rhon[0] = 1;
+      for (int n=1; n<P; n++) rhon[n] = -rhon[n-1] * rho / n;
+      for (int r=0; r<NRHS; r++) {
+        rotate<Pt>(Cj->L + r * NTERM, Lr, D, eim, true, fmm);
+        for (int j=0; j<P; j++) {
+          for (int k=0; k<=j; k++) {
+            complex_t L = 0;
+            for (int n=j; n<P; n++) {
+              L += Lr[n*(n+1)/2+k] * rhon[n-j];
             }
+            Lt[j*(j+1)/2+k] = L;
           }
-          Ci->L[jks] += L;
         }
+        rotateBack<Pt>(Lt, Ci->L + r * NTERM, D, eim, true, fmm);
       }
     }
   }
 
-  void L2P(Cell * Ci) {
+  template<int Pt, int o>
+  EXAFMM_CLONES
+  void L2P(Cell * Ci, const FMM & fmm, Output<o>) {
+    const int P = Pt ? Pt : fmm.P;                              // Order of expansions, a constant unless Pt is 0
+    const int NTERM = P * (P + 1) / 2;                          // Number of coefficients
     complex_t Ynm[P*P], YnmTheta[P*P];
+    real_t dX[3];
     for (Body * B=Ci->BODY; B!=Ci->BODY+Ci->NBODY; B++) {
       for (int d=0; d<3; d++) dX[d] = B->X[d] - Ci->X[d];
-      real_t spherical[3] = {0, 0, 0};
-      real_t cartesian[3] = {0, 0, 0};
       real_t r, theta, phi;
       cart2sph(dX, r, theta, phi);
-      evalMultipole(r, theta, phi, Ynm, YnmTheta);
-      for (int n=0; n<P; n++) {
-        int nm  = n * n + n;
-        int nms = n * (n + 1) / 2;
-        B->p += std::real(Ci->L[nms] * Ynm[nm]);
-        spherical[0] += std::real(Ci->L[nms] * Ynm[nm]) / r * n;
-        spherical[1] += std::real(Ci->L[nms] * YnmTheta[nm]);
-        for (int m=1; m<=n; m++) {
-          nm  = n * n + n + m;
-          nms = n * (n + 1) / 2 + m;
-          B->p += 2 * std::real(Ci->L[nms] * Ynm[nm]);
-          spherical[0] += 2 * std::real(Ci->L[nms] * Ynm[nm]) / r * n;
-          spherical[1] += 2 * std::real(Ci->L[nms] * YnmTheta[nm]);
-          spherical[2] += 2 * std::real(Ci->L[nms] * Ynm[nm] * I) * m;
+      evalMultipole<Pt>(r, theta, phi, Ynm, YnmTheta, fmm, Output<o>());
+      for (int k=0; k<NRHS; k++) {
+        complex_t * L = Ci->L + k * NTERM;
+        real_t spherical[3] = {0, 0, 0};
+        real_t cartesian[3] = {0, 0, 0};
+        real_t p = 0;
+        for (int n=0; n<P; n++) {
+          int nm  = n * n + n;
+          int nms = n * (n + 1) / 2;
+          if constexpr (o & POTENTIAL) p += std::real(L[nms] * Ynm[nm]);
+          if constexpr (o & FORCE) {
+            spherical[0] += std::real(L[nms] * Ynm[nm]) / r * n;
+            spherical[1] += std::real(L[nms] * YnmTheta[nm]);
+          }
+          for (int m=1; m<=n; m++) {
+            nm  = n * n + n + m;
+            nms = n * (n + 1) / 2 + m;
+            if constexpr (o & POTENTIAL) p += 2 * std::real(L[nms] * Ynm[nm]);
+            if constexpr (o & FORCE) {
+              spherical[0] += 2 * std::real(L[nms] * Ynm[nm]) / r * n;
+              spherical[1] += 2 * std::real(L[nms] * YnmTheta[nm]);
+              spherical[2] += 2 * std::real(L[nms] * Ynm[nm] * I) * m;
+            }
+          }
+        }
+        if constexpr (o & POTENTIAL) potential(*B, k) += p;
+        if constexpr (o & FORCE) {
+          sph2cart(r, theta, phi, spherical, cartesian);
+          real_t * F = force(*B, k);
+          F[0] += cartesian[0];
+          F[1] += cartesian[1];
+          F[2] += cartesian[2];
         }
       }
-      sph2cart(r, theta, phi, spherical, cartesian);
-      B->F[0] += cartesian[0];
-      B->F[1] += cartesian[1];
-      B->F[2] += cartesian[2];
+    }
+  }
+
+  //! Switch on the runtime order P to the kernel instantiated for it; other orders run the generic kernel<0>
+#define EXAFMM_ORDER(n, kernel, ...) case n: kernel<n>(__VA_ARGS__); break;
+#define EXAFMM_SWITCH_P(P, kernel, ...)                         \
+  switch (P) {                                                  \
+    EXAFMM_ORDER(4, kernel, __VA_ARGS__)                        \
+    EXAFMM_ORDER(5, kernel, __VA_ARGS__)                        \
+    EXAFMM_ORDER(6, kernel, __VA_ARGS__)                        \
+    EXAFMM_ORDER(7, kernel, __VA_ARGS__)                        \
+    EXAFMM_ORDER(8, kernel, __VA_ARGS__)                        \
+    EXAFMM_ORDER(9, kernel, __VA_ARGS__)                        \
+    EXAFMM_ORDER(10, kernel, __VA_ARGS__)                       \
+    EXAFMM_ORDER(11, kernel, __VA_ARGS__)                       \
+    EXAFMM_ORDER(12, kernel, __VA_ARGS__)                       \
+    EXAFMM_ORDER(13, kernel, __VA_ARGS__)                       \
+    EXAFMM_ORDER(14, kernel, __VA_ARGS__)                       \
+    EXAFMM_ORDER(15, kernel, __VA_ARGS__)                       \
+    EXAFMM_ORDER(16, kernel, __VA_ARGS__)                       \
+    EXAFMM_ORDER(17, kernel, __VA_ARGS__)                       \
+    EXAFMM_ORDER(18, kernel, __VA_ARGS__)                       \
+    EXAFMM_ORDER(19, kernel, __VA_ARGS__)                       \
+    EXAFMM_ORDER(20, kernel, __VA_ARGS__)                       \
+    default: kernel<0>(__VA_ARGS__);                            \
+  }
+
+  void P2M(Cell * C, const FMM & fmm) {
+    EXAFMM_SWITCH_P(fmm.P, P2M, C, fmm)
+  }
+
+  void M2M(Cell * Ci, const FMM & fmm) {
+    EXAFMM_SWITCH_P(fmm.P, M2M, Ci, fmm)
+  }
+
+  //! Lowest order whose M2L truncation error (Ri + Rj)^p / |dX|^p meets fmm.eps, between 4 and P
+  //! Orders without an instantiated kernel fall back to P, since the generic kernel runs at P
+  int orderM2L(Cell * Ci, Cell * Cj, const FMM & fmm) {
+    if (fmm.eps <= 0 || fmm.P <= 4) return fmm.P;               // Truncation is disabled or cannot lower order
+    real_t dX[3];                                               // Distance vector
+    for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d];        // Distance vector from source to target
+    real_t ratio = (Ci->R + Cj->R) / std::sqrt(norm(dX));       // Separation ratio, below theta for M2L pairs
+    int p = int(std::ceil(std::log(fmm.eps) / std::log(ratio)));// Lowest order with ratio^p <= eps
+    p = std::max(p, 4);                                         // Lowest instantiated order
+    return p < fmm.P && p <= 20 ? p : fmm.P;                    // Truncated order if it has a kernel
+  }
+
+  void M2L(Cell * Ci, Cell * Cj, const FMM & fmm) {
+    int p = orderM2L(Ci, Cj, fmm);                              // Truncated order of this pair
+    EXAFMM_SWITCH_P(p, M2L, Ci, Cj, fmm)
+  }
+
+  //! Estimated cost of one M2L in P2P body pairs; rotation-based M2L measures 4-8 P^3 for P from 4 to 20
+  inline real_t costM2L(const FMM & fmm) {
+    return 4 * real_t(fmm.P) * fmm.P * fmm.P;                   // Cost of O(P^3) M2L
+  }
+
+  //! Estimated cost of P2M and M2M, or L2L and L2P, of the subtree of C in P2P body pairs
+  inline real_t costExpansion(Cell * C, const FMM & fmm) {
+    return C->NBODY * (fmm.NTERM + costM2L(fmm) / fmm.ncrit);  // P2M or L2P per body and M2M or L2L per leaf
+  }
+
+  //! Estimated cost above which a pass of the given total cost spawns a task for a subtree
+  inline real_t spawnCost(real_t total) {
+    return std::max(costSpawn, total / (taskPerThread * omp_get_max_threads()));// Split pass among threads, but not finer than costSpawn
+  }
+
+  //! Number of target bodies above which a tree walk over nbody targets spawns a task for a subtree
+  //! A walk visits about the same number of cell pairs per target body, so its bodies measure its cost
+  inline int spawnBodies(int nbody) {
+    return std::max(bodySpawn, nbody / (taskPerThread * omp_get_max_threads()));// Split walk among threads, but not finer than bodySpawn
+  }
+
+  void L2L(Cell * Cj, const FMM & fmm) {
+    EXAFMM_SWITCH_P(fmm.P, L2L, Cj, fmm)
+  }
+
+  void L2P(Cell * Ci, const FMM & fmm) {
+    switch (fmm.output) {
+      case POTENTIAL: EXAFMM_SWITCH_P(fmm.P, L2P, Ci, fmm, Output<POTENTIAL>()) break;
+      case FORCE: EXAFMM_SWITCH_P(fmm.P, L2P, Ci, fmm, Output<FORCE>()) break;
+      default: EXAFMM_SWITCH_P(fmm.P, L2P, Ci, fmm, Output<POTENTIAL|FORCE>())
+    }
+  }
+
+  //! P2P kernel specialized for the outputs of fmm
+  void P2P(Cell * Ci, Cell * Cj, const FMM & fmm) {
+    switch (fmm.output) {
+      case POTENTIAL: P2P(Ci, Cj, Output<POTENTIAL>()); break;
+      case FORCE: P2P(Ci, Cj, Output<FORCE>()); break;
+      default: P2P(Ci, Cj, Output<POTENTIAL|FORCE>());
+    }
+  }
+
+  //! Direct P2P kernel of both potential and force
+  void P2P(Cell * Ci, Cell * Cj) {
+    P2P(Ci, Cj, Output<POTENTIAL|FORCE>());
+  }
+
+  //! Mutual P2P kernel specialized for the outputs of fmm
+  void P2P(Cell * Ci, Cell * Cj, real_t * Rj, const FMM & fmm) {
+    switch (fmm.output) {
+      case POTENTIAL: P2P(Ci, Cj, Rj, Output<POTENTIAL>()); break;
+      case FORCE: P2P(Ci, Cj, Rj, Output<FORCE>()); break;
+      default: P2P(Ci, Cj, Rj, Output<POTENTIAL|FORCE>());
     }
   }
 }
@@ -0,0 +1,250 @@
+#ifndef scheduler_h
+#define scheduler_h
+#include <algorithm>
+#include <atomic>
+#include <omp.h>
+#include "exafmm.h"
+#if EXAFMM_STEAL
+#include <functional>
+#include <mutex>
+#include <thread>
+#endif
+
+namespace exafmm {
+  //! Loop over items split into ranges by partition, called by all threads of a parallel region
+  //! Each thread first runs the items of its own range in order, then takes the items left in the ranges of others
+  class OwnedLoop {
+    std::vector<int> begin;                                     //!< First item of each range
+    std::vector<std::atomic<int> > next;                        //!< Next item of each range that no thread took
+
+  public:
+    //! Loop over n items, in one range shared by all threads if there are no ranges
+    OwnedLoop(const std::vector<int> & _begin, int n) : begin(_begin.empty() ? std::vector<int>{0, n} : _begin), next(begin.size() - 1) {
+      for (size_t r=0; r<next.size(); r++) next[r] = begin[r];  // No item is taken yet
+    }
+
+    //! Call f(i) for every item that this thread takes
+    template<typename F>
+    void run(const F & f) {
+      int nrange = next.size();                                 // Number of ranges
+      for (int k=0; k<nrange; k++) {                            // Loop over ranges, own range first
+        int r = (omp_get_thread_num() + k) % nrange;            //  Range index
+        for (int i=next[r]++; i<begin[r+1]; i=next[r]++) f(i);  //  Take items of range until none is left
+      }                                                         // End loop over ranges
+    }
+  };
+
+#if EXAFMM_STEAL
+  //! Task of the work-stealing runtime
+  struct Task {
+    std::function<void()> run;                                  //!< Work of the task
+    std::atomic<int> * pending;                                 //!< Number of unfinished tasks of its group
+  };
+
+  //! Chase-Lev deque of tasks: its worker pushes and pops at the bottom, thieves steal from the top
+  class Deque {
+    static const long capacity = 1 << 12;                       //!< Number of slots, a power of two
+    alignas(64) std::atomic<long> top;                          //!< Index of oldest task, written by thieves
+    alignas(64) std::atomic<long> bottom;                       //!< Index past newest task, written by its worker
+    std::atomic<Task*> tasks[capacity];                         //!< Ring buffer of tasks
+
+  public:
+    Deque() : top(0), bottom(0) {}
+
+    //! Push a task at the bottom, returns false if the deque is full
+    bool push(Task * task) {
+      long b = bottom.load(std::memory_order_relaxed);          // Bottom of deque
+      long t = top.load(std::memory_order_acquire);             // Top of deque
+      if (b - t >= capacity) return false;                      // Deque is full
+      tasks[b & (capacity - 1)].store(task, std::memory_order_relaxed);// Store task
+      std::atomic_thread_fence(std::memory_order_release);      // Publish task before bottom
+      bottom.store(b + 1, std::memory_order_relaxed);           // Advance bottom
+      return true;
+    }
+
+    //! Pop the newest task from the bottom, NULL if the deque is empty or a thief took the last task
+    Task * pop() {
+      long b = bottom.load(std::memory_order_relaxed) - 1;      // Claim bottom task
+      bottom.store(b, std::memory_order_relaxed);               // Before reading top
+      std::atomic_thread_fence(std::memory_order_seq_cst);      // Order against thieves
+      long t = top.load(std::memory_order_relaxed);             // Top of deque
+      if (t > b) {                                              // If deque is empty
+        bottom.store(b + 1, std::memory_order_relaxed);         //  Restore bottom
+        return NULL;                                            //  No task
+      }                                                         // End if for empty deque
+      Task * task = tasks[b & (capacity - 1)].load(std::memory_order_relaxed);// Bottom task
+      if (t == b) {                                             // If it is the last task
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+          task = NULL;                                          //  A thief took it
+        bottom.store(b + 1, std::memory_order_relaxed);         //  Deque is empty either way
+      }                                                         // End if for last task
+      return task;
+    }
+
+    //! Steal the oldest task from the top, NULL if the deque is empty or another thread won the race
+    Task * steal() {
+      long t = top.load(std::memory_order_acquire);             // Top of deque
+      std::atomic_thread_fence(std::memory_order_seq_cst);      // Order against the worker
+      long b = bottom.load(std::memory_order_acquire);          // Bottom of deque
+      if (t >= b) return NULL;                                  // Deque is empty
+      Task * task = tasks[t & (capacity - 1)].load(std::memory_order_relaxed);// Top task
+      if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return NULL;                                            // Another thread took it
+      return task;
+    }
+  };
+
+  //! Tasks that other threads hand to the thread that owns their cells
+  struct alignas(64) Mailbox {
+    std::mutex lock;                                            //!< Lock of tasks
+    std::vector<Task*> tasks;                                   //!< Tasks handed to this thread
+    std::atomic<int> size{0};                                   //!< Number of tasks, read without the lock
+
+    //! Hand a task to this thread
+    void post(Task * task) {
+      std::lock_guard<std::mutex> guard(lock);                  // Lock tasks
+      tasks.push_back(task);                                    // Append task
+      size.fetch_add(1, std::memory_order_relaxed);             // Count task
+    }
+
+    //! Take the newest task, NULL if there is none
+    Task * take() {
+      if (size.load(std::memory_order_relaxed) == 0) return NULL;// Skip the lock if there is no task
+      std::lock_guard<std::mutex> guard(lock);                  // Lock tasks
+      if (tasks.empty()) return NULL;                           // Another thread took the last task
+      Task * task = tasks.back();                               // Newest task
+      tasks.pop_back();                                         // Remove task
+      size.fetch_sub(1, std::memory_order_relaxed);             // Uncount task
+      return task;
+    }
+  };
+
+  //! Deques of the threads of one runtime, one runtime per call of runTasks so concurrent solves stay apart
+  struct Workers {
+    Deque * deques;                                             //!< Deque of each thread
+    Mailbox * mailboxes;                                        //!< Tasks handed to each thread by others
+    int size;                                                   //!< Number of threads
+    const Cells * cells;                                        //!< Cells whose owners run their tasks, NULL if none
+  };
+
+  thread_local Workers * workers = NULL;                        //!< Runtime of this thread, NULL outside runTasks
+  thread_local int worker = 0;                                  //!< Index of this thread in its runtime
+  thread_local unsigned victim = 1;                             //!< State of random choice of victims
+
+  //! Run a task and count it as finished in its group
+  void execute(Task * task) {
+    task->run();                                                // Run task
+    task->pending->fetch_sub(1, std::memory_order_release);     // Publish its results to the waiting thread
+    delete task;                                                // Free task
+  }
+
+  //! Steal a task from a random other thread, or one handed to it, NULL if it has none
+  Task * steal() {
+    if (workers->size < 2) return NULL;                         // Nobody to steal from
+    victim ^= victim << 13;                                     // Xorshift random number
+    victim ^= victim >> 17;
+    victim ^= victim << 5;
+    int w = victim % (workers->size - 1);                       // Random thread other than this
+    w += w >= worker;                                           // Skip this thread
+    Task * task = workers->deques[w].steal();                   // Steal from top of its deque
+    return task ? task : workers->mailboxes[w].take();          // Else take a task handed to it
+  }
+
+  //! Next task of this thread: its newest own task, then a task handed to it, then a task of another thread
+  Task * findTask() {
+    Task * task = workers->deques[worker].pop();                // Newest task of this thread
+    if (!task) task = workers->mailboxes[worker].take();        // Else task handed to this thread
+    if (!task) task = steal();                                  // Else task of another thread
+    return task;
+  }
+#endif
+
+  //! Group of tasks that one thread spawns and waits for
+  //! EXAFMM_STEAL runs them on work-stealing deques, where a waiting thread runs other tasks instead of blocking;
+  //! otherwise they are untied OpenMP tasks. Thieves steal spawned children, not the continuation of their parent,
+  //! since stealing a continuation needs the compiler to capture the frame of the caller
+  class TaskGroup {
+#if EXAFMM_STEAL
+    std::atomic<int> pending;                                   //!< Number of unfinished tasks
+
+  public:
+    TaskGroup() : pending(0) {}
+
+    //! Spawn a task for cell C, handed to the thread that owns C, or call it at once outside runTasks or when the deque is full
+    template<typename F>
+    void run(const F & f, const Cell * C=NULL) {
+      if (!workers) return f();                                 // No runtime to spawn on
+      Task * task = new Task{f, &pending};                      // New task of this group
+      pending.fetch_add(1, std::memory_order_relaxed);          // Count unfinished task
+      int w = workers->cells ? workers->cells->owner(C) : -1;   // Thread that owns cell
+      if (w >= 0 && w < workers->size && w != worker) workers->mailboxes[w].post(task);// Hand task to its owner
+      else if (!workers->deques[worker].push(task)) execute(task);// Else run at once if deque is full
+    }
+
+    //! Run own and stolen tasks until every task of this group is done
+    void wait() {
+      while (pending.load(std::memory_order_acquire) > 0) {     // While tasks of this group are unfinished
+        Task * task = findTask();                               //  Task of this or another thread
+        if (task) execute(task);                                //  Run task
+        else std::this_thread::yield();                         //  Else let other threads run
+      }                                                         // End while for unfinished tasks
+    }
+#else
+  public:
+    //! Spawn an untied OpenMP task, which any thread may run
+    template<typename F>
+    void run(const F & f, const Cell * =NULL) {
+#pragma omp task untied firstprivate(f)                         // Start OpenMP task
+      f();                                                      // Run task
+    }
+
+    //! Synchronize OpenMP tasks
+    void wait() {
+#pragma omp taskwait                                            // Synchronize OpenMP tasks
+    }
+#endif
+  };
+
+  //! Call f on one thread of a new team whose other threads run the tasks it spawns
+  //! EXAFMM_STEAL hands tasks for cells to the thread that owns the cell, which runs them before it steals; OpenMP
+  //! tasks go to any thread, since OpenMP cannot direct a task to a thread
+#if EXAFMM_STEAL
+  template<typename F>
+  void runTasks(const F & f, const Cells * cells=NULL) {
+    if (workers) return f();                                    // Already inside a runtime
+    Workers team;                                               // Runtime of this call
+    team.size = omp_get_max_threads();                          // Number of threads
+    team.deques = new Deque[team.size];                         // Deque of each thread
+    team.mailboxes = new Mailbox[team.size];                    // Tasks handed to each thread
+    team.cells = cells;                                         // Cells whose owners run their tasks
+    std::atomic<bool> done(false);                              // Whether f has returned
+#pragma omp parallel num_threads(team.size)                     // Start OpenMP
+    {
+      workers = &team;                                          //  Join runtime
+      worker = omp_get_thread_num();                            //  Index of this thread
+      victim = worker + 1;                                      //  Seed random choice of victims
+      if (worker == 0) {                                        //  If master thread
+        f();                                                    //   Run f, which waits for all its tasks
+        done.store(true, std::memory_order_release);            //   Release other threads
+      } else {                                                  //  Else
+        while (!done.load(std::memory_order_acquire)) {         //   While f is running
+          Task * task = findTask();                             //    Task handed to this thread or of another
+          if (task) execute(task);                              //    Run task
+          else std::this_thread::yield();                       //    Else let other threads run
+        }                                                       //   End while for f
+      }                                                         //  End if for master thread
+      workers = NULL;                                           //  Leave runtime
+    }                                                           // End OpenMP
+    delete[] team.deques;                                       // Free deques
+    delete[] team.mailboxes;                                    // Free mailboxes
+  }
+#else
+  template<typename F>
+  void runTasks(const F & f, const Cells * =NULL) {
+#pragma omp parallel                                            // Start OpenMP
+#pragma omp single nowait                                       // Start OpenMP single region with nowait
+    f();                                                        // Run f, which waits for all its tasks
+  }
+#endif
+}
+#endif
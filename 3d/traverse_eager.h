@@ -1,72 +1,233 @@
 #ifndef traverse_eager_h
 #define traverse_eager_h
+#include <algorithm>
 #include "exafmm.h"
+#include "scheduler.h"
 
 namespace exafmm {
-  //! Recursive call to post-order tree traversal for upward pass
-  void upwardPass(Cell * Ci) {
+  //! Recursive call to post-order tree traversal for upward pass, with a task for each subtree that costs more than spawn
+  void upwardPass(Cell * Ci, const FMM & fmm, real_t spawn) {
+    TaskGroup tasks;                                            // Tasks of child cells
     for (Cell * Cj=Ci->CHILD; Cj!=Ci->CHILD+Ci->NCHILD; Cj++) { // Loop over child cells
-#pragma omp task untied if(Cj->NBODY > 100)                     //  Start OpenMP task if large enough task
-      upwardPass(Cj);                                           //  Recursive call for child cell
+      if (costExpansion(Cj, fmm) > spawn) {                     //  If large enough task
+        tasks.run([=, &fmm] { upwardPass(Cj, fmm, spawn); }, Cj);//  Recursive call for child cell in a task of its owner
+      } else {                                                  //  Else
+        upwardPass(Cj, fmm, spawn);                             //   Recursive call for child cell
+      }                                                         //  End if for large enough task
     }                                                           // End loop over child cells
-#pragma omp taskwait                                            // Synchronize OpenMP tasks
-    Ci->M.resize(NTERM, 0.0);                                   // Allocate and initialize multipole coefs
-    Ci->L.resize(NTERM, 0.0);                                   // Allocate and initialize local coefs
-    if(Ci->NCHILD==0) P2M(Ci);                                  // P2M kernel
-    M2M(Ci);                                                    // M2M kernel
+    tasks.wait();                                               // Synchronize tasks
+    std::fill(Ci->M, Ci->M + NRHS * fmm.NTERM, 0.0);            // Initialize multipole coefs
+    std::fill(Ci->L, Ci->L + NRHS * fmm.NTERM, 0.0);            // Initialize local coefs
+    if(Ci->NCHILD==0) P2M(Ci, fmm);                             // P2M kernel
+    M2M(Ci, fmm);                                               // M2M kernel
   }
 
   //! Upward pass interface
-  void upwardPass(Cells & cells) {
-#pragma omp parallel                                            // Start OpenMP
-#pragma omp single nowait                                       // Start OpenMP single region with nowait
-    upwardPass(&cells[0]);                                      // Pass root cell to recursive call
+  void upwardPass(Cells & cells, const FMM & fmm) {
+    initCoefs(cells, fmm);                                      // Allocate coefs of all cells at once
+    real_t spawn = spawnCost(costExpansion(&cells[0], fmm));    // Least cost of a task
+    runTasks([&] { upwardPass(&cells[0], fmm, spawn); }, &cells);// Pass root cell to recursive call
   }
 
-  //! Recursive call to dual tree traversal for horizontal pass
-  void horizontalPass(Cell * Ci, Cell * Cj) {
+  //! Recursive call to dual tree traversal that adds the estimated cost of each interaction to its target cell
+  //! Every pair costs the same to visit, so this walk spawns a task for each target subtree with more than spawn bodies
+  //! Tasks and taskwaits cost microseconds even when undeferred, so small calls recurse without them
+  void getCost(Cell * Ci, Cell * Cj, const FMM & fmm, int spawn) {
+    real_t dX[3];                                               // Distance vector
     for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d];        // Distance vector from source to target
-    real_t R2 = norm(dX) * theta * theta;                       // Scalar distance squared
+    real_t R2 = norm(dX) * fmm.theta * fmm.theta;               // Scalar distance squared
     if (R2 > (Ci->R + Cj->R) * (Ci->R + Cj->R)) {               // If distance is far enough
-      M2L(Ci, Cj);                                              //  M2L kernel
+      Ci->COST += costM2L(fmm);                                 //  Cost of M2L
     } else if (Ci->NCHILD == 0 && Cj->NCHILD == 0) {            // Else if both cells are leafs
-      P2P(Ci, Cj);                                              //  P2P kernel
+      Ci->COST += real_t(Ci->NBODY) * Cj->NBODY;                //  Cost of P2P
     } else if (Cj->NCHILD == 0 || (Ci->R >= Cj->R && Ci->NCHILD != 0)) {// If Cj is leaf or Ci is larger
+      TaskGroup tasks;                                          //  Tasks of Ci's children
       for (Cell * ci=Ci->CHILD; ci!=Ci->CHILD+Ci->NCHILD; ci++) {// Loop over Ci's children
-#pragma omp task untied if(ci->NBODY > 100)                     //   Start OpenMP task if large enough task
-        horizontalPass(ci, Cj);                                 //   Recursive call to target child cells
+        if (ci->NBODY > spawn) {                                //   If large enough task
+          tasks.run([=, &fmm] { getCost(ci, Cj, fmm, spawn); }, ci);// Recursive call to target child cells in a task of its owner
+        } else {                                                //   Else
+          getCost(ci, Cj, fmm, spawn);                          //    Recursive call to target child cells
+        }                                                       //   End if for large enough task
       }                                                         //  End loop over Ci's children
+      tasks.wait();                                             //  Synchronize tasks
     } else {                                                    // Else if Ci is leaf or Cj is larger
       for (Cell * cj=Cj->CHILD; cj!=Cj->CHILD+Cj->NCHILD; cj++) {// Loop over Cj's children
-        horizontalPass(Ci, cj);                                 //   Recursive call to source child cells
+        getCost(Ci, cj, fmm, spawn);                            //   Recursive call to source child cells
+      }                                                         //  End loop over Cj's children
+    }                                                           // End if for leafs and Ci Cj size
+  }
+
+  //! Clear estimated costs of the subtree of Ci
+  void clearCost(Cell * Ci) {
+    Ci->COST = 0;                                               // Clear cost of cell
+    for (Cell * ci=Ci->CHILD; ci!=Ci->CHILD+Ci->NCHILD; ci++) clearCost(ci);// Recursive call for child cells
+  }
+
+  //! Add estimated costs of child subtrees to their parents, returns the cost of the subtree of Ci
+  real_t sumCost(Cell * Ci) {
+    for (Cell * ci=Ci->CHILD; ci!=Ci->CHILD+Ci->NCHILD; ci++) Ci->COST += sumCost(ci);// Add cost of child subtrees
+    return Ci->COST;                                            // Return cost of subtree
+  }
+
+  //! Estimate the cost of interactions of every target subtree, which decides task spawning of the horizontal pass
+  void initCost(Cell * Ci, Cell * Cj, const FMM & fmm) {
+    clearCost(Ci);                                              // Clear costs of target tree
+    getCost(Ci, Cj, fmm, spawnBodies(Ci->NBODY));               // Add cost of each interaction to its target cell
+    sumCost(Ci);                                                // Sum costs up the target tree
+  }
+
+  //! Private copy of the part of a target subtree that a task of a source split reaches, into which it accumulates
+  struct Accumulator {
+    std::vector<Cell*> origin;                                  //!< Original of each copied cell
+    Cells cells;                                                //!< Copied cells in breadth-first order
+    Bodies bodies;                                              //!< Positions and charges of copied leafs, cleared outputs
+  };
+
+  //! Dual tree traversal without kernels that collects the target cells whose children the traversal visits
+  void getSplits(Cell * Ci, Cell * Cj, const FMM & fmm, std::vector<Cell*> & splits) {
+    real_t dX[3];                                               // Distance vector
+    for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d];        // Distance vector from source to target
+    real_t R2 = norm(dX) * fmm.theta * fmm.theta;               // Scalar distance squared
+    if (R2 > (Ci->R + Cj->R) * (Ci->R + Cj->R)) {               // If distance is far enough
+      return;                                                   //  M2L reaches no children
+    } else if (Ci->NCHILD == 0 && Cj->NCHILD == 0) {            // Else if both cells are leafs
+      return;                                                   //  P2P reaches no children
+    } else if (Cj->NCHILD == 0 || (Ci->R >= Cj->R && Ci->NCHILD != 0)) {// If Cj is leaf or Ci is larger
+      splits.push_back(Ci);                                     //  Children of Ci are reached
+      for (Cell * ci=Ci->CHILD; ci!=Ci->CHILD+Ci->NCHILD; ci++) {// Loop over Ci's children
+        getSplits(ci, Cj, fmm, splits);                         //   Recursive call to target child cells
+      }                                                         //  End loop over Ci's children
+    } else {                                                    // Else if Ci is leaf or Cj is larger
+      for (Cell * cj=Cj->CHILD; cj!=Cj->CHILD+Cj->NCHILD; cj++) {// Loop over Cj's children
+        getSplits(Ci, cj, fmm, splits);                         //   Recursive call to source child cells
+      }                                                         //  End loop over Cj's children
+    }                                                           // End if for leafs and Ci Cj size
+  }
+
+  //! Copy the cells of the subtree of Ci that the traversal of Ci and Cj reaches, with cleared local coefs and outputs
+  //! Cells whose children are not reached keep NCHILD for the traversal but get no CHILD
+  void initAccumulator(Accumulator & acc, Cell * Ci, Cell * Cj, const FMM & fmm) {
+    std::vector<Cell*> splits;                                  // Target cells whose children are reached
+    getSplits(Ci, Cj, fmm, splits);                             // Collect them with a traversal without kernels
+    std::sort(splits.begin(), splits.end());                    // Sort for binary search
+    acc.origin.assign(1, Ci);                                   // Start from Ci
+    for (size_t n=0; n<acc.origin.size(); n++) {                // Loop over cells in breadth-first order
+      Cell * C = acc.origin[n];                                 //  Original cell
+      if (!std::binary_search(splits.begin(), splits.end(), C)) continue;// Skip children that are not reached
+      for (Cell * Cc=C->CHILD; Cc!=C->CHILD+C->NCHILD; Cc++) acc.origin.push_back(Cc);// Queue child cells
+    }                                                           // End loop over cells
+    acc.bodies.resize(Ci->NBODY);                               // Allocate bodies with cleared outputs
+    acc.cells.resize(acc.origin.size());                        // Allocate cells
+    int next = 1;                                               // Index of first child of next cell
+    for (size_t n=0; n<acc.cells.size(); n++) {                 // Loop over cells
+      Cell * C = acc.origin[n];                                 //  Original cell
+      acc.cells[n] = *C;                                        //  Copy cell
+      acc.cells[n].BODY = &acc.bodies[0] + (C->BODY - Ci->BODY);//  Bodies of copy
+      if (std::binary_search(splits.begin(), splits.end(), C)) {//  If children are reached
+        acc.cells[n].CHILD = &acc.cells[next];                  //   Children are contiguous in breadth-first order
+        next += C->NCHILD;                                      //   Skip children of this cell
+      } else {                                                  //  Else
+        acc.cells[n].CHILD = NULL;                              //   Children are not copied
+      }                                                         //  End if for reached children
+      if (C->NCHILD != 0) continue;                             //  Only leafs need bodies
+      Body * B = acc.cells[n].BODY;                             //  Bodies of copy
+      for (int b=0; b<C->NBODY; b++) {                          //  Loop over bodies of leaf
+        for (int d=0; d<3; d++) B[b].X[d] = C->BODY[b].X[d];    //   Copy position
+        for (int k=0; k<NRHS; k++) charge(B[b], k) = charge(C->BODY[b], k);// Copy charge
+        B[b].IBODY = C->BODY[b].IBODY;                          //   Copy body index
+      }                                                         //  End loop over bodies of leaf
+    }                                                           // End loop over cells
+    initCoefs(acc.cells, fmm);                                  // Allocate cleared coefs of copy
+  }
+
+  //! Add local coefs and outputs of a copied subtree to the original
+  void reduceAccumulator(Accumulator & acc, const FMM & fmm) {
+    for (size_t n=0; n<acc.cells.size(); n++) {                 // Loop over cells
+      Cell * C = acc.origin[n];                                 //  Original cell
+      for (int i=0; i<NRHS*fmm.NTERM; i++) C->L[i] += acc.cells[n].L[i];// Add local coefs
+      if (C->NCHILD != 0) continue;                             //  Only leafs have outputs
+      Body * B = acc.cells[n].BODY;                             //  Bodies of copy
+      for (int b=0; b<C->NBODY; b++) {                          //  Loop over bodies of leaf
+        for (int k=0; k<NRHS; k++) {                            //   Loop over right-hand sides
+          potential(C->BODY[b], k) += potential(B[b], k);       //    Add potential
+          for (int d=0; d<3; d++) force(C->BODY[b], k)[d] += force(B[b], k)[d];// Add force
+        }                                                       //   End loop over right-hand sides
+      }                                                         //  End loop over bodies of leaf
+    }                                                           // End loop over cells
+  }
+
+  //! Recursive call to dual tree traversal for horizontal pass, with a task for each target subtree that costs more than spawn
+  //! Tasks of a source split would race on the same target subtree, so each writes to a copy that is added once they are done
+  void horizontalPass(Cell * Ci, Cell * Cj, const FMM & fmm, real_t spawn) {
+    real_t dX[3];                                               // Distance vector
+    for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d];        // Distance vector from source to target
+    real_t R2 = norm(dX) * fmm.theta * fmm.theta;               // Scalar distance squared
+    if (R2 > (Ci->R + Cj->R) * (Ci->R + Cj->R)) {               // If distance is far enough
+      M2L(Ci, Cj, fmm);                                         //  M2L kernel
+    } else if (Ci->NCHILD == 0 && Cj->NCHILD == 0) {            // Else if both cells are leafs
+      P2P(Ci, Cj, fmm);                                         //  P2P kernel
+    } else if (Cj->NCHILD == 0 || (Ci->R >= Cj->R && Ci->NCHILD != 0)) {// If Cj is leaf or Ci is larger
+      TaskGroup tasks;                                          //  Tasks of Ci's children
+      for (Cell * ci=Ci->CHILD; ci!=Ci->CHILD+Ci->NCHILD; ci++) {// Loop over Ci's children
+        if (ci->COST > spawn) {                                 //   If large enough task
+          tasks.run([=, &fmm] { horizontalPass(ci, Cj, fmm, spawn); }, ci);// Recursive call to target child cells in a task of its owner
+        } else {                                                //   Else
+          horizontalPass(ci, Cj, fmm, spawn);                   //    Recursive call to target child cells
+        }                                                       //   End if for large enough task
+      }                                                         //  End loop over Ci's children
+      tasks.wait();                                             //  Synchronize tasks
+    } else if (real_t(Ci->NBODY) * Cj->NBODY > spawn) {         // Else if source split may be large enough to spawn
+      Accumulator accs[8];                                      //  Copies of Ci for tasks of Cj's children
+      for (Cell * cj=Cj->CHILD; cj!=Cj->CHILD+Cj->NCHILD-1; cj++) {// Loop over Cj's children, except the last
+        if (real_t(Ci->NBODY) * cj->NBODY > spawn) {            //   If large enough task
+          initAccumulator(accs[cj-Cj->CHILD], Ci, cj, fmm);     //    Copy Ci before any child writes to it
+        }                                                       //   End if for large enough task
+      }                                                         //  End loop over Cj's children
+      TaskGroup tasks;                                          //  Tasks of Cj's children
+      for (Cell * cj=Cj->CHILD; cj!=Cj->CHILD+Cj->NCHILD; cj++) {// Loop over Cj's children
+        Accumulator & acc = accs[cj-Cj->CHILD];                 //   Copy of Ci for this child
+        if (!acc.cells.empty()) {                               //   If child has a copy
+          tasks.run([=, &acc, &fmm] { horizontalPass(&acc.cells[0], cj, fmm, spawn); });// Recursive call in a task
+        } else {                                                //   Else
+          horizontalPass(Ci, cj, fmm, spawn);                   //    Recursive call to source child cells
+        }                                                       //   End if for large enough task
+      }                                                         //  End loop over Cj's children
+      tasks.wait();                                             //  Synchronize tasks
+      for (int n=0; n<8; n++) {                                 //  Loop over copies of Ci
+        if (!accs[n].cells.empty()) reduceAccumulator(accs[n], fmm);// Add results of task to Ci
+      }                                                         //  End loop over copies of Ci
+    } else {                                                    // Else if Ci is leaf or Cj is larger
+      for (Cell * cj=Cj->CHILD; cj!=Cj->CHILD+Cj->NCHILD; cj++) {// Loop over Cj's children
+        horizontalPass(Ci, cj, fmm, spawn);                     //   Recursive call to source child cells
       }                                                         //  End loop over Cj's children
     }                                                           // End if for leafs and Ci Cj size
-#pragma omp taskwait                                            // Synchronize OpenMP tasks
   }
 
   //! Horizontal pass interface
-  void horizontalPass(Cells & icells, Cells & jcells) {
-#pragma omp parallel                                            // Start OpenMP
-#pragma omp single nowait                                       // Start OpenMP single region with nowait
-    horizontalPass(&icells[0], &jcells[0]);                     // Pass root cell to recursive call
+  void horizontalPass(Cells & icells, Cells & jcells, FMM & fmm) {
+    runTasks([&] { initCost(&icells[0], &jcells[0], fmm); }, &icells);// Estimate cost of target subtrees
+    runTasks([&] { horizontalPass(&icells[0], &jcells[0], fmm, spawnCost(icells[0].COST)); }, &icells);// Pass root cell to recursive call
   }
 
-  //! Recursive call to pre-order tree traversal for downward pass
-  void downwardPass(Cell * Cj) {
-    L2L(Cj);                                                    // L2L kernel
-    if (Cj->NCHILD==0) L2P(Cj);                                 // L2P kernel
+  //! Recursive call to pre-order tree traversal for downward pass, with a task for each subtree that costs more than spawn
+  void downwardPass(Cell * Cj, const FMM & fmm, real_t spawn) {
+    L2L(Cj, fmm);                                               // L2L kernel
+    if (Cj->NCHILD==0) L2P(Cj, fmm);                            // L2P kernel
+    TaskGroup tasks;                                            // Tasks of child cells
     for (Cell * Ci=Cj->CHILD; Ci!=Cj->CHILD+Cj->NCHILD; Ci++) { // Loop over child cells
-#pragma omp task untied if(Ci->NBODY > 100)                     //  Start OpenMP task if large enough task
-      downwardPass(Ci);                                         //  Recursive call for child cell
+      if (costExpansion(Ci, fmm) > spawn) {                     //  If large enough task
+        tasks.run([=, &fmm] { downwardPass(Ci, fmm, spawn); }, Ci);// Recursive call for child cell in a task of its owner
+      } else {                                                  //  Else
+        downwardPass(Ci, fmm, spawn);                           //   Recursive call for child cell
+      }                                                         //  End if for large enough task
     }                                                           // End loop over chlid cells
-#pragma omp taskwait                                            // Synchronize OpenMP tasks
+    tasks.wait();                                               // Synchronize tasks
   }
 
   //! Downward pass interface
-  void downwardPass(Cells & cells) {
-#pragma omp parallel                                            // Start OpenMP
-#pragma omp single nowait                                       // Start OpenMP single region with nowait
-    downwardPass(&cells[0]);                                    // Pass root cell to recursive call
+  void downwardPass(Cells & cells, const FMM & fmm) {
+    real_t spawn = spawnCost(costExpansion(&cells[0], fmm));    // Least cost of a task
+    runTasks([&] { downwardPass(&cells[0], fmm, spawn); }, &cells);// Pass root cell to recursive call
   }
 
   //! Direct summation
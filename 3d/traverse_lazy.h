@@ -1,82 +1,460 @@
 #ifndef traverse_lazy_h
 #define traverse_lazy_h
+#include <algorithm>
+#include <omp.h>
 #include "exafmm.h"
+#include "scheduler.h"
 
 namespace exafmm {
-  //! Recursive call to post-order tree traversal for upward pass
-  void upwardPass(Cell * Ci) {
+  //! Recursive call to post-order tree traversal for upward pass, with a task for each subtree that costs more than spawn
+  void upwardPass(Cell * Ci, const FMM & fmm, real_t spawn) {
+    TaskGroup tasks;                                            // Tasks of child cells
     for (Cell * Cj=Ci->CHILD; Cj!=Ci->CHILD+Ci->NCHILD; Cj++) { // Loop over child cells
-#pragma omp task untied if(Cj->NBODY > 100)                     //  Start OpenMP task if large enough task
-      upwardPass(Cj);                                           //  Recursive call for child cell
+      if (costExpansion(Cj, fmm) > spawn) {                     //  If large enough task
+        tasks.run([=, &fmm] { upwardPass(Cj, fmm, spawn); }, Cj);//  Recursive call for child cell in a task of its owner
+      } else {                                                  //  Else
+        upwardPass(Cj, fmm, spawn);                             //   Recursive call for child cell
+      }                                                         //  End if for large enough task
     }                                                           // End loop over child cells
-#pragma omp taskwait                                            // Synchronize OpenMP tasks
-    Ci->M.resize(NTERM, 0.0);                                   // Allocate and initialize multipole coefs
-    Ci->L.resize(NTERM, 0.0);                                   // Allocate and initialize local coefs
-    if(Ci->NCHILD==0) P2M(Ci);                                  // P2M kernel
-    M2M(Ci);                                                    // M2M kernel
+    tasks.wait();                                               // Synchronize tasks
+    std::fill(Ci->M, Ci->M + NRHS * fmm.NTERM, 0.0);            // Initialize multipole coefs
+    std::fill(Ci->L, Ci->L + NRHS * fmm.NTERM, 0.0);            // Initialize local coefs
+    if(Ci->NCHILD==0) P2M(Ci, fmm);                             // P2M kernel
+    M2M(Ci, fmm);                                               // M2M kernel
   }
 
   //! Upward pass interface
-  void upwardPass(Cells & cells) {
-#pragma omp parallel                                            // Start OpenMP
-#pragma omp single nowait                                       // Start OpenMP single region with nowait
-    upwardPass(&cells[0]);                                      // Pass root cell to recursive call
+  void upwardPass(Cells & cells, const FMM & fmm) {
+    initCoefs(cells, fmm);                                      // Allocate coefs of all cells at once
+    real_t spawn = spawnCost(costExpansion(&cells[0], fmm));    // Least cost of a task
+    runTasks([&] { upwardPass(&cells[0], fmm, spawn); }, &cells);// Pass root cell to recursive call
   }
 
+  typedef std::vector<std::vector<int> > Pairs;                 //!< Flattened (target, source) index pairs of each thread
+
   //! Recursive call to dual tree traversal for list construction
-  void getList(Cell * Ci, Cell * Cj) {
+  //! Every pair costs the same to visit, so this walk spawns a task for each target subtree with more than spawn bodies;
+  //! small calls recurse without tasks
+  void getList(Cell * Ci, Cell * Cj, Cell * Ci0, Cell * Cj0, Pairs & pairM2L, Pairs & pairP2P, const FMM & fmm, int spawn) {
+    real_t dX[3];                                               // Distance vector
     for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d];        // Distance vector from source to target
-    real_t R2 = norm(dX) * theta * theta;                       // Scalar distance squared
-    if (R2 > (Ci->R + Cj->R) * (Ci->R + Cj->R)) {               // If distance is far enough
-      Ci->listM2L.push_back(Cj);                                //  Add to M2L list
+    real_t R2 = norm(dX) * fmm.theta * fmm.theta;               // Scalar distance squared
+    real_t R = Ci->R + Cj->R + 2 * fmm.skin;                    // Sum of radii inflated by the skin of both cells
+    if (R2 > R * R) {                                           // If distance is far enough
+      std::vector<int> & pairs = pairM2L[omp_get_thread_num()]; //  M2L pairs of this thread
+      pairs.push_back(Ci - Ci0);                                //  Add target index to M2L pairs
+      pairs.push_back(Cj - Cj0);                                //  Add source index to M2L pairs
     } else if (Ci->NCHILD == 0 && Cj->NCHILD == 0) {            // Else if both cells are leafs
-      Ci->listP2P.push_back(Cj);                                //  Add to P2P list
+      std::vector<int> & pairs = pairP2P[omp_get_thread_num()]; //  P2P pairs of this thread
+      pairs.push_back(Ci - Ci0);                                //  Add target index to P2P pairs
+      pairs.push_back(Cj - Cj0);                                //  Add source index to P2P pairs
     } else if (Cj->NCHILD == 0 || (Ci->R >= Cj->R && Ci->NCHILD != 0)) {// If Cj is leaf or Ci is larger
+      TaskGroup tasks;                                          //  Tasks of Ci's children
       for (Cell * ci=Ci->CHILD; ci!=Ci->CHILD+Ci->NCHILD; ci++) {// Loop over Ci's children
-        getList(ci, Cj);                                        //   Recursive call to target child cells
+        if (ci->NBODY > spawn) {                                //   If large enough task
+          tasks.run([=, &pairM2L, &pairP2P, &fmm] {             //    Recursive call to target child cells in a task of its owner
+            getList(ci, Cj, Ci0, Cj0, pairM2L, pairP2P, fmm, spawn);
+          }, ci);
+        } else {                                                //   Else
+          getList(ci, Cj, Ci0, Cj0, pairM2L, pairP2P, fmm, spawn);//  Recursive call to target child cells
+        }                                                       //   End if for large enough task
       }                                                         //  End loop over Ci's children
+      tasks.wait();                                             //  Synchronize tasks
     } else {                                                    // Else if Ci is leaf or Cj is larger
       for (Cell * cj=Cj->CHILD; cj!=Cj->CHILD+Cj->NCHILD; cj++) {// Loop over Cj's children
-        getList(Ci, cj);                                        //   Recursive call to source child cells
+        getList(Ci, cj, Ci0, Cj0, pairM2L, pairP2P, fmm, spawn);//   Recursive call to source child cells
       }                                                         //  End loop over Cj's children
     }                                                           // End if for leafs and Ci Cj size
   }
 
-    //! Evaluate M2L, P2P kernels
-  void evaluate(Cells & cells) {
+  //! Merge pairs of all threads into CSR offsets and source indices, sorted within each list
+  void pairs2CSR(Pairs & pairs, int ncell, std::vector<int> & offset, std::vector<int> & list) {
+    int nthreads = pairs.size();                                // Number of threads that collected pairs
+    std::vector<int> count(ncell * nthreads, 0);                // Count of pairs for each cell and thread
+#pragma omp parallel for
+    for (int t=0; t<nthreads; t++) {                            // Loop over threads
+      for (size_t k=0; k<pairs[t].size(); k+=2) {               //  Loop over pairs of thread
+        count[pairs[t][k]*nthreads+t]++;                        //   Count pair for target cell and thread
+      }                                                         //  End loop over pairs of thread
+    }                                                           // End loop over threads
+    offset.resize(ncell + 1);                                   // Allocate offsets
+    int sum = 0;                                                // Running sum of counts
+    for (int i=0; i<ncell; i++) {                               // Loop over target cells
+      offset[i] = sum;                                          //  Offset of list of target cell
+      for (int t=0; t<nthreads; t++) {                          //  Loop over threads
+        int c = count[i*nthreads+t];                            //   Count of pairs for target cell and thread
+        count[i*nthreads+t] = sum;                              //   Replace count with offset
+        sum += c;                                               //   Increment running sum
+      }                                                         //  End loop over threads
+    }                                                           // End loop over target cells
+    offset[ncell] = sum;                                        // End of last list
+    list.resize(sum);                                           // Allocate source indices
+#pragma omp parallel for
+    for (int t=0; t<nthreads; t++) {                            // Loop over threads
+      for (size_t k=0; k<pairs[t].size(); k+=2) {               //  Loop over pairs of thread
+        list[count[pairs[t][k]*nthreads+t]++] = pairs[t][k+1];  //   Scatter source index to its list
+      }                                                         //  End loop over pairs of thread
+    }                                                           // End loop over threads
 #pragma omp parallel for schedule(dynamic)
-    for (size_t i=0; i<cells.size(); i++) {                     // Loop over cells
-      for (size_t j=0; j<cells[i].listM2L.size(); j++) {        //  Loop over M2L list
-        M2L(&cells[i],cells[i].listM2L[j]);                     //   M2L kernel
-      }                                                         //  End loop over M2L list
-      for (size_t j=0; j<cells[i].listP2P.size(); j++) {        //  Loop over P2P list
-        P2P(&cells[i],cells[i].listP2P[j]);                     //   P2P kernel
-      }                                                         //  End loop over P2P list
+    for (int i=0; i<ncell; i++) {                               // Loop over target cells
+      std::sort(list.begin()+offset[i], list.begin()+offset[i+1]);//  Sort list for deterministic order
+    }                                                           // End loop over target cells
+  }
+
+  //! Estimated cost of the lists of target cell i alone in P2P body pairs
+  real_t listCost(int i, Cells & icells, Cells & jcells, const FMM & fmm) {
+    const Lists & lists = fmm.lists;                            // Interaction lists
+    real_t cost = (lists.offsetM2L[i+1] - lists.offsetM2L[i]) * costM2L(fmm);// Cost of M2L list
+    for (int k=lists.offsetP2P[i]; k<lists.offsetP2P[i+1]; k++) {// Loop over P2P list
+      cost += real_t(icells[i].NBODY) * jcells[lists.listP2P[k]].NBODY;// Cost of P2P
+    }                                                           // End loop over P2P list
+    return cost;                                                // Return cost of lists
+  }
+
+  //! Target cell indices in descending order of the estimated cost of their lists alone
+  std::vector<int> sortCells(Cells & icells, Cells & jcells, const FMM & fmm) {
+    int ncell = icells.size();                                  // Number of target cells
+    std::vector<real_t> cost(ncell);                            // Cost of lists of each target cell
+#pragma omp parallel for
+    for (int i=0; i<ncell; i++) cost[i] = listCost(i, icells, jcells, fmm);// Cost of lists of target cell
+    std::vector<int> order(ncell);                              // Order of target cells
+    for (int i=0; i<ncell; i++) order[i] = i;                   // Initialize order of target cells
+    std::stable_sort(order.begin(), order.end(), [&](int i, int j) {// Sort target cells
+      return cost[i] > cost[j];                                 //  In descending order of cost
+    });
+    return order;                                               // Return order of target cells
+  }
+
+  //! Estimate the cost of the lists of each target cell and sum it up the target tree
+  void getCost(Cells & icells, Cells & jcells, const FMM & fmm) {
+    int ncell = icells.size();                                  // Number of target cells
+#pragma omp parallel for
+    for (int i=0; i<ncell; i++) icells[i].COST = listCost(i, icells, jcells, fmm);// Cost of lists of target cell
+    for (int i=ncell-1; i>=0; i--) {                            // Loop over target cells from the leafs, after their parents
+      Cell * Ci = &icells[i];                                   //  Target cell
+      for (Cell * ci=Ci->CHILD; ci!=Ci->CHILD+Ci->NCHILD; ci++) Ci->COST += ci->COST;// Add cost of child subtrees
+    }                                                           // End loop over target cells
+  }
+
+  //! Build CSR interaction lists with a parallel dual tree traversal
+  void getList(Cells & icells, Cells & jcells, FMM & fmm) {
+    Pairs pairM2L(omp_get_max_threads()), pairP2P(omp_get_max_threads());// Pairs of each thread
+    int spawn = spawnBodies(icells[0].NBODY);                   // Bodies above which a target subtree gets a task
+    runTasks([&] { getList(&icells[0], &jcells[0], &icells[0], &jcells[0], pairM2L, pairP2P, fmm, spawn); }, &icells);// Pass root cells to recursive call
+    pairs2CSR(pairM2L, icells.size(), fmm.lists.offsetM2L, fmm.lists.listM2L);// Merge M2L pairs into CSR
+    pairs2CSR(pairP2P, icells.size(), fmm.lists.offsetP2P, fmm.lists.listP2P);// Merge P2P pairs into CSR
+    getCost(icells, jcells, fmm);                               // Estimate cost of target subtrees
+  }
+
+  //! Save body positions of a tree for checking displacements against the skin
+  void savePositions(Cells & cells, std::vector<real_t> & X0) {
+    Body * B = cells[0].BODY;                                   // First body of the tree
+    int nbody = cells[0].NBODY;                                 // Number of bodies in the tree
+    X0.resize(3 * nbody);                                       // Allocate positions
+#pragma omp parallel for
+    for (int b=0; b<nbody; b++) {                               // Loop over bodies
+      for (int d=0; d<3; d++) X0[3*b+d] = B[b].X[d];            //  Save position
+    }                                                           // End loop over bodies
+  }
+
+  //! Check if no body of a tree has moved more than the skin since the positions were saved
+  bool withinSkin(Cells & cells, const std::vector<real_t> & X0, real_t skin) {
+    Body * B = cells[0].BODY;                                   // First body of the tree
+    int nbody = cells[0].NBODY;                                 // Number of bodies in the tree
+    if (int(X0.size()) != 3 * nbody) return false;              // Positions belong to another tree
+    real_t R2max = 0;                                           // Maximum squared displacement
+#pragma omp parallel for reduction(max:R2max)
+    for (int b=0; b<nbody; b++) {                               // Loop over bodies
+      real_t dx[3];                                             //  Displacement of body
+      for (int d=0; d<3; d++) dx[d] = B[b].X[d] - X0[3*b+d];    //  Displacement since lists were built
+      R2max = std::max(R2max, norm(dx));                        //  Update maximum squared displacement
+    }                                                           // End loop over bodies
+    return R2max < skin * skin;                                 // Compare with skin
+  }
+
+  //! Check if the lists of the last horizontal pass can be reused for these trees
+  bool reuseList(Cells & icells, Cells & jcells, const FMM & fmm) {
+    const Lists & lists = fmm.lists;                            // Lists of the last horizontal pass
+    if (lists.skin == 0 || lists.ncrit != fmm.ncrit) return false;// Lists were built without skin or for another tree
+    if (icells.tree == 0 || lists.itree != icells.tree || lists.jtree != jcells.tree) return false;// Lists were built for other trees
+    return withinSkin(icells, lists.Xi0, lists.skin) && withinSkin(jcells, lists.Xj0, lists.skin);// Check displacements of all bodies
+  }
+
+  //! Check if the P2P list of source cell j also contains target cell i
+  bool isMutual(int i, int j, const Lists & lists) {
+    const int * begin = &lists.listP2P[0] + lists.offsetP2P[j]; // Begin of sorted list of j
+    const int * end = &lists.listP2P[0] + lists.offsetP2P[j+1]; // End of sorted list of j
+    return std::binary_search(begin, end, i);                   // Search for i in list of j
+  }
+
+  //! Reactions of the mutual P2P of one thread, kept only for the source leafs that thread reached
+  struct Reactions {
+    std::vector<int> offset;                                    //!< Offset of reactions of each cell, -1 if not reached
+    std::vector<int> reached;                                   //!< Cells reached, in the order they were reached
+    std::vector<real_t> values;                                 //!< Potential and force of each right-hand side of their bodies
+  };
+
+  //! Reactions on the bodies of source leaf j, allocated and cleared when the thread first reaches j
+  real_t * getReactions(Reactions & reactions, int j, int nbody) {
+    if (reactions.offset[j] < 0) {                              // If leaf is reached for the first time
+      reactions.offset[j] = reactions.values.size();            //  Append its reactions
+      reactions.reached.push_back(j);                           //  Remember leaf for the reduction
+      reactions.values.resize(reactions.values.size() + 4 * NRHS * nbody, 0);// Clear its reactions
+    }                                                           // End if for first time
+    return &reactions.values[reactions.offset[j]];              // Reactions of leaf
+  }
+
+  //! P2P list of target cell i; with reactions, pairs listed both ways are computed once by the lower index
+  void evaluateP2P(int i, Cells & icells, Cells & jcells, Reactions * reactions, const FMM & fmm) {
+    const Lists & lists = fmm.lists;                            // Interaction lists
+    Cell * Ci = &icells[i];                                     // Target cell
+    for (int k=lists.offsetP2P[i]; k<lists.offsetP2P[i+1]; k++) {// Loop over P2P list
+      int j = lists.listP2P[k];                                 //  Source cell index
+      Cell * Cj = &jcells[j];                                   //  Source cell
+      if (!reactions || j == i || !isMutual(i, j, lists)) {     //  If pair is one-sided
+        P2P(Ci, Cj, fmm);                                       //   P2P kernel
+      } else if (i < j) {                                       //  Else if this cell owns the pair
+        P2P(Ci, Cj, getReactions(*reactions, j, Cj->NBODY), fmm);// Mutual P2P kernel
+      }                                                         //  End if for mutual pair
+    }                                                           // End loop over P2P list
+  }
+
+  //! Clear the reactions of this thread for a tree of ncell cells, inside a parallel region
+  Reactions * initReactions(std::vector<Reactions> & reactions, int ncell) {
+    Reactions & r = reactions[omp_get_thread_num()];            // Reactions of this thread
+    r.offset.assign(ncell, -1);                                 // No leaf is reached yet
+    r.reached.clear();                                          // Clear reached leafs
+    r.values.clear();                                           // Clear values
+    return &r;
+  }
+
+  //! Add the reactions of all threads to the bodies of the leafs they reached, inside a parallel region
+  //! Each leaf is summed by one thread, so the cost is the number of reactions and not the number of bodies times threads
+  void reduceReactions(std::vector<Reactions> & reactions, Cells & cells) {
+#pragma omp for schedule(dynamic)
+    for (int j=0; j<int(cells.size()); j++) {                   // Loop over cells
+      Body * B = cells[j].BODY;                                 //  Bodies of cell
+      for (size_t t=0; t<reactions.size(); t++) {               //  Loop over threads
+        if (reactions[t].offset.empty() || reactions[t].offset[j] < 0) continue;// Skip threads that did not reach cell
+        real_t * R = &reactions[t].values[reactions[t].offset[j]];//  Reactions of thread on cell
+        for (int b=0; b<cells[j].NBODY; b++) {                  //   Loop over bodies of cell
+          for (int k=0; k<NRHS; k++, R+=4) {                    //    Loop over right-hand sides
+            potential(B[b], k) += R[0];                         //     Add reaction to potential
+            for (int d=0; d<3; d++) force(B[b], k)[d] += R[1+d];//     Add reaction to force
+          }                                                     //    End loop over right-hand sides
+        }                                                       //   End loop over bodies of cell
+      }                                                         //  End loop over threads
     }                                                           // End loop over cells
   }
 
+  //! Evaluate M2L, P2P kernels, each thread on its own range of target cells first
+  void evaluate(Cells & icells, Cells & jcells, const FMM & fmm) {
+    const Lists & lists = fmm.lists;                            // Interaction lists
+    bool mutual = &icells == &jcells;                           // Compute P2P pairs once for the same tree
+    std::vector<Reactions> reactions(mutual ? omp_get_max_threads() : 0);// Reactions of mutual P2P of each thread
+    OwnedLoop loop(icells.owners, icells.size());               // Loop over ranges of target cells
+#pragma omp parallel                                            // Start OpenMP
+    {
+      Reactions * r = mutual ? initReactions(reactions, icells.size()) : NULL;// Reactions of this thread
+      loop.run([&](int i) {                                     //  Loop over target cells, own range first
+        Cell * Ci = &icells[i];                                 //   Target cell
+        for (int k=lists.offsetM2L[i]; k<lists.offsetM2L[i+1]; k++) {// Loop over M2L list
+          M2L(Ci, &jcells[lists.listM2L[k]], fmm);              //    M2L kernel
+        }                                                       //   End loop over M2L list
+        evaluateP2P(i, icells, jcells, r, fmm);                 //   P2P list
+      });                                                       //  End loop over target cells
+#pragma omp barrier
+      if (mutual) reduceReactions(reactions, icells);           //  Add reactions of mutual P2P to bodies
+    }                                                           // End OpenMP
+  }
+
+  //! Build interaction lists unless the lists of the last evaluation can be reused
+  void updateList(Cells & icells, Cells & jcells, FMM & fmm) {
+    if (reuseList(icells, jcells, fmm)) return;                 // Keep lists within the skin
+    getList(icells, jcells, fmm);                               // Build interaction lists
+    fmm.lists.itree = icells.tree;                              // Target tree the lists were built for
+    fmm.lists.jtree = jcells.tree;                              // Source tree the lists were built for
+    fmm.lists.ncrit = fmm.ncrit;                                // Leaf size the lists were built for
+    fmm.lists.skin = fmm.skin;                                  // Skin the lists were built with
+    if (fmm.skin > 0) {                                         // If lists may be reused
+      savePositions(icells, fmm.lists.Xi0);                     //  Save target positions
+      savePositions(jcells, fmm.lists.Xj0);                     //  Save source positions
+    }                                                           // End if for skin
+  }
+
   //! Horizontal pass interface
-  void horizontalPass(Cells & icells, Cells & jcells) {
-    getList(&icells[0], &jcells[0]);                            // Pass root cell to recursive call
-    evaluate(icells);                                           // Evaluate M2L & P2P kernels
+  void horizontalPass(Cells & icells, Cells & jcells, FMM & fmm) {
+    updateList(icells, jcells, fmm);                            // Build or reuse interaction lists
+    evaluate(icells, jcells, fmm);                              // Evaluate M2L & P2P kernels
   }
 
-  //! Recursive call to pre-order tree traversal for downward pass
-  void downwardPass(Cell * Cj) {
-    L2L(Cj);                                                    // L2L kernel
-    if (Cj->NCHILD==0) L2P(Cj);                                 // L2P kernel
+  //! Recursive call to pre-order tree traversal for downward pass, with a task for each subtree that costs more than spawn
+  void downwardPass(Cell * Cj, const FMM & fmm, real_t spawn) {
+    L2L(Cj, fmm);                                               // L2L kernel
+    if (Cj->NCHILD==0) L2P(Cj, fmm);                            // L2P kernel
+    TaskGroup tasks;                                            // Tasks of child cells
     for (Cell * Ci=Cj->CHILD; Ci!=Cj->CHILD+Cj->NCHILD; Ci++) { // Loop over child cells
-#pragma omp task untied if(Ci->NBODY > 100)                     //  Start OpenMP task if large enough task
-      downwardPass(Ci);                                         //  Recursive call for child cell
+      if (costExpansion(Ci, fmm) > spawn) {                     //  If large enough task
+        tasks.run([=, &fmm] { downwardPass(Ci, fmm, spawn); }, Ci);// Recursive call for child cell in a task of its owner
+      } else {                                                  //  Else
+        downwardPass(Ci, fmm, spawn);                           //   Recursive call for child cell
+      }                                                         //  End if for large enough task
     }                                                           // End loop over chlid cells
-#pragma omp taskwait                                            // Synchronize OpenMP tasks
+    tasks.wait();                                               // Synchronize tasks
   }
 
   //! Downward pass interface
-  void downwardPass(Cells & cells) {
+  void downwardPass(Cells & cells, const FMM & fmm) {
+    real_t spawn = spawnCost(costExpansion(&cells[0], fmm));    // Least cost of a task
+    runTasks([&] { downwardPass(&cells[0], fmm, spawn); }, &cells);// Pass root cell to recursive call
+  }
+
+  //! Dependency counters and shared data of the tasks of a dataflow evaluation
+  struct Dataflow {
+    Cells & cells;                                              //!< Cells of the tree
+    const FMM & fmm;                                            //!< Parameters, kernel tables and interaction lists
+    std::vector<int> parent;                                    //!< Index of parent cell, -1 for the root
+    std::vector<int> offsetT;                                   //!< Offset of list of M2L targets of each source cell
+    std::vector<int> listT;                                     //!< M2L target cell indices
+    std::vector<int> nup;                                       //!< Number of children whose multipoles are not ready
+    std::vector<int> nM2L;                                      //!< Number of M2L sources whose multipoles are not ready
+    std::vector<int> ndown;                                     //!< Number of unfinished M2L list, P2P list and parent L2L
+    std::vector<Reactions> reactions;                           //!< Reactions of mutual P2P of each thread
+    Dataflow(Cells & _cells, const FMM & _fmm) : cells(_cells), fmm(_fmm) {}
+  };
+
+  //! Decrement a dependency counter and return whether it reached zero
+  bool release(int & count) {
+    int left;                                                   // Count after decrement
+#pragma omp atomic capture
+    left = --count;                                             // Atomic decrement
+    return left == 0;                                           // Last dependency is done
+  }
+
+  //! Dataflow task of L2L from the parent and L2P, which releases the children
+  void downTask(Dataflow & flow, int i) {
+    Cell * Ci = &flow.cells[i];                                 // Cell of this task
+    int p = flow.parent[i];                                     // Parent index
+    if (p >= 0) {                                               // If cell has a parent
+      Cell Cp = flow.cells[p];                                  //  Copy of parent
+      Cp.CHILD = Ci;                                            //  whose only child is this cell,
+      Cp.NCHILD = 1;                                            //  so L2L does not touch siblings still in M2L
+      L2L(&Cp, flow.fmm);                                       //  L2L kernel
+    }                                                           // End if for parent
+    if (Ci->NCHILD==0) L2P(Ci, flow.fmm);                       // L2P kernel
+    int last = -1;                                              // Released child to run in this task
+    for (Cell * Cc=Ci->CHILD; Cc!=Ci->CHILD+Ci->NCHILD; Cc++) { // Loop over child cells
+      int c = Cc - &flow.cells[0];                              //  Child index
+      if (!release(flow.ndown[c])) continue;                    //  Skip child whose lists are not done
+      if (last >= 0) {                                          //  If a child is already released
+#pragma omp task untied shared(flow)                            //   Start OpenMP task
+        downTask(flow, last);                                   //   Downward task of that child
+      }                                                         //  End if for released child
+      last = c;                                                 //  Keep this child for this task
+    }                                                           // End loop over child cells
+    if (last >= 0) downTask(flow, last);                        // Downward task of last released child
+  }
+
+  //! Dataflow task of the M2L list of cell i, whose sources all have their multipoles
+  void M2LTask(Dataflow & flow, int i) {
+    const Lists & lists = flow.fmm.lists;                       // Interaction lists
+    Cell * Ci = &flow.cells[i];                                 // Target cell
+    for (int k=lists.offsetM2L[i]; k<lists.offsetM2L[i+1]; k++) {// Loop over M2L list
+      M2L(Ci, &flow.cells[lists.listM2L[k]], flow.fmm);         //  M2L kernel
+    }                                                           // End loop over M2L list
+    if (release(flow.ndown[i])) downTask(flow, i);              // Downward task if parent and P2P are done
+  }
+
+  //! Dataflow task of the P2P list of leaf i, which only needs bodies and can start at once
+  void P2PTask(Dataflow & flow, int i) {
+    Reactions * r = &flow.reactions[omp_get_thread_num()];      // Reactions of this thread
+    evaluateP2P(i, flow.cells, flow.cells, r, flow.fmm);        // P2P list, without a scheduling point
+    if (release(flow.ndown[i])) downTask(flow, i);              // Downward task if parent and M2L are done
+  }
+
+  //! Dataflow task of P2M and M2M of cell j, which releases its M2L targets and its parent
+  void upTask(Dataflow & flow, int j) {
+    Cell * Cj = &flow.cells[j];                                 // Cell of this task
+    if (Cj->NCHILD==0) P2M(Cj, flow.fmm);                       // P2M kernel
+    M2M(Cj, flow.fmm);                                          // M2M kernel
+    for (int k=flow.offsetT[j]; k<flow.offsetT[j+1]; k++) {     // Loop over M2L targets of this cell
+      int i = flow.listT[k];                                    //  Target cell index
+      if (release(flow.nM2L[i])) {                              //  If all sources of target are ready
+#pragma omp task untied shared(flow)                            //   Start OpenMP task
+        M2LTask(flow, i);                                       //   M2L task of target
+      }                                                         //  End if for ready target
+    }                                                           // End loop over M2L targets
+    int p = flow.parent[j];                                     // Parent index
+    if (p >= 0 && release(flow.nup[p])) upTask(flow, p);        // Upward task of parent after its last child
+  }
+
+  //! Transpose CSR lists of target cells into lists of the target cells of each source cell
+  void transposeCSR(const std::vector<int> & offset, const std::vector<int> & list, int ncell,
+                    std::vector<int> & offsetT, std::vector<int> & listT) {
+    offsetT.assign(ncell + 1, 0);                               // Clear counts
+    for (size_t k=0; k<list.size(); k++) offsetT[list[k]+1]++;  // Count targets of each source cell
+    for (int j=0; j<ncell; j++) offsetT[j+1] += offsetT[j];     // Offsets from counts
+    std::vector<int> next(offsetT.begin(), offsetT.end() - 1);  // Next free slot of each list
+    listT.resize(list.size());                                  // Allocate target indices
+    for (int i=0; i<ncell; i++) {                               // Loop over target cells
+      for (int k=offset[i]; k<offset[i+1]; k++) {               //  Loop over list of target cell
+        listT[next[list[k]]++] = i;                             //   Add target to list of source
+      }                                                         //  End loop over list
+    }                                                           // End loop over target cells
+  }
+
+  //! FMM evaluation of a tree on itself as one graph of tasks over the interaction lists
+  //! Each M2L list starts when the multipoles of its sources are done, P2P lists start at once,
+  //! and each L2L & L2P starts when its parent and its own lists are done, overlapping the three passes
+  void dataflowPass(Cells & cells, FMM & fmm) {
+    int ncell = cells.size();                                   // Number of cells
+    initCoefs(cells, fmm);                                      // Allocate coefs of all cells at once
+    updateList(cells, cells, fmm);                              // Build or reuse interaction lists
+    const Lists & lists = fmm.lists;                            // Interaction lists
+    Dataflow flow(cells, fmm);                                  // Dependencies of tasks
+    transposeCSR(lists.offsetM2L, lists.listM2L, ncell, flow.offsetT, flow.listT);// M2L targets of each source
+    flow.parent.assign(ncell, -1);                              // Root has no parent
+    flow.nup.resize(ncell);                                     // Allocate counters of upward tasks
+    flow.nM2L.resize(ncell);                                    // Allocate counters of M2L tasks
+    flow.ndown.resize(ncell);                                   // Allocate counters of downward tasks
+    for (int i=0; i<ncell; i++) {                               // Loop over cells
+      Cell * Ci = &cells[i];                                    //  Cell
+      for (Cell * Cc=Ci->CHILD; Cc!=Ci->CHILD+Ci->NCHILD; Cc++) flow.parent[Cc-&cells[0]] = i;// Parent of children
+      flow.nup[i] = Ci->NCHILD;                                 //  Wait for multipoles of children
+      flow.nM2L[i] = lists.offsetM2L[i+1] - lists.offsetM2L[i]; //  Wait for multipoles of M2L sources
+      flow.ndown[i] = (i != 0) + (flow.nM2L[i] != 0)            //  Wait for parent, M2L list
+        + (lists.offsetP2P[i+1] != lists.offsetP2P[i]);         //  and P2P list
+    }                                                           // End loop over cells
+    flow.reactions.resize(omp_get_max_threads());               // Reactions of each thread
+    std::vector<int> order = sortCells(cells, cells, fmm);      // Cells in descending order of cost of their lists
 #pragma omp parallel                                            // Start OpenMP
-#pragma omp single nowait                                       // Start OpenMP single region with nowait
-    downwardPass(&cells[0]);                                    // Pass root cell to recursive call
+    {
+      initReactions(flow.reactions, ncell);                     //  Clear reactions of this thread
+#pragma omp for
+      for (int i=0; i<ncell; i++) {                             //  Loop over cells
+        std::fill(cells[i].M, cells[i].M + 2 * NRHS * fmm.NTERM, 0.0);// Initialize multipole and local coefs
+      }                                                         //  End loop over cells
+#pragma omp single nowait                                       //  Start OpenMP single region with nowait
+      {
+        if (flow.ndown[0] == 0) {                               //   If root has no lists
+#pragma omp task untied shared(flow)                            //    Start OpenMP task
+          downTask(flow, 0);                                    //    Downward task of root
+        }                                                       //   End if for root
+        for (int i=ncell-1; i>=0; i--) {                        //   Loop over cells from the leafs
+          if (cells[i].NCHILD != 0) continue;                   //    Skip cells that are not leafs
+#pragma omp task untied shared(flow)                            //    Start OpenMP task
+          upTask(flow, i);                                      //    Upward task of leaf
+        }                                                       //   End loop over cells
+        for (int n=0; n<ncell; n++) {                           //   Loop over cells, most costly first
+          int i = order[n];                                     //    Cell index
+          if (lists.offsetP2P[i+1] == lists.offsetP2P[i]) continue;// Skip cell without a P2P list
+#pragma omp task untied shared(flow)                            //    Start OpenMP task
+          P2PTask(flow, i);                                     //    P2P task of cell
+        }                                                       //   End loop over cells
+      }                                                         //  End OpenMP single region
+#pragma omp barrier
+      reduceReactions(flow.reactions, cells);                   //  Add reactions of mutual P2P to bodies
+    }                                                           // End OpenMP
   }
 
   //! Direct summation
@@ -3,10 +3,22 @@
 #include "exafmm.h"
 
 namespace exafmm {
+  const int nspawn = 1000;                                      //!< Threshold of NBODY for spawning new OpenMP tasks
+
+  //! Structure of temporary octree nodes used during tree construction
+  struct Node {
+    int IBODY;                                                  //!< Index of first body in node
+    int NBODY;                                                  //!< Number of descendant bodies
+    int NNODE;                                                  //!< Number of descendant nodes including itself
+    Node * CHILD[8];                                            //!< Pointers of child nodes
+    real_t X[3];                                                //!< Node center
+  };
+
   //! Get bounding box of bodies
   void getBounds(Bodies & bodies, real_t & R0, real_t * X0) {
     real_t Xmin[3], Xmax[3];                                    // Min, max of domain
     for (int d=0; d<3; d++) Xmin[d] = Xmax[d] = bodies[0].X[d]; // Initialize Xmin, Xmax
+#pragma omp parallel for reduction(min:Xmin[:3]) reduction(max:Xmax[:3])
     for (size_t b=0; b<bodies.size(); b++) {                    // Loop over range of bodies
       for (int d=0; d<3; d++) Xmin[d] = fmin(bodies[b].X[d], Xmin[d]);//  Update Xmin
       for (int d=0; d<3; d++) Xmax[d] = fmax(bodies[b].X[d], Xmax[d]);//  Update Xmax
@@ -20,79 +32,154 @@ namespace exafmm {
     R0 *= 1.00001;                                              // Add some leeway to radius
   }
 
-  //! Build cells of tree adaptively using a top-down approach based on recursion
-  void buildCells(Body * bodies, Body * buffer, int begin, int end, Cell * cell, Cells & cells,
-                  real_t * X, real_t R, int level=0, bool direction=false) {
-    //! Create a tree cell
-    cell->BODY = bodies + begin;                                // Pointer of first body in cell
-    if(direction) cell->BODY = buffer + begin;                  // Pointer of first body in cell
-    cell->NBODY = end - begin;                                  // Number of bodies in cell
-    cell->NCHILD = 0;                                           // Initialize counter for child cells
-    for (int d=0; d<3; d++) cell->X[d] = X[d];                  // Center position of cell
-    cell->R = R / (1 << level);                                 // Cell radius
-    //! If cell is a leaf
+  //! Count number of bodies in each octant for a block of bodies
+  void countBodies(Body * bodies, int begin, int end, real_t * X, int * size) {
+    for (int i=0; i<8; i++) size[i] = 0;                        // Initialize octant counter
+    real_t x[3];                                                // Coordinates of bodies
+    for (int i=begin; i<end; i++) {                             // Loop over bodies in block
+      for (int d=0; d<3; d++) x[d] = bodies[i].X[d];            //  Position of body
+      int octant = (x[0] > X[0]) + ((x[1] > X[1]) << 1) + ((x[2] > X[2]) << 2);// Which octant body belongs to
+      size[octant]++;                                           //  Increment body count in octant
+    }                                                           // End loop over bodies in block
+  }
+
+  //! Sort a block of bodies by octant
+  void moveBodies(Body * bodies, Body * buffer, int begin, int end, real_t * X, int * counter) {
+    real_t x[3];                                                // Coordinates of bodies
+    for (int i=begin; i<end; i++) {                             // Loop over bodies in block
+      for (int d=0; d<3; d++) x[d] = bodies[i].X[d];            //  Position of body
+      int octant = (x[0] > X[0]) + ((x[1] > X[1]) << 1) + ((x[2] > X[2]) << 2);// Which octant body belongs to
+      for (int d=0; d<3; d++) buffer[counter[octant]].X[d] = bodies[i].X[d];// Permute bodies coordinates out-of-place according to octant
+      buffer[counter[octant]].q = bodies[i].q;                  //  Permute bodies sources out-of-place according to octant
+      buffer[counter[octant]].IBODY = bodies[i].IBODY;          //  Permute bodies numbering out-of-place according to octant
+      counter[octant]++;                                        //  Increment body count in octant
+    }                                                           // End loop over bodies in block
+  }
+
+  //! Build nodes of tree adaptively using a top-down approach based on recursion
+  Node * buildNodes(Body * bodies, Body * buffer, int begin, int end,
+                    real_t * X, real_t R, int ncrit, int level=0, bool direction=false) {
+    //! Create a tree node
+    Node * node = new Node;                                     // Allocate node in the memory of this task
+    node->IBODY = begin;                                        // Index of first body in node
+    node->NBODY = end - begin;                                  // Number of bodies in node
+    node->NNODE = 1;                                            // Initialize counter for descendant nodes
+    for (int i=0; i<8; i++) node->CHILD[i] = NULL;              // Initialize pointers of child nodes
+    for (int d=0; d<3; d++) node->X[d] = X[d];                  // Center position of node
+    //! If node is a leaf
     if (end - begin <= ncrit) {                                 // If number of bodies is less than threshold
       if (direction) {                                          //  If direction of data is from bodies to buffer
-        for (int i=begin; i<end; i++) {                         //   Loop over bodies in cell
+        for (int i=begin; i<end; i++) {                         //   Loop over bodies in node
           for (int d=0; d<3; d++) buffer[i].X[d] = bodies[i].X[d];//  Copy bodies coordinates to buffer
           buffer[i].q = bodies[i].q;                            //    Copy bodies source to buffer
-        }                                                       //   End loop over bodies in cell
+          buffer[i].IBODY = bodies[i].IBODY;                    //    Copy bodies numbering to buffer
+        }                                                       //   End loop over bodies in node
       }                                                         //  End if for direction of data
-      return;                                                   //  Return without recursion
+      return node;                                              //  Return without recursion
     }                                                           // End if for number of bodies
-    //! Count number of bodies in each octant
-    int size[8] = {0,0,0,0,0,0,0,0};
-    real_t x[3];                                                // Coordinates of bodies
-    for (int i=begin; i<end; i++) {                             // Loop over bodies in cell
-      for (int d=0; d<3; d++) x[d] = bodies[i].X[d];            //  Position of body
-      int octant = (x[0] > X[0]) + ((x[1] > X[1]) << 1) + ((x[2] > X[2]) << 2);// Which octant body belongs to
-      size[octant]++;                                           //  Increment body count in octant
-    }                                                           // End loop over bodies in cell
+    //! Count number of bodies in each octant, one task per block of nspawn bodies
+    int nblock = (end - begin - 1) / nspawn + 1;                // Number of blocks of bodies
+    std::vector<int> sizes(8 * nblock);                         // Body count in each octant of each block
+    for (int b=0; b<nblock; b++) {                              // Loop over blocks
+#pragma omp task shared(sizes) if(nblock > 1)                   //  Start OpenMP task if there are several blocks
+      countBodies(bodies, begin+b*nspawn, std::min(begin+(b+1)*nspawn, end), X, &sizes[8*b]);
+    }                                                           // End loop over blocks
+#pragma omp taskwait                                            // Synchronize OpenMP tasks
     //! Exclusive scan to get offsets
+    int size[8] = {0,0,0,0,0,0,0,0};                            // Body count in each octant
+    for (int b=0; b<nblock; b++) {                              // Loop over blocks
+      for (int i=0; i<8; i++) size[i] += sizes[8*b+i];          //  Accumulate body count in octant
+    }                                                           // End loop over blocks
     int offset = begin;                                         // Offset of first octant
-    int offsets[8], counter[8];                                 // Offsets and counter for each octant
+    int offsets[8];                                             // Offsets for each octant
     for (int i=0; i<8; i++) {                                   // Loop over elements
       offsets[i] = offset;                                      //  Set value
       offset += size[i];                                        //  Increment offset
-      if (size[i]) cell->NCHILD++;                              //  Increment child cell counter
     }                                                           // End loop over elements
-    //! Sort bodies by octant
-    for (int i=0; i<8; i++) counter[i] = offsets[i];            // Copy offsets to counter
-    for (int i=begin; i<end; i++) {                             // Loop over bodies
-      for (int d=0; d<3; d++) x[d] = bodies[i].X[d];            //  Position of body
-      int octant = (x[0] > X[0]) + ((x[1] > X[1]) << 1) + ((x[2] > X[2]) << 2);// Which octant body belongs to`
-      for (int d=0; d<3; d++) buffer[counter[octant]].X[d] = bodies[i].X[d];// Permute bodies coordinates out-of-place according to octant
-      buffer[counter[octant]].q = bodies[i].q;                  //  Permute bodies sources out-of-place according to octant
-      counter[octant]++;                                        //  Increment body count in octant
-    }                                                           // End loop over bodies
+    for (int i=0; i<8; i++) {                                   // Loop over octants
+      int counter = offsets[i];                                 //  Offset of first block in octant
+      for (int b=0; b<nblock; b++) {                            //  Loop over blocks
+        int count = sizes[8*b+i];                               //   Body count of block in octant
+        sizes[8*b+i] = counter;                                 //   Replace count with offset of block in octant
+        counter += count;                                       //   Increment offset
+      }                                                         //  End loop over blocks
+    }                                                           // End loop over octants
+    //! Sort bodies by octant, one task per block of nspawn bodies
+    for (int b=0; b<nblock; b++) {                              // Loop over blocks
+#pragma omp task shared(sizes) if(nblock > 1)                   //  Start OpenMP task if there are several blocks
+      moveBodies(bodies, buffer, begin+b*nspawn, std::min(begin+(b+1)*nspawn, end), X, &sizes[8*b]);
+    }                                                           // End loop over blocks
+#pragma omp taskwait                                            // Synchronize OpenMP tasks
     //! Loop over children and recurse
-    real_t Xchild[3];                                           // Coordinates of children
-    cells.resize(cells.size()+cell->NCHILD);                    // Resize cell vector
-    Cell * child = &cells.back() - cell->NCHILD + 1;            // Pointer for first child cell
-    cell->CHILD = child;                                        // Point to first child cell
-    int c = 0;                                                  // Counter for child cells
     for (int i=0; i<8; i++) {                                   // Loop over children
-      for (int d=0; d<3; d++) Xchild[d] = X[d];                 //  Initialize center position of child cell
-      real_t r = R / (1 << (level + 1));                        //  Radius of cells for child's level
-      for (int d=0; d<3; d++) {                                 //  Loop over dimensions
-        Xchild[d] += r * (((i & 1 << d) >> d) * 2 - 1);         //   Shift center position to that of child cell
-      }                                                         //  End loop over dimensions
       if (size[i]) {                                            //  If child exists
-        buildCells(buffer, bodies, offsets[i], offsets[i] + size[i],// Recursive call for each child
-                   &child[c], cells, Xchild, R, level+1, !direction);
-        c++;                                                    //   Increment child cell counter
+        real_t Xchild[3];                                       //   Coordinates of child
+        real_t r = R / (1 << (level + 1));                      //   Radius of cells for child's level
+        for (int d=0; d<3; d++) {                               //   Loop over dimensions
+          Xchild[d] = X[d] + r * (((i & 1 << d) >> d) * 2 - 1); //    Shift center position to that of child node
+        }                                                       //   End loop over dimensions
+#pragma omp task untied if(size[i] > nspawn)                    //   Start OpenMP task if large enough task
+        node->CHILD[i] = buildNodes(buffer, bodies, offsets[i], offsets[i] + size[i],// Recursive call for each child
+                                    Xchild, R, ncrit, level+1, !direction);
       }                                                         //  End if for child
     }                                                           // End loop over children
+#pragma omp taskwait                                            // Synchronize OpenMP tasks
+    for (int i=0; i<8; i++) {                                   // Loop over children
+      if (node->CHILD[i]) node->NNODE += node->CHILD[i]->NNODE; //  Accumulate number of descendant nodes
+    }                                                           // End loop over children
+    return node;                                                // Return node
   }
 
-  Cells buildTree(Bodies & bodies) {
+  //! Convert nodes to cells of tree recursively, and free the nodes
+  void nodes2cells(Node * node, Cell * cell, Cell * child, Body * bodies, real_t R, int level=0) {
+    cell->BODY = bodies + node->IBODY;                          // Pointer of first body in cell
+    cell->NBODY = node->NBODY;                                  // Number of bodies in cell
+    cell->NCHILD = 0;                                           // Initialize counter for child cells
+    cell->CHILD = child;                                        // Pointer of first child cell
+    for (int d=0; d<3; d++) cell->X[d] = node->X[d];            // Center position of cell
+    cell->R = R / (1 << level);                                 // Cell radius
+    for (int i=0; i<8; i++) {                                   // Loop over child nodes
+      if (node->CHILD[i]) cell->NCHILD++;                       //  Increment child cell counter
+    }                                                           // End loop over child nodes
+    Cell * grandchild = child + cell->NCHILD;                   // Pointer of first grandchild cell
+    for (int i=0; i<8; i++) {                                   // Loop over child nodes
+      Node * n = node->CHILD[i];                                //  Pointer of child node
+      if (n) {                                                  //  If child exists
+        int nnode = n->NNODE;                                   //   Number of cells in child's subtree
+#pragma omp task untied if(n->NBODY > nspawn)                   //   Start OpenMP task if large enough task
+        nodes2cells(n, child, grandchild, bodies, R, level+1);  //   Recursive call for each child
+        child++;                                                //   Increment child cell pointer
+        grandchild += nnode - 1;                                //   Skip cells of child's subtree
+      }                                                         //  End if for child
+    }                                                           // End loop over child nodes
+#pragma omp taskwait                                            // Synchronize OpenMP tasks
+    delete node;                                                // Free node
+  }
+
+  //! Build tree in parallel; nodes are built first, since the final cell layout depends on subtree sizes
+  Cells buildTree(Bodies & bodies, const FMM & fmm) {
     real_t R0, X0[3];                                           // Radius and center root cell
     getBounds(bodies, R0, X0);                                  // Get bounding box from bodies
     Bodies buffer = bodies;                                     // Copy bodies to buffer
-    Cells cells(1);                                             // Vector of cells
-    cells.reserve(bodies.size());                               // Reserve memory space
-    buildCells(&bodies[0], &buffer[0], 0, bodies.size(), &cells[0], cells, X0, R0);// Build tree recursively
-    return cells;                                               // Return pointer of root cell
+    Node * root;                                                // Root node
+#pragma omp parallel                                            // Start OpenMP
+#pragma omp single nowait                                       // Start OpenMP single region with nowait
+    root = buildNodes(&bodies[0], &buffer[0], 0, bodies.size(), X0, R0, fmm.ncrit);// Build nodes recursively
+    Cells cells(root->NNODE);                                   // Allocate all cells at once
+#pragma omp parallel                                            // Start OpenMP
+#pragma omp single nowait                                       // Start OpenMP single region with nowait
+    nodes2cells(root, &cells[0], &cells[0]+1, &bodies[0], R0);  // Convert nodes to cells recursively
+    return cells;                                               // Return vector of cells
+  }
+
+  //! Scatter potential and force of bodies back to their initial order given by IBODY
+  void scatterBodies(Bodies & bodies, real_t * p, real_t * F) {
+#pragma omp parallel for
+    for (size_t b=0; b<bodies.size(); b++) {                    // Loop over bodies in tree order
+      int i = bodies[b].IBODY;                                  //  Initial index of body
+      p[i] = bodies[b].p;                                       //  Copy potential to initial order
+      for (int d=0; d<3; d++) F[3*i+d] = bodies[b].F[d];        //  Copy force to initial order
+    }                                                           // End loop over bodies
   }
 }
 
@@ -0,0 +1,171 @@
+#ifndef buildtree_key_h
+#define buildtree_key_h
+#include <algorithm>
+#include <stdint.h>
+#include <omp.h>
+#include "build_tree.h"
+
+namespace exafmm {
+  const int maxLevel = 21;                                      //!< Max level of key-based tree (3 * 21 = 63 bits)
+
+  //! Get 3-D integer coordinates of body at the finest level
+  inline void getIndex(Body * B, real_t * Xmin, real_t D, uint64_t * ix) {
+    for (int d=0; d<3; d++) {                                   // Loop over dimensions
+      int64_t i = int64_t((B->X[d] - Xmin[d]) / D * (1 << maxLevel));//  Index at the finest level
+      ix[d] = std::min(std::max(i, int64_t(0)), int64_t((1 << maxLevel) - 1));// Clamp index to domain
+    }                                                           // End loop over dimensions
+  }
+
+  //! Spread the lower 21 bits of an integer to every third bit
+  inline uint64_t splitBy3(uint64_t a) {
+    a &= 0x1fffff;                                              // Keep only 21 bits
+    a = (a | a << 32) & 0x1f00000000ffff;                       // Spread by 32
+    a = (a | a << 16) & 0x1f0000ff0000ff;                       // Spread by 16
+    a = (a | a << 8) & 0x100f00f00f00f00f;                      // Spread by 8
+    a = (a | a << 4) & 0x10c30c30c30c30c3;                      // Spread by 4
+    a = (a | a << 2) & 0x1249249249249249;                      // Spread by 2
+    return a;                                                   // Return spread bits
+  }
+
+  //! Morton key from 3-D integer coordinates; octants are ordered as in buildNodes
+  inline uint64_t getMortonKey(uint64_t * ix) {
+    return splitBy3(ix[0]) | splitBy3(ix[1]) << 1 | splitBy3(ix[2]) << 2;// Interleave bits of x, y, z
+  }
+
+  //! Hilbert key from 3-D integer coordinates (Skilling's transpose algorithm)
+  inline uint64_t getHilbertKey(uint64_t * ix) {
+    uint64_t X[3] = {ix[0], ix[1], ix[2]};                      // Copy of coordinates to transform
+    for (uint64_t Q=uint64_t(1)<<(maxLevel-1); Q>1; Q>>=1) {    // Loop over bits from the top
+      uint64_t P = Q - 1;                                       //  Mask of lower bits
+      for (int d=0; d<3; d++) {                                 //  Loop over dimensions
+        if (X[d] & Q) X[0] ^= P;                                //   Invert
+        else {                                                  //   Else
+          uint64_t t = (X[0] ^ X[d]) & P;                       //    Bits to exchange
+          X[0] ^= t;                                            //    Exchange lower bits
+          X[d] ^= t;                                            //    Exchange lower bits
+        }                                                       //   End if for bit
+      }                                                         //  End loop over dimensions
+    }                                                           // End loop over bits
+    for (int d=1; d<3; d++) X[d] ^= X[d-1];                     // Gray encode
+    uint64_t t = 0;                                             // Correction mask
+    for (uint64_t Q=uint64_t(1)<<(maxLevel-1); Q>1; Q>>=1) {    // Loop over bits from the top
+      if (X[2] & Q) t ^= Q - 1;                                 //  Accumulate correction
+    }                                                           // End loop over bits
+    for (int d=0; d<3; d++) X[d] ^= t;                          // Apply correction
+    return splitBy3(X[2]) | splitBy3(X[1]) << 1 | splitBy3(X[0]) << 2;// Interleave transposed bits
+  }
+
+  //! Parallel LSD radix sort of keys with 8-bit digits, carrying a permutation index
+  void radixSort(std::vector<uint64_t> & key, std::vector<int> & index) {
+    const int nbin = 256;                                       // Number of bins per digit
+    int n = key.size();                                         // Number of keys
+    std::vector<uint64_t> key2(n);                              // Buffer for keys
+    std::vector<int> index2(n);                                 // Buffer for index
+    std::vector<int> bins(nbin * omp_get_max_threads());        // Bin counters for each thread
+    for (int shift=0; shift<3*maxLevel; shift+=8) {             // Loop over digits from the lowest
+#pragma omp parallel                                            //  Start OpenMP
+      {
+        int t = omp_get_thread_num();                           //   Thread number
+        int nt = omp_get_num_threads();                         //   Number of threads
+        int * bin = &bins[nbin*t];                              //   Bin counters of this thread
+        for (int i=0; i<nbin; i++) bin[i] = 0;                  //   Initialize bin counters
+#pragma omp for schedule(static)
+        for (int i=0; i<n; i++) {                               //   Loop over keys
+          bin[(key[i] >> shift) & (nbin - 1)]++;                //    Count keys in bin
+        }                                                       //   End loop over keys
+#pragma omp single
+        {
+          int offset = 0;                                       //    Offset of bin
+          for (int i=0; i<nbin; i++) {                          //    Loop over bins
+            for (int j=0; j<nt; j++) {                          //     Loop over threads
+              int count = bins[nbin*j+i];                       //      Count of bin in thread
+              bins[nbin*j+i] = offset;                          //      Replace count with offset
+              offset += count;                                  //      Increment offset
+            }                                                   //     End loop over threads
+          }                                                     //    End loop over bins
+        }                                                       //   Implicit barrier
+#pragma omp for schedule(static)
+        for (int i=0; i<n; i++) {                               //   Loop over keys with the same partition
+          int j = bin[(key[i] >> shift) & (nbin - 1)]++;        //    Destination of key
+          key2[j] = key[i];                                     //    Scatter key
+          index2[j] = index[i];                                 //    Scatter index
+        }                                                       //   End loop over keys
+      }                                                         //  End OpenMP
+      key.swap(key2);                                           //  Swap key with buffer
+      index.swap(index2);                                       //  Swap index with buffer
+    }                                                           // End loop over digits
+  }
+
+  //! Build nodes of tree from ranges of sorted keys, splitting each range on the next 3 bits of the prefix
+  Node * buildNodes(Body * bodies, uint64_t * key, int begin, int end,
+                    real_t * Xmin, real_t D, int ncrit, int level=0) {
+    //! Create a tree node
+    Node * node = new Node;                                     // Allocate node in the memory of this task
+    node->IBODY = begin;                                        // Index of first body in node
+    node->NBODY = end - begin;                                  // Number of bodies in node
+    node->NNODE = 1;                                            // Initialize counter for descendant nodes
+    for (int i=0; i<8; i++) node->CHILD[i] = NULL;              // Initialize pointers of child nodes
+    uint64_t ix[3];                                             // Integer coordinates of first body
+    getIndex(bodies + begin, Xmin, D, ix);                      // Get integer coordinates of first body
+    real_t size = D / (1 << level);                             // Size of node at this level
+    for (int d=0; d<3; d++) {                                   // Loop over dimensions
+      node->X[d] = Xmin[d] + ((ix[d] >> (maxLevel - level)) + .5) * size;// Center of node from prefix
+    }                                                           // End loop over dimensions
+    if (end - begin <= ncrit || level == maxLevel) return node; // If node is a leaf, return without recursion
+    //! Find range of each child with binary search on the sorted keys
+    int shift = 3 * (maxLevel - level - 1);                     // Shift of child digit in key
+    uint64_t prefix = key[begin] >> (shift + 3) << (shift + 3); // Prefix of node with lower bits cleared
+    int offsets[9];                                             // Offsets of each child
+    offsets[0] = begin;                                         // Offset of first child
+    offsets[8] = end;                                           // Offset of end of last child
+    for (int i=1; i<8; i++) {                                   // Loop over children
+      offsets[i] = std::lower_bound(key + offsets[i-1], key + end, prefix | uint64_t(i) << shift) - key;
+    }                                                           // End loop over children
+    //! Loop over children and recurse
+    for (int i=0; i<8; i++) {                                   // Loop over children
+      if (offsets[i+1] > offsets[i]) {                          //  If child exists
+#pragma omp task untied if(offsets[i+1] - offsets[i] > nspawn)  //   Start OpenMP task if large enough task
+        node->CHILD[i] = buildNodes(bodies, key, offsets[i], offsets[i+1], Xmin, D, ncrit, level+1);
+      }                                                         //  End if for child
+    }                                                           // End loop over children
+#pragma omp taskwait                                            // Synchronize OpenMP tasks
+    for (int i=0; i<8; i++) {                                   // Loop over children
+      if (node->CHILD[i]) node->NNODE += node->CHILD[i]->NNODE; //  Accumulate number of descendant nodes
+    }                                                           // End loop over children
+    return node;                                                // Return node
+  }
+
+  //! Build tree by sorting bodies on Morton or Hilbert keys
+  Cells buildTreeKey(Bodies & bodies, const FMM & fmm, bool hilbert=false) {
+    real_t R0, X0[3], Xmin[3];                                  // Radius, center and corner of root cell
+    getBounds(bodies, R0, X0);                                  // Get bounding box from bodies
+    for (int d=0; d<3; d++) Xmin[d] = X0[d] - R0;               // Corner of root cell
+    int n = bodies.size();                                      // Number of bodies
+    std::vector<uint64_t> key(n);                               // Keys of bodies
+    std::vector<int> index(n);                                  // Permutation index of bodies
+#pragma omp parallel for
+    for (int b=0; b<n; b++) {                                   // Loop over bodies
+      uint64_t ix[3];                                           //  Integer coordinates of body
+      getIndex(&bodies[b], Xmin, 2 * R0, ix);                   //  Get integer coordinates of body
+      key[b] = hilbert ? getHilbertKey(ix) : getMortonKey(ix);  //  Get key of body
+      index[b] = b;                                             //  Initialize permutation index
+    }                                                           // End loop over bodies
+    radixSort(key, index);                                      // Sort keys and permutation index
+    Bodies buffer(n);                                           // Buffer for permuted bodies
+#pragma omp parallel for
+    for (int b=0; b<n; b++) {                                   // Loop over bodies
+      buffer[b] = bodies[index[b]];                             //  Permute bodies into key order
+    }                                                           // End loop over bodies
+    bodies.swap(buffer);                                        // Swap bodies with buffer
+    Node * root;                                                // Root node
+#pragma omp parallel                                            // Start OpenMP
+#pragma omp single nowait                                       // Start OpenMP single region with nowait
+    root = buildNodes(&bodies[0], &key[0], 0, n, Xmin, 2 * R0, fmm.ncrit);// Build nodes from key prefixes
+    Cells cells(root->NNODE);                                   // Allocate all cells at once
+#pragma omp parallel                                            // Start OpenMP
+#pragma omp single nowait                                       // Start OpenMP single region with nowait
+    nodes2cells(root, &cells[0], &cells[0]+1, &bodies[0], R0);  // Convert nodes to cells recursively
+    return cells;                                               // Return vector of cells
+  }
+}
+#endif
@@ -11,15 +11,24 @@ namespace exafmm {
   };
   typedef std::vector<Wave> Waves;                              //!< Vector of Wave types
 
-  static int ksize;                                             //!< Number of waves in Ewald summation
-  static real_t alpha;                                          //!< Scaling parameter for Ewald summation
-  static real_t sigma;                                          //!< Scaling parameter for Ewald summation
-  static real_t cutoff;                                         //!< Cutoff distance
-  static real_t K[3];                                           //!< Wave number vector
-  static real_t scale[3];                                       //!< Scale vector
+  //! Parameters of one Ewald summation
+  struct Ewald {
+    int ksize;                                                  //!< Number of waves in Ewald summation
+    real_t alpha;                                               //!< Scaling parameter for Ewald summation
+    real_t sigma;                                               //!< Scaling parameter for Ewald summation
+    real_t cutoff;                                              //!< Cutoff distance
+    real_t cycle;                                               //!< Cycle of periodic boundary condition
+  };
+
+  //! Scale from wave numbers to the periodic domain
+  inline void initScale(const Ewald & ewald, real_t * scale) {
+    for (int d=0; d<3; d++) scale[d]= 2 * M_PI / ewald.cycle;   // Scale conversion
+  }
 
   //! Forward DFT
-  void dft(Waves & waves, Bodies & bodies) {
+  void dft(Waves & waves, Bodies & bodies, const Ewald & ewald) {
+    real_t scale[3];                                            // Scale vector
+    initScale(ewald, scale);                                    // Scale conversion
 #pragma omp parallel for
     for (size_t w=0; w<waves.size(); w++) {                     // Loop over waves
       waves[w].REAL = waves[w].IMAG = 0;                        //  Initialize waves
@@ -33,7 +42,9 @@ namespace exafmm {
   }
 
   //! Inverse DFT
-  void idft(Waves & waves, Bodies & bodies) {
+  void idft(Waves & waves, Bodies & bodies, const Ewald & ewald) {
+    real_t scale[3];                                            // Scale vector
+    initScale(ewald, scale);                                    // Scale conversion
 #pragma omp parallel for
     for (size_t b=0; b<bodies.size(); b++) {                    // Loop over bodies
       real_t p = 0, F[3] = {0, 0, 0};                           //  Initialize potential, force
@@ -51,11 +62,10 @@ namespace exafmm {
   }
 
   //! Initialize wave vector
-  Waves initWaves() {
-    for (int d=0; d<3; d++) scale[d]= 2 * M_PI / cycle;         // Scale conversion
+  Waves initWaves(const Ewald & ewald) {
     Waves waves;                                                // Initialzie wave vector
-    int kmaxsq = ksize * ksize;                                 // kmax squared
-    int kmax = ksize;                                           // kmax as integer
+    int kmaxsq = ewald.ksize * ewald.ksize;                     // kmax squared
+    int kmax = ewald.ksize;                                     // kmax as integer
     for (int l=0; l<=kmax; l++) {                               // Loop over x component
       int mmin = -kmax;                                         //  Determine minimum y component
       if (l==0) mmin = 0;                                       //  Exception for minimum y component
@@ -79,12 +89,15 @@ namespace exafmm {
   }
 
   //! Ewald real part P2P kernel
-  void realP2P(Cell * Ci, Cell * Cj) {
+  EXAFMM_CLONES
+  void realP2P(Cell * Ci, Cell * Cj, const int * iX, const Ewald & ewald) {
+    const real_t alpha = ewald.alpha;                           // Scaling parameter for Ewald summation
+    real_t dX[3];                                               // Distance vector
     for (Body * Bi=Ci->BODY; Bi!=Ci->BODY+Ci->NBODY; Bi++) {    // Loop over target bodies
       for (Body * Bj=Cj->BODY; Bj!=Cj->BODY+Cj->NBODY; Bj++) {  //  Loop over source bodies
-        for (int d=0; d<3; d++) dX[d] = Bi->X[d] - Bj->X[d] - iX[d] * cycle;// Distance vector from source to target
+        for (int d=0; d<3; d++) dX[d] = Bi->X[d] - Bj->X[d] - iX[d] * ewald.cycle;// Distance vector from source to target
         real_t R2 = dX[0] * dX[0] + dX[1] * dX[1] + dX[2] * dX[2];//   R^2
-        if (0 < R2 && R2 < cutoff * cutoff) {                   //   Exclude self interaction and cutoff
+        if (0 < R2 && R2 < ewald.cutoff * ewald.cutoff) {       //   Exclude self interaction and cutoff
           real_t R2s = R2 * alpha * alpha;                      //    (R * alpha)^2
           real_t Rs = std::sqrt(R2s);                           //    R * alpha
           real_t invRs = 1 / Rs;                                //    1 / (R * alpha)
@@ -101,37 +114,41 @@ namespace exafmm {
     }                                                           // End loop over target bodies
   }
 
-  void neighbor(Cell * Ci, Cell * Cj) {                         // Traverse tree to find neighbor
+  void neighbor(Cell * Ci, Cell * Cj, const Ewald & ewald) {    // Traverse tree to find neighbor
+    real_t dX[3];                                               // Distance vector
+    int iX[3];                                                  // Periodic index
     for (int d=0; d<3; d++) {                                   //  Loop over dimensions
       dX[d] = Ci->X[d] - Cj->X[d];                              //  Distance vector from source to target
       iX[d] = 0;                                                //   Initialize periodic index
-      if(dX[d] < -cycle / 2) iX[d]--;                           //   Wrap periodic index backward
-      if(dX[d] >  cycle / 2) iX[d]++;                           //   Wrap periodic index forward
-      dX[d] -= iX[d] * cycle;                                   //   Wrap distance vector
+      if(dX[d] < -ewald.cycle / 2) iX[d]--;                     //   Wrap periodic index backward
+      if(dX[d] >  ewald.cycle / 2) iX[d]++;                     //   Wrap periodic index forward
+      dX[d] -= iX[d] * ewald.cycle;                             //   Wrap distance vector
     }                                                           //  End loop over dimensions
     real_t R = std::sqrt(dX[0] * dX[0] + dX[1] * dX[1] + dX[2] * dX[2]);//  Scalar distance
-    if (R - Ci->R - Cj->R < sqrtf(3) * cutoff) {                //  If cells are close
-      if(Cj->NCHILD == 0) realP2P(Ci, Cj);                      //   Ewald real part
+    if (R - Ci->R - Cj->R < sqrtf(3) * ewald.cutoff) {          //  If cells are close
+      if(Cj->NCHILD == 0) realP2P(Ci, Cj, iX, ewald);           //   Ewald real part
       for (Cell * cj=Cj->CHILD; cj!=Cj->CHILD+Cj->NCHILD; cj++) {// Loop over cell's children
-        neighbor(Ci, cj);                                       //    Instantiate recursive functor
+        neighbor(Ci, cj, ewald);                                //    Instantiate recursive functor
       }                                                         //   End loop over cell's children
     }                                                           //  End if for far cells
   }                                                             // End overload operator()
 
   //! Ewald real part
-  void realPart(Cell * Ci, Cell * Cj) {
-    if (Ci->NCHILD == 0) neighbor(Ci, Cj);                      // If target cell is leaf, find neighbors
+  void realPart(Cell * Ci, Cell * Cj, const Ewald & ewald) {
+    if (Ci->NCHILD == 0) neighbor(Ci, Cj, ewald);               // If target cell is leaf, find neighbors
     for (Cell * ci=Ci->CHILD; ci!=Ci->CHILD+Ci->NCHILD; ci++) { // Loop over target child cells
-      realPart(ci, Cj);                                         //  Recursively subdivide target cells
+      realPart(ci, Cj, ewald);                                  //  Recursively subdivide target cells
     }                                                           // End loop over target cells
   }
 
   //! Ewald wave part
-  void wavePart(Bodies & bodies, Bodies & jbodies) {
-    Waves waves = initWaves();                                  // Initialize wave vector
-    dft(waves,jbodies);                                         // Apply DFT to bodies to get waves
-    real_t coef = 2 / sigma / cycle / cycle / cycle;            // First constant
-    real_t coef2 = 1 / (4 * alpha * alpha);                     // Second constant
+  void wavePart(Bodies & bodies, Bodies & jbodies, const Ewald & ewald) {
+    real_t K[3], scale[3];                                      // Wave number vector, scale vector
+    initScale(ewald, scale);                                    // Scale conversion
+    Waves waves = initWaves(ewald);                             // Initialize wave vector
+    dft(waves,jbodies,ewald);                                   // Apply DFT to bodies to get waves
+    real_t coef = 2 / ewald.sigma / ewald.cycle / ewald.cycle / ewald.cycle;// First constant
+    real_t coef2 = 1 / (4 * ewald.alpha * ewald.alpha);         // Second constant
     for (size_t w=0; w<waves.size(); w++) {                     // Loop over waves
       for (int d=0; d<3; d++) K[d] = waves[w].K[d] * scale[d];  //  Wave number scaled
       real_t K2 = K[0] * K[0] + K[1] * K[1] + K[2] * K[2];      //  Wave number squared
@@ -139,13 +156,13 @@ namespace exafmm {
       waves[w].REAL *= factor;                                  //  Apply wave factor to real part
       waves[w].IMAG *= factor;                                  //  Apply wave factor to imaginary part
     }                                                           // End loop over waves
-    idft(waves,bodies);                                         // Inverse DFT
+    idft(waves,bodies,ewald);                                   // Inverse DFT
   }
 
   //! Subtract self term
-  void selfTerm(Bodies & bodies) {
+  void selfTerm(Bodies & bodies, const Ewald & ewald) {
     for (size_t b=0; b<bodies.size(); b++) {                    // Loop over all bodies
-      bodies[b].p -= M_2_SQRTPI * bodies[b].q * alpha;          //  Self term of Ewald real part
+      bodies[b].p -= M_2_SQRTPI * bodies[b].q * ewald.alpha;    //  Self term of Ewald real part
     }                                                           // End loop over all bodies in cell
   }
 }
@@ -1,10 +1,20 @@
 #ifndef exafmm_h
 #define exafmm_h
+#include <cmath>
 #include <complex>
 #include <cstdlib>
 #include <cstdio>
 #include <vector>
 
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(EXAFMM_DISPATCH)
+#define EXAFMM_DISPATCH 1                                       //!< Dispatch hot kernels on CPU features at runtime
+#endif
+#if EXAFMM_DISPATCH
+#define EXAFMM_CLONES __attribute__((target_clones("avx512f","avx2","default")))
+#else
+#define EXAFMM_CLONES
+#endif
+
 namespace exafmm {
   //! Basic type definitions
   typedef double real_t;                                        //!< Floating point type
@@ -16,6 +26,7 @@ namespace exafmm {
     real_t q;                                                   //!< Charge
     real_t p;                                                   //!< Potential
     real_t F[3];                                                //!< Force
+    int IBODY;                                                  //!< Initial body numbering for sorting back
   };
   typedef std::vector<Body> Bodies;                             //!< Vector of bodies
 
@@ -38,15 +49,14 @@ namespace exafmm {
   };
   typedef std::vector<Cell> Cells;                              //!< Vector of cells
 
-  //! Global variables
-  int P;                                                        //!< Order of expansions
-  int NTERM;                                                    //!< Number of coefficients
-  int ncrit;                                                    //!< Number of bodies per leaf cell
-  int images;                                                   //!< Number of periodic image sublevels
-  int iX[3];                                                    //!< 3-D periodic index
-  real_t cycle;                                                 //!< Cycle of periodic boundary condition
-  real_t theta;                                                 //!< Multipole acceptance criterion
-  real_t dX[3];                                                 //!< Distance vector
-#pragma omp threadprivate(iX,dX)                                //!< Make global variables private
+  //! Parameters of one FMM solve, passed to the tree construction, traversals and kernels
+  struct FMM {
+    int P = 10;                                                 //!< Order of expansions
+    int NTERM = 0;                                              //!< Number of coefficients
+    int ncrit = 64;                                             //!< Number of bodies per leaf cell
+    int images = 0;                                             //!< Number of periodic image sublevels
+    real_t cycle = 2 * M_PI;                                    //!< Cycle of periodic boundary condition
+    real_t theta = .4;                                          //!< Multipole acceptance criterion
+  };
 }
 #endif
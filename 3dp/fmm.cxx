@@ -1,4 +1,7 @@
 #include "build_tree.h"
+#if EXAFMM_KEY
+#include "build_tree_key.h"
+#endif
 #include "kernel.h"
 #include "ewald.h"
 #include "timer.h"
@@ -7,22 +10,29 @@
 #elif EXAFMM_LAZY
 #include "traverse_lazy.h"
 #endif
+#if EXAFMM_AUTOTUNE
+#include "autotune.h"
+#endif
 using namespace exafmm;
 
 int main(int argc, char ** argv) {
   const int numBodies = 1000;                                   // Number of bodies
-  P = 10;                                                       // Order of expansions
-  ncrit = 64;                                                   // Number of bodies per leaf cell
-  cycle = 2 * M_PI;                                             // Cycle of periodic boundary condition
-  theta = 0.4;                                                  // Multipole acceptance criterion
-  images = 4;                                                   // 3^images * 3^images * 3^images periodic images
+  FMM fmm;                                                      // Parameters of this solve
+  fmm.P = 10;                                                   // Order of expansions
+  fmm.ncrit = 64;                                               // Number of bodies per leaf cell
+  fmm.cycle = 2 * M_PI;                                         // Cycle of periodic boundary condition
+  fmm.theta = 0.4;                                              // Multipole acceptance criterion
+  fmm.images = 4;                                               // 3^images * 3^images * 3^images periodic images
 
-  ksize = 11;                                                   // Ewald wave number
-  alpha = ksize / cycle;                                        // Ewald real/wave balance parameter
-  sigma = .25 / M_PI;                                           // Ewald distribution parameter
-  cutoff = cycle / 2;                                           // Ewald cutoff distance
+  Ewald ewald;                                                  // Parameters of the Ewald summation
+  ewald.ksize = 11;                                             // Ewald wave number
+  ewald.cycle = fmm.cycle;                                      // Ewald cycle of periodic boundary condition
+  ewald.alpha = ewald.ksize / ewald.cycle;                      // Ewald real/wave balance parameter
+  ewald.sigma = .25 / M_PI;                                     // Ewald distribution parameter
+  ewald.cutoff = ewald.cycle / 2;                               // Ewald cutoff distance
 
   printf("--- %-16s ------------\n", "FMM Profiling");          // Start profiling
+  printf("%-20s : %s\n", "SIMD", simdVariant());                // Print dispatched kernel variant
   //! Initialize bodies
   start("Initialize bodies");                                   // Start timer
   Bodies bodies(numBodies);                                     // Initialize bodies
@@ -30,34 +40,47 @@ int main(int argc, char ** argv) {
   srand48(0);                                                   // Set seed for random number generator
   for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
     for (int d=0; d<3; d++) {                                   //  Loop over dimension
-      bodies[b].X[d] = drand48() * cycle - cycle * .5;          //   Initialize positions
+      bodies[b].X[d] = drand48() * fmm.cycle - fmm.cycle * .5;  //   Initialize positions
     }                                                           //  End loop over dimension
     bodies[b].q = drand48() - .5;                               //  Initialize charge
     average += bodies[b].q;                                     //  Accumulate charge
     bodies[b].p = 0;                                            //  Clear potential
     for (int d=0; d<3; d++) bodies[b].F[d] = 0;                 //  Clear force
+    bodies[b].IBODY = b;                                        //  Initial body numbering
   }                                                             // End loop over bodies
   average /= bodies.size();                                     // Average charge
   for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
     bodies[b].q -= average;                                     // Charge neutral
   }                                                             // End loop over bodies
   stop("Initialize bodies");                                    // Stop timer
+#if EXAFMM_AUTOTUNE
+  FMM plan = fmm;                                               // Keep default ncrit for Ewald tree
+  start("Autotune ncrit");                                      // Start timer
+  initKernel(fmm);                                              // Initialize kernel
+  fmm.ncrit = tuneNcrit(bodies, fmm);                           // Tune ncrit with trial evaluations
+  stop("Autotune ncrit");                                       // Stop timer
+  printf("%-20s : %d\n", "ncrit", fmm.ncrit);                   // Print tuned ncrit
+#endif
 
   //! Build tree
   start("Build tree");                                          // Start timer
-  Cells  cells = buildTree(bodies);                             // Build tree
+#if EXAFMM_KEY
+  Cells cells = buildTreeKey(bodies, fmm);                      // Build tree from sorted keys
+#else
+  Cells cells = buildTree(bodies, fmm);                         // Build tree
+#endif
   stop("Build tree");                                           // Stop timer
 
   //! FMM evaluation
   start("P2M & M2M");                                           // Start timer
-  initKernel();                                                 // Initialize kernel
-  upwardPass(cells);                                            // Upward pass for P2M, M2M
+  initKernel(fmm);                                              // Initialize kernel
+  upwardPass(cells, fmm);                                       // Upward pass for P2M, M2M
   stop("P2M & M2M");                                            // Stop timer
   start("M2L & P2P");                                           // Start timer
-  horizontalPass(cells, cells);                                 // Horizontal pass for M2L, P2P
+  horizontalPass(cells, cells, fmm);                            // Horizontal pass for M2L, P2P
   stop("M2L & P2P");                                            // Stop timer
   start("L2L & L2P");                                           // Start timer
-  downwardPass(cells);                                          // Downward pass for L2L, L2P
+  downwardPass(cells, fmm);                                     // Downward pass for L2L, L2P
   stop("L2L & L2P");                                            // Stop timer
 
   //! Dipole correction
@@ -66,7 +89,7 @@ int main(int argc, char ** argv) {
   for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
     for (int d=0; d<3; d++) dipole[d] += bodies[b].X[d] * bodies[b].q;// Accumulate dipole
   }                                                             // End loop over bodies
-  real_t coef = 4 * M_PI / (3 * cycle * cycle * cycle);         // Domain coefficient
+  real_t coef = 4 * M_PI / (3 * fmm.cycle * fmm.cycle * fmm.cycle);// Domain coefficient
   for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
     real_t dnorm = dipole[0] * dipole[0] + dipole[1] * dipole[1] + dipole[2] * dipole[2];// Norm of dipole
     bodies[b].p -= coef * dnorm / bodies.size() / bodies[b].q;  //  Correct potential
@@ -83,14 +106,17 @@ int main(int argc, char ** argv) {
     for (int d=0; d<3; d++) bodies[b].F[d] = 0;                 //  Clear force
   }                                                             // End loop over bodies
   Bodies jbodies = bodies;                                      // Copy bodies
-  Cells  jcells = buildTree(jbodies);                           // Build tree
+#if EXAFMM_AUTOTUNE
+  fmm.ncrit = plan.ncrit;                                       // Ewald neighbor search needs small leaves
+#endif
+  Cells  jcells = buildTree(jbodies, fmm);                      // Build tree
   stop("Build tree");                                           // Stop timer
   start("Wave part");                                           // Start timer
-  wavePart(bodies, jbodies);                                    // Ewald wave part
+  wavePart(bodies, jbodies, ewald);                             // Ewald wave part
   stop("Wave part");                                            // Stop timer
   start("Real part");                                           // Start timer
-  realPart(&cells[0], &jcells[0]);                              // Ewald real part
-  selfTerm(bodies);                                             // Ewald self term
+  realPart(&cells[0], &jcells[0], ewald);                       // Ewald real part
+  selfTerm(bodies, ewald);                                      // Ewald self term
   stop("Real part");                                            // Stop timer
 
   //! Verify result
@@ -2,8 +2,10 @@
 using namespace exafmm;
 
 int main(int argc, char ** argv) {
-  P = atoi(argv[1]);
-  initKernel();
+  FMM fmm;
+  fmm.P = atoi(argv[1]);
+  initKernel(fmm);
+  int iX[3] = {0, 0, 0};
 
   // P2M
   Bodies jbodies(1);
@@ -17,8 +19,8 @@ int main(int argc, char ** argv) {
   Cj->R = 1;
   Cj->BODY = &jbodies[0];
   Cj->NBODY = jbodies.size();
-  Cj->M.resize(NTERM, 0.0);
-  P2M(Cj);
+  Cj->M.resize(fmm.NTERM, 0.0);
+  P2M(Cj, fmm);
 
   // M2M
   Cell * CJ = &cells[1];
@@ -28,8 +30,8 @@ int main(int argc, char ** argv) {
   CJ->X[1] = 0;
   CJ->X[2] = 0;
   CJ->R = 2;
-  CJ->M.resize(NTERM, 0.0);
-  M2M(CJ);
+  CJ->M.resize(fmm.NTERM, 0.0);
+  M2M(CJ, fmm);
 
   // M2L
   Cell * CI = &cells[2];
@@ -37,8 +39,8 @@ int main(int argc, char ** argv) {
   CI->X[1] = 0;
   CI->X[2] = 0;
   CI->R = 2;
-  CI->L.resize(NTERM, 0.0);
-  M2L(CI, CJ);
+  CI->L.resize(fmm.NTERM, 0.0);
+  M2L(CI, CJ, iX, fmm);
 
   // L2L
   Cell * Ci = &cells[3];
@@ -48,8 +50,8 @@ int main(int argc, char ** argv) {
   Ci->X[1] = 1;
   Ci->X[2] = 1;
   Ci->R = 1;
-  Ci->L.resize(NTERM, 0.0);
-  L2L(CI);
+  Ci->L.resize(fmm.NTERM, 0.0);
+  L2L(CI, fmm);
 
   // L2P
   Bodies bodies(1);
@@ -61,7 +63,7 @@ int main(int argc, char ** argv) {
   for (int d=0; d<3; d++) bodies[0].F[d] = 0;
   Ci->BODY = &bodies[0];
   Ci->NBODY = bodies.size();
-  L2P(Ci);
+  L2P(Ci, fmm);
 
   // P2P
   Bodies bodies2(1);
@@ -73,7 +75,7 @@ int main(int argc, char ** argv) {
   Cj->NBODY = jbodies.size();
   Ci->NBODY = bodies2.size();
   Ci->BODY = &bodies2[0];
-  P2P(Ci, Cj);
+  P2P(Ci, Cj, iX, fmm);
 
   // Verify results
   real_t pDif = 0, pNrm = 0, FDif = 0, FNrm = 0;
@@ -1,9 +1,16 @@
 #ifndef kernel_h
 #define kernel_h
+#include <algorithm>
+#include <cfloat>
 #include "exafmm.h"
+#if EXAFMM_DISPATCH
+#include <immintrin.h>
+#endif
 
 namespace exafmm {
   const complex_t I(0.,1.);                                     //!< Imaginary unit
+  const int nblock = 256;                                       //!< Number of source bodies gathered at once in P2P
+  const int NSIMD = 8;                                          //!< Padding of source blocks for the widest SIMD variant
 
   //!< L2 norm of vector X
   inline real_t norm(real_t * X) {
@@ -40,7 +47,8 @@ namespace exafmm {
   }
 
   //! Evaluate solid harmonics \f$ r^n Y_{n}^{m} \f$
-  void evalMultipole(real_t rho, real_t alpha, real_t beta, complex_t * Ynm, complex_t * YnmTheta) {
+  void evalMultipole(real_t rho, real_t alpha, real_t beta, complex_t * Ynm, complex_t * YnmTheta, const FMM & fmm) {
+    const int P = fmm.P;                                        // Order of expansions
     real_t x = std::cos(alpha);                                 // x = cos(alpha)
     real_t y = std::sin(alpha);                                 // y = sin(alpha)
     real_t invY = y == 0 ? 0 : 1 / y;                           // 1 / y
@@ -80,7 +88,8 @@ namespace exafmm {
   }
 
   //! Evaluate singular harmonics \f$ r^{-n-1} Y_n^m \f$
-  void evalLocal(real_t rho, real_t alpha, real_t beta, complex_t * Ynm) {
+  void evalLocal(real_t rho, real_t alpha, real_t beta, complex_t * Ynm, const FMM & fmm) {
+    const int P = fmm.P;                                        // Order of expansions
     real_t x = std::cos(alpha);                                 // x = cos(alpha)
     real_t y = std::sin(alpha);                                 // y = sin(alpha)
     real_t fact = 1;                                            // Initialize 2 * m + 1
@@ -115,47 +124,187 @@ namespace exafmm {
     }                                                           // End loop over m in Ynm
   }
 
-  void initKernel() {
-    NTERM = P * (P + 1) / 2;                                    // Calculate number of coefficients
+  void initKernel(FMM & fmm) {
+    fmm.NTERM = fmm.P * (fmm.P + 1) / 2;                        // Calculate number of coefficients
+  }
+
+  //! Report the SIMD variant that the dispatched kernels run on this CPU
+  const char * simdVariant() {
+#if EXAFMM_DISPATCH
+    if (__builtin_cpu_supports("avx512f")) return "AVX-512";    // Same order as the dispatcher
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return "AVX2";
+#endif
+    return "Scalar";
   }
 
-  void P2P(Cell * Ci, Cell * Cj) {
+  //! Sum potential and force on one target from a block of sources in SoA layout
+#if EXAFMM_DISPATCH
+  __attribute__((target("default")))
+#endif
+  void P2P(real_t * Xi, real_t * Xj, real_t * Yj, real_t * Zj, real_t * Qj, int nj,
+           real_t & pot, real_t & ax, real_t & ay, real_t & az) {
+    for (int j=0; j<nj; j++) {
+      real_t dx = Xi[0] - Xj[j];
+      real_t dy = Xi[1] - Yj[j];
+      real_t dz = Xi[2] - Zj[j];
+      real_t R2 = dx * dx + dy * dy + dz * dz;
+      if (R2 != 0) {
+        real_t invR2 = 1.0 / R2;
+        real_t invR = Qj[j] * sqrt(invR2);
+        invR2 *= invR;
+        pot += invR;
+        ax += dx * invR2;
+        ay += dy * invR2;
+        az += dz * invR2;
+      }
+    }
+  }
+
+#if EXAFMM_DISPATCH
+  //! 1 / sqrt(R2) from a float rsqrt estimate and two Newton steps; lanes whose R2 overflows or underflows float, where the
+  //! estimate is 0 or infinite, take an exact square root and division instead, which costs nothing while no lane does
+  __attribute__((target("avx2,fma")))
+  inline __m256d rsqrtAVX2(__m256d R2) {
+    __m256d half = _mm256_set1_pd(0.5);
+    __m256d three = _mm256_set1_pd(1.5);
+    __m256d invR = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(R2)));// 12-bit estimate of 1 / R
+    __m256d hR2 = _mm256_mul_pd(half, R2);
+    invR = _mm256_mul_pd(invR, _mm256_fnmadd_pd(hR2, _mm256_mul_pd(invR, invR), three));// Newton step
+    invR = _mm256_mul_pd(invR, _mm256_fnmadd_pd(hR2, _mm256_mul_pd(invR, invR), three));// Newton step
+    __m256d small = _mm256_cmp_pd(R2, _mm256_set1_pd(FLT_MIN), _CMP_LT_OQ);// Underflows float
+    __m256d large = _mm256_cmp_pd(R2, _mm256_set1_pd(FLT_MAX), _CMP_GT_OQ);// Overflows float
+    __m256d self = _mm256_cmp_pd(R2, _mm256_setzero_pd(), _CMP_EQ_OQ);// Self interaction, masked by the caller
+    __m256d out = _mm256_andnot_pd(self, _mm256_or_pd(small, large));// Lanes out of range of float
+    if (_mm256_movemask_pd(out)) {                              // If any lane is out of range
+      __m256d exact = _mm256_div_pd(_mm256_set1_pd(1), _mm256_sqrt_pd(R2));// Exact 1 / R
+      invR = _mm256_blendv_pd(invR, exact, out);                //  Replace estimate of lanes out of range
+    }                                                           // End if for out of range
+    return invR;
+  }
+
+  //! AVX2 variant of the block P2P with float rsqrt and two Newton steps
+  __attribute__((target("avx2,fma")))
+  void P2P(real_t * Xi, real_t * Xj, real_t * Yj, real_t * Zj, real_t * Qj, int nj,
+           real_t & pot, real_t & ax, real_t & ay, real_t & az) {
+    __m256d zero = _mm256_setzero_pd();
+    __m256d xi = _mm256_set1_pd(Xi[0]);
+    __m256d yi = _mm256_set1_pd(Xi[1]);
+    __m256d zi = _mm256_set1_pd(Xi[2]);
+    __m256d pv = zero, axv = zero, ayv = zero, azv = zero;
+    for (int j=0; j<nj; j+=4) {
+      __m256d dx = _mm256_sub_pd(xi, _mm256_load_pd(Xj+j));
+      __m256d dy = _mm256_sub_pd(yi, _mm256_load_pd(Yj+j));
+      __m256d dz = _mm256_sub_pd(zi, _mm256_load_pd(Zj+j));
+      __m256d R2 = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dz, dz)));
+      __m256d mask = _mm256_cmp_pd(R2, zero, _CMP_NEQ_OQ);      // Skip self interaction
+      __m256d invR = rsqrtAVX2(R2);                             // 1 / R
+      invR = _mm256_and_pd(invR, mask);
+      __m256d invR2 = _mm256_mul_pd(invR, invR);
+      invR = _mm256_mul_pd(invR, _mm256_load_pd(Qj+j));
+      pv = _mm256_add_pd(pv, invR);
+      invR = _mm256_mul_pd(invR, invR2);
+      axv = _mm256_fmadd_pd(dx, invR, axv);
+      ayv = _mm256_fmadd_pd(dy, invR, ayv);
+      azv = _mm256_fmadd_pd(dz, invR, azv);
+    }
+    real_t sum[4][4];
+    _mm256_storeu_pd(sum[0], pv);
+    _mm256_storeu_pd(sum[1], axv);
+    _mm256_storeu_pd(sum[2], ayv);
+    _mm256_storeu_pd(sum[3], azv);
+    for (int k=0; k<4; k++) {
+      pot += sum[0][k];
+      ax += sum[1][k];
+      ay += sum[2][k];
+      az += sum[3][k];
+    }
+  }
+
+  //! AVX-512 variant of the block P2P with rsqrt14 and two Newton steps
+  __attribute__((target("avx512f")))
+  void P2P(real_t * Xi, real_t * Xj, real_t * Yj, real_t * Zj, real_t * Qj, int nj,
+           real_t & pot, real_t & ax, real_t & ay, real_t & az) {
+    __m512d zero = _mm512_setzero_pd();
+    __m512d half = _mm512_set1_pd(0.5);
+    __m512d three = _mm512_set1_pd(1.5);
+    __m512d xi = _mm512_set1_pd(Xi[0]);
+    __m512d yi = _mm512_set1_pd(Xi[1]);
+    __m512d zi = _mm512_set1_pd(Xi[2]);
+    __m512d pv = zero, axv = zero, ayv = zero, azv = zero;
+    for (int j=0; j<nj; j+=8) {
+      __m512d dx = _mm512_sub_pd(xi, _mm512_load_pd(Xj+j));
+      __m512d dy = _mm512_sub_pd(yi, _mm512_load_pd(Yj+j));
+      __m512d dz = _mm512_sub_pd(zi, _mm512_load_pd(Zj+j));
+      __m512d R2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dz, dz)));
+      __mmask8 mask = _mm512_cmp_pd_mask(R2, zero, _CMP_NEQ_OQ);// Skip self interaction
+      __m512d invR = _mm512_maskz_rsqrt14_pd(mask, R2);         // 14-bit estimate of 1 / R
+      __m512d hR2 = _mm512_mul_pd(half, R2);
+      invR = _mm512_mul_pd(invR, _mm512_fnmadd_pd(hR2, _mm512_mul_pd(invR, invR), three));// Newton step
+      invR = _mm512_mul_pd(invR, _mm512_fnmadd_pd(hR2, _mm512_mul_pd(invR, invR), three));// Newton step
+      __m512d invR2 = _mm512_mul_pd(invR, invR);
+      invR = _mm512_mul_pd(invR, _mm512_load_pd(Qj+j));
+      pv = _mm512_add_pd(pv, invR);
+      invR = _mm512_mul_pd(invR, invR2);
+      axv = _mm512_fmadd_pd(dx, invR, axv);
+      ayv = _mm512_fmadd_pd(dy, invR, ayv);
+      azv = _mm512_fmadd_pd(dz, invR, azv);
+    }
+    real_t sum[4][8];
+    _mm512_storeu_pd(sum[0], pv);
+    _mm512_storeu_pd(sum[1], axv);
+    _mm512_storeu_pd(sum[2], ayv);
+    _mm512_storeu_pd(sum[3], azv);
+    for (int k=0; k<8; k++) {
+      pot += sum[0][k];
+      ax += sum[1][k];
+      ay += sum[2][k];
+      az += sum[3][k];
+    }
+  }
+#endif
+
+  void P2P(Cell * Ci, Cell * Cj, const int * iX, const FMM & fmm) {
     Body * Bi = Ci->BODY;
     Body * Bj = Cj->BODY;
     int ni = Ci->NBODY;
     int nj = Cj->NBODY;
-    for (int i=0; i<ni; i++) {
-      real_t pot = 0;
-      real_t ax = 0;
-      real_t ay = 0;
-      real_t az = 0;
-      for (int j=0; j<nj; j++) {
-        for (int d=0; d<3; d++) dX[d] = Bi[i].X[d] - Bj[j].X[d] - iX[d] * cycle;
-        real_t R2 = norm(dX);
-        if (R2 != 0) {
-          real_t invR2 = 1.0 / R2;
-          real_t invR = Bj[j].q * sqrt(invR2);
-          for (int d=0; d<3; d++) dX[d] *= invR2 * invR;
-          pot += invR;
-          ax += dX[0];
-          ay += dX[1];
-          az += dX[2];
-        }
+    alignas(64) real_t Xj[nblock], Yj[nblock], Zj[nblock], Qj[nblock];
+    for (int jb=0; jb<nj; jb+=nblock) {
+      int nb = std::min(nblock, nj - jb);
+      int nv = (nb + NSIMD - 1) / NSIMD * NSIMD;
+      for (int j=0; j<nb; j++) {
+        Xj[j] = Bj[jb+j].X[0] + iX[0] * fmm.cycle;
+        Yj[j] = Bj[jb+j].X[1] + iX[1] * fmm.cycle;
+        Zj[j] = Bj[jb+j].X[2] + iX[2] * fmm.cycle;
+        Qj[j] = Bj[jb+j].q;
+      }
+      for (int j=nb; j<nv; j++) {
+        Xj[j] = Yj[j] = Zj[j] = Qj[j] = 0;
+      }
+      for (int i=0; i<ni; i++) {
+        real_t pot = 0;
+        real_t ax = 0;
+        real_t ay = 0;
+        real_t az = 0;
+        P2P(Bi[i].X, Xj, Yj, Zj, Qj, nv, pot, ax, ay, az);
+        Bi[i].p += pot;
+        Bi[i].F[0] -= ax;
+        Bi[i].F[1] -= ay;
+        Bi[i].F[2] -= az;
       }
-      Bi[i].p += pot;
-      Bi[i].F[0] -= ax;
-      Bi[i].F[1] -= ay;
-      Bi[i].F[2] -= az;
     }
   }
 
-  void P2M(Cell * C) {
+  EXAFMM_CLONES
+  void P2M(Cell * C, const FMM & fmm) {
+    const int P = fmm.P;                                        // Order of expansions
+    real_t dX[3];                                               // Distance vector
     complex_t Ynm[P*P], YnmTheta[P*P];
     for (Body * B=C->BODY; B!=C->BODY+C->NBODY; B++) {
       for (int d=0; d<3; d++) dX[d] = B->X[d] - C->X[d];
       real_t rho, alpha, beta;
       cart2sph(dX, rho, alpha, beta);
-      evalMultipole(rho, alpha, -beta, Ynm, YnmTheta);
+      evalMultipole(rho, alpha, -beta, Ynm, YnmTheta, fmm);
       for (int n=0; n<P; n++) {
         for (int m=0; m<=n; m++) {
           int nm  = n * n + n + m;
@@ -166,13 +315,15 @@ namespace exafmm {
     }
   }
 
-  void M2M(Cell * Ci) {
+  void M2M(Cell * Ci, const FMM & fmm) {
+    const int P = fmm.P;                                        // Order of expansions
+    real_t dX[3];                                               // Distance vector
     complex_t Ynm[P*P], YnmTheta[P*P];
     for (Cell * Cj=Ci->CHILD; Cj!=Ci->CHILD+Ci->NCHILD; Cj++) {
       for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d];
       real_t rho, alpha, beta;
       cart2sph(dX, rho, alpha, beta);
-      evalMultipole(rho, alpha, beta, Ynm, YnmTheta);
+      evalMultipole(rho, alpha, beta, Ynm, YnmTheta, fmm);
       for (int j=0; j<P; j++) {
         for (int k=0; k<=j; k++) {
           int jks = j * (j + 1) / 2 + k;
@@ -195,12 +346,20 @@ namespace exafmm {
     }
   }
 
-  void M2L(Cell * Ci, Cell * Cj) {
+  //! Estimated cost of one M2L in P2P body pairs, the number of terms its loops add up
+  inline real_t costM2L(const FMM & fmm) {
+    return real_t(fmm.P) * fmm.P * fmm.P * fmm.P / 2;           // Cost of O(P^4) M2L
+  }
+
+  EXAFMM_CLONES
+  void M2L(Cell * Ci, Cell * Cj, const int * iX, const FMM & fmm) {
+    const int P = fmm.P;                                        // Order of expansions
+    real_t dX[3];                                               // Distance vector
     complex_t Ynm2[4*P*P];
-    for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d] - iX[d] * cycle;
+    for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d] - iX[d] * fmm.cycle;
     real_t rho, alpha, beta;
     cart2sph(dX, rho, alpha, beta);
-    evalLocal(rho, alpha, beta, Ynm2);
+    evalLocal(rho, alpha, beta, Ynm2, fmm);
     for (int j=0; j<P; j++) {
       real_t Cnm = oddOrEven(j);
       for (int k=0; k<=j; k++) {
@@ -224,13 +383,15 @@ namespace exafmm {
     }
   }
 
-  void L2L(Cell * Cj) {
+  void L2L(Cell * Cj, const FMM & fmm) {
+    const int P = fmm.P;                                        // Order of expansions
+    real_t dX[3];                                               // Distance vector
     complex_t Ynm[P*P], YnmTheta[P*P];
     for (Cell * Ci=Cj->CHILD; Ci!=Cj->CHILD+Cj->NCHILD; Ci++) {
       for (int d=0; d<3; d++) dX[d] = Ci->X[d] - Cj->X[d];
       real_t rho, alpha, beta;
       cart2sph(dX, rho, alpha, beta);
-      evalMultipole(rho, alpha, beta, Ynm, YnmTheta);
+      evalMultipole(rho, alpha, beta, Ynm, YnmTheta, fmm);
       for (int j=0; j<P; j++) {
         for (int k=0; k<=j; k++) {
           int jks = j * (j + 1) / 2 + k;
@@ -255,7 +416,10 @@ namespace exafmm {
     }
   }
 
-  void L2P(Cell * Ci) {
+  EXAFMM_CLONES
+  void L2P(Cell * Ci, const FMM & fmm) {
+    const int P = fmm.P;                                        // Order of expansions
+    real_t dX[3];                                               // Distance vector
     complex_t Ynm[P*P], YnmTheta[P*P];
     for (Body * B=Ci->BODY; B!=Ci->BODY+Ci->NBODY; B++) {
       for (int d=0; d<3; d++) dX[d] = B->X[d] - Ci->X[d];
@@ -263,7 +427,7 @@ namespace exafmm {
       real_t cartesian[3] = {0, 0, 0};
       real_t r, theta, phi;
       cart2sph(dX, r, theta, phi);
-      evalMultipole(r, theta, phi, Ynm, YnmTheta);
+      evalMultipole(r, theta, phi, Ynm, YnmTheta, fmm);
       for (int n=0; n<P; n++) {
         int nm  = n * n + n;
         int nms = n * (n + 1) / 2;
@@ -0,0 +1,27 @@
+#ifndef TEST_BODIES_H
+#define TEST_BODIES_H
+
+#include "exafmm.h"
+using namespace exafmm;
+
+//! Random bodies in the cube [xmin,xmax) with neutral charge, cleared outputs and initial numbering
+void initBodies(Bodies & bodies, int seed=0, real_t xmin=-M_PI, real_t xmax=M_PI) {
+  real_t average = 0;                                           // Average charge
+  srand48(seed);                                                // Set seed for random number generator
+  for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
+    for (int d=0; d<3; d++) {                                   //  Loop over dimension
+      bodies[b].X[d] = drand48() * (xmax - xmin) + xmin;        //   Initialize positions
+    }                                                           //  End loop over dimension
+    bodies[b].q = drand48() - .5;                               //  Initialize charge
+    average += bodies[b].q;                                     //  Accumulate charge
+    bodies[b].p = 0;                                            //  Clear potential
+    for (int d=0; d<3; d++) bodies[b].F[d] = 0;                 //  Clear force
+    bodies[b].IBODY = b;                                        //  Initial body numbering
+  }                                                             // End loop over bodies
+  if (bodies.empty()) return;                                   // No charge to neutralize
+  average /= bodies.size();                                     // Average charge
+  for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
+    bodies[b].q -= average;                                     // Charge neutral
+  }                                                             // End loop over bodies
+}
+#endif
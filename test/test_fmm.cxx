@@ -5,3 +5,46 @@ TEST(FMMTest, Accuracy) {
   EXPECT_GT(1e-3, test_fmm(10));
   EXPECT_GT(1e-6, test_fmm(20));
 }
+
+TEST(FMMTest, Truncation) {
+  EXPECT_GT(1e-3, test_fmm(10, pow(0.4, 10)));
+  EXPECT_GT(1e-6, test_fmm(20, pow(0.4, 20)));
+}
+
+TEST(FMMTest, Tolerance) {
+  EXPECT_GT(1e-3, test_tolerance(1e-3));
+  EXPECT_GT(1e-5, test_tolerance(1e-5));
+}
+
+TEST(FMMTest, Unreachable) {
+  bool met;
+  EXPECT_GT(1e-5, test_selection(1e-5, met));
+  EXPECT_TRUE(met);
+  EXPECT_DOUBLE_EQ(predictError(.3, 20), test_selection(1e-12, met));
+  EXPECT_FALSE(met);
+}
+
+TEST(FMMTest, Probe) {
+  EXPECT_GT(1e-3, test_probe(10, 4000, 1000, -1, 2));
+  EXPECT_GT(1e-6, test_probe(20, 4000, 1000, -1, 2));
+}
+
+TEST(FMMTest, Split) {
+  EXPECT_GT(1e-3, test_probe(10, 20000, 2000, -.1, .1));
+}
+
+TEST(FMMTest, Concurrent) {
+  EXPECT_GT(1e-12, test_concurrent());
+}
+
+TEST(FMMTest, Output) {
+  EXPECT_GT(1e-12, test_output());
+}
+
+TEST(FMMTest, Cost) {
+  EXPECT_GT(1e-12, test_cost());
+}
+
+TEST(FMMTest, Batch) {
+  EXPECT_GT(1e-12, test_batch());
+}
@@ -1,58 +1,49 @@
 #ifndef TEST_FMM_H
 #define TEST_FMM_H
 
+#include <omp.h>
 #include "build_tree.h"
 #include "kernel.h"
 #include "timer.h"
 #if EXAFMM_EAGER
-#include "traverse_eager.h"
+#include "batch.h"
 #elif EXAFMM_LAZY
 #include "traverse_lazy.h"
 #endif
+#include "accuracy.h"
+#include "test_bodies.h"
 using namespace exafmm;
 
-real_t test_fmm(int p) {
+real_t test_fmm(int p, real_t eps=0) {
   const int numBodies = 10000;                                  // Number of bodies
-  P = p;                                                       // Order of expansions
-  ncrit = 64;                                                   // Number of bodies per leaf cell
-  theta = 0.4;                                                  // Multipole acceptance criterion
+  FMM fmm;                                                      // Parameters and tables of this solve
+  fmm.P = p;                                                    // Order of expansions
+  fmm.ncrit = 64;                                               // Number of bodies per leaf cell
+  fmm.theta = 0.4;                                              // Multipole acceptance criterion
+  fmm.eps = eps;                                                // Tolerance of M2L truncation
 
   printf("--- %-16s ------------\n", "FMM Profiling");          // Start profiling
   //! Initialize bodies
   start("Initialize bodies");                                   // Start timer
   Bodies bodies(numBodies);                                     // Initialize bodies
-  real_t average = 0;                                           // Average charge
-  srand48(0);                                                   // Set seed for random number generator
-  for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
-    for (int d=0; d<3; d++) {                                   //  Loop over dimension
-      bodies[b].X[d] = drand48() * 2 * M_PI - M_PI;             //   Initialize positions
-    }                                                           //  End loop over dimension
-    bodies[b].q = drand48() - .5;                               //  Initialize charge
-    average += bodies[b].q;                                     //  Accumulate charge
-    bodies[b].p = 0;                                            //  Clear potential
-    for (int d=0; d<3; d++) bodies[b].F[d] = 0;                 //  Clear force
-  }                                                             // End loop over bodies
-  average /= bodies.size();                                     // Average charge
-  for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
-    bodies[b].q -= average;                                     // Charge neutral
-  }                                                             // End loop over bodies
+  initBodies(bodies);                                           // Initialize positions and charges
   stop("Initialize bodies");                                    // Stop timer
 
   //! Build tree
   start("Build tree");                                          // Start timer
-  Cells cells = buildTree(bodies);                              // Build tree
+  Cells cells = buildTree(bodies, fmm);                         // Build tree
   stop("Build tree");                                           // Stop timer
 
   //! FMM evaluation
   start("P2M & M2M");                                           // Start timer
-  initKernel();                                                 // Initialize kernel
-  upwardPass(cells);                                            // Upward pass for P2M, M2M
+  initKernel(fmm);                                              // Initialize kernel
+  upwardPass(cells, fmm);                                       // Upward pass for P2M, M2M
   stop("P2M & M2M");                                            // Stop timer
   start("M2L & P2P");                                           // Start timer
-  horizontalPass(cells, cells);                                 // Horizontal pass for M2L, P2P
+  horizontalPass(cells, cells, fmm);                            // Horizontal pass for M2L, P2P
   stop("M2L & P2P");                                            // Stop timer
   start("L2L & L2P");                                           // Start timer
-  downwardPass(cells);                                          // Downward pass for L2L, L2P
+  downwardPass(cells, fmm);                                     // Downward pass for L2L, L2P
   stop("L2L & L2P");                                            // Stop timer
 
   //! Direct N-Body
@@ -88,4 +79,185 @@ real_t test_fmm(int p) {
   //printf("%-20s : %8.5e s\n","Rel. L2 Error (F)", sqrt(FDif/FNrm));// Print force error
   return sqrt(pDif/pNrm);
 }
+
+//! Potential of an FMM solve of order p on a copy of bodies, in the initial order of bodies
+void solve(Bodies bodies, int p, std::vector<real_t> & pot) {
+  FMM fmm;                                                      // Parameters and tables of this solve
+  fmm.P = p;                                                    // Order of expansions
+  fmm.ncrit = 64;                                               // Number of bodies per leaf cell
+  fmm.theta = 0.4;                                              // Multipole acceptance criterion
+  Cells cells = buildTree(bodies, fmm);                         // Build tree
+  initKernel(fmm);                                              // Initialize kernel
+  upwardPass(cells, fmm);                                       // Upward pass for P2M, M2M
+  horizontalPass(cells, cells, fmm);                            // Horizontal pass for M2L, P2P
+  downwardPass(cells, fmm);                                     // Downward pass for L2L, L2P
+  std::vector<real_t> F(3*bodies.size());                       // Force in initial order
+  pot.resize(bodies.size());                                    // Potential in initial order
+  scatterBodies(bodies, &pot[0], &F[0]);                        // Scatter results back to initial order
+}
+
+//! Difference between two solves of different order run one after another and run at the same time
+real_t test_concurrent() {
+  const int numBodies = 2000;                                   // Number of bodies
+  Bodies bodies(numBodies);                                     // Initialize bodies
+  initBodies(bodies);                                           // Initialize positions and charges
+  std::vector<real_t> serial[2], concurrent[2];                 // Potentials of both solves
+  for (int i=0; i<2; i++) solve(bodies, 6+4*i, serial[i]);      // Solve one after another
+  omp_set_max_active_levels(2);                                 // Let each solve start its own team
+#pragma omp parallel for num_threads(2)
+  for (int i=0; i<2; i++) solve(bodies, 6+4*i, concurrent[i]);  // Solve at the same time
+  real_t dif = 0, nrm = 0;
+  for (int i=0; i<2; i++) {                                     // Loop over solves
+    for (int b=0; b<numBodies; b++) {                           //  Loop over bodies
+      dif += (serial[i][b] - concurrent[i][b]) * (serial[i][b] - concurrent[i][b]);// Difference of potential
+      nrm += serial[i][b] * serial[i][b];                       //   Value of potential
+    }                                                           //  End loop over bodies
+  }                                                             // End loop over solves
+  return sqrt(dif/nrm);
+}
+
+//! Error of potential and force at probes in [xmin,xmax), which have a tree of their own, from sources in [-1,1)
+real_t test_probe(int p, int numSources, int numProbes, real_t xmin, real_t xmax) {
+  FMM fmm;                                                      // Parameters and tables of this solve
+  fmm.P = p;                                                    // Order of expansions
+  fmm.ncrit = 32;                                               // Number of bodies per leaf cell
+  fmm.theta = 0.4;                                              // Multipole acceptance criterion
+  Bodies bodies(numSources), probes(numProbes);                 // Sources and probes
+  initBodies(bodies, 2, -1, 1);                                 // Initialize sources
+  initBodies(probes, 3, xmin, xmax);                            // Initialize probes
+  for (size_t b=0; b<probes.size(); b++) probes[b].q = 0;       // Probes carry no charge
+  Bodies probes2 = probes;                                      // Copy probes for direct summation
+  Cells cells = buildTree(bodies, fmm);                         // Build source tree
+  Cells pcells = buildTree(probes, fmm);                        // Build probe tree
+  initKernel(fmm);                                              // Initialize kernel
+  upwardPass(cells, fmm);                                       // Upward pass for P2M, M2M
+  initTargets(pcells, fmm);                                     // Clear local coefs of probe tree
+  horizontalPass(pcells, cells, fmm);                           // Horizontal pass for M2L, P2P to probes
+  downwardPass(pcells, fmm);                                    // Downward pass for L2L, L2P to probes
+  direct(probes2, bodies);                                      // Direct summation to probes
+  real_t dif = 0, nrm = 0;
+  for (size_t b=0; b<probes.size(); b++) {                      // Loop over probes in tree order
+    const Body & B = probes2[probes[b].IBODY];                  //  Same probe in initial order
+    dif += (probes[b].p - B.p) * (probes[b].p - B.p);           //  Difference of potential
+    nrm += B.p * B.p;                                           //  Value of potential
+    for (int d=0; d<3; d++) {                                   //  Loop over dimension
+      dif += (probes[b].F[d] - B.F[d]) * (probes[b].F[d] - B.F[d]);// Difference of force
+      nrm += B.F[d] * B.F[d];                                   //   Value of force
+    }                                                           //  End loop over dimension
+  }                                                             // End loop over probes
+  return sqrt(dif/nrm);
+}
+
+//! Sampled error of a solve whose theta and P are chosen for the given tolerance
+real_t test_tolerance(real_t tolerance) {
+  const int numBodies = 5000;                                   // Number of bodies
+  Bodies bodies(numBodies);                                     // Initialize bodies
+  initBodies(bodies, 4);                                        // Initialize positions and charges
+  FMM fmm;                                                      // Parameters and tables of this solve
+  fmm.ncrit = 64;                                               // Number of bodies per leaf cell
+  Cells cells = buildTree(bodies, fmm);                         // Build tree
+  selectAccuracy(cells, fmm, tolerance);                        // Choose theta and P for tolerance
+  initKernel(fmm);                                              // Initialize kernel
+  upwardPass(cells, fmm);                                       // Upward pass for P2M, M2M
+  horizontalPass(cells, cells, fmm);                            // Horizontal pass for M2L, P2P
+  downwardPass(cells, fmm);                                     // Downward pass for L2L, L2P
+  return sampleError(bodies, 100);                              // Error at sampled bodies
+}
+
+//! Predicted error of the theta and P chosen for the given tolerance, and whether any candidate meets it
+real_t test_selection(real_t tolerance, bool & met) {
+  Bodies bodies(5000);                                          // Initialize bodies
+  initBodies(bodies, 4);                                        // Initialize positions and charges
+  FMM fmm;                                                      // Parameters and tables of this solve
+  Cells cells = buildTree(bodies, fmm);                         // Build tree
+  met = selectAccuracy(cells, fmm, tolerance);                  // Choose theta and P for tolerance
+  return predictError(fmm.theta, fmm.P);                        // Predicted error of the choice
+}
+
+#if EXAFMM_EAGER
+//! Difference between the estimated cost of the whole target tree and the cost of the interactions it counts
+real_t test_cost() {
+  Bodies bodies(5000);                                          // Initialize bodies
+  initBodies(bodies, 5, 0, 1);                                  // Initialize positions and charges
+  FMM fmm;                                                      // Parameters and tables of this solve
+  fmm.ncrit = 32;                                               // Number of bodies per leaf cell
+  Cells cells = buildTree(bodies, fmm);                         // Build tree
+  for (int i=0; i<2; i++) {                                     // Estimate twice to check that costs are cleared
+#pragma omp parallel                                            //  Start OpenMP
+#pragma omp single nowait                                       //  Start OpenMP single region with nowait
+    initCost(&cells[0], &cells[0], fmm);                        //  Estimate cost of target subtrees
+  }                                                             // End loop over estimates
+  double nM2L = 0, nP2P = 0;                                    // Number of interactions
+  countInteractions(&cells[0], &cells[0], fmm.theta, nM2L, nP2P);// Count interactions
+  real_t cost = nM2L * costM2L(fmm) + nP2P;                     // Cost of interactions
+  return std::abs(cells[0].COST - cost) / cost;
+}
+#endif
+
+//! Difference of potential-only and force-only solves from a solve of both, or 1 if they evaluate other outputs
+real_t test_output() {
+  const int numBodies = 2000;                                   // Number of bodies
+  Bodies bodies(numBodies);                                     // Initialize bodies
+  initBodies(bodies, 3);                                        // Initialize positions and charges
+  Bodies result[3];                                             // Bodies of each combination of outputs
+  for (int o=1; o<=3; o++) {                                    // Loop over potential, force and both
+    FMM fmm;                                                    //  Parameters and tables of this solve
+    fmm.P = 8;                                                  //  Order of expansions
+    fmm.ncrit = 64;                                             //  Number of bodies per leaf cell
+    fmm.theta = 0.4;                                            //  Multipole acceptance criterion
+    fmm.output = o;                                             //  Outputs to evaluate
+    result[o-1] = bodies;                                       //  Copy bodies
+    Cells cells = buildTree(result[o-1], fmm);                  //  Build tree
+    initKernel(fmm);                                            //  Initialize kernel
+    upwardPass(cells, fmm);                                     //  Upward pass for P2M, M2M
+    horizontalPass(cells, cells, fmm);                          //  Horizontal pass for M2L, P2P
+    downwardPass(cells, fmm);                                   //  Downward pass for L2L, L2P
+  }                                                             // End loop over outputs
+  Bodies & pOnly = result[0], & FOnly = result[1], & both = result[2];
+  real_t dif = 0, nrm = 0;
+  for (int b=0; b<numBodies; b++) {                             // Loop over bodies in tree order
+    if (pOnly[b].F[0] != 0 || pOnly[b].F[1] != 0 || pOnly[b].F[2] != 0 || FOnly[b].p != 0) return 1;
+    dif += (pOnly[b].p - both[b].p) * (pOnly[b].p - both[b].p); //  Difference of potential
+    nrm += both[b].p * both[b].p;                               //  Value of potential
+    for (int d=0; d<3; d++) {                                   //  Loop over dimension
+      dif += (FOnly[b].F[d] - both[b].F[d]) * (FOnly[b].F[d] - both[b].F[d]);// Difference of force
+      nrm += both[b].F[d] * both[b].F[d];                       //   Value of force
+    }                                                           //  End loop over dimension
+  }                                                             // End loop over bodies
+  return sqrt(dif/nrm);
+}
+
+#if EXAFMM_EAGER
+//! Difference between a batch of systems solved at once and solved one by one
+real_t test_batch() {
+  const int numSystems = 8;                                     // Number of systems
+  FMM fmm;                                                      // Parameters and tables of all systems
+  fmm.P = 8;                                                    // Order of expansions
+  fmm.ncrit = 32;                                               // Number of bodies per leaf cell
+  fmm.theta = 0.4;                                              // Multipole acceptance criterion
+  initKernel(fmm);                                              // Initialize kernel
+  std::vector<Bodies> systems(numSystems);                      // Bodies of each system
+  for (int s=0; s<numSystems; s++) {                            // Loop over systems
+    systems[s].resize(s == 1 ? 0 : s == 2 ? 1 : 100 * s);       //  Include an empty and a single body system
+    initBodies(systems[s], 1+s, 0, s+1);                        //  Initialize positions and charges
+  }                                                             // End loop over systems
+  std::vector<Bodies> systems2 = systems;                       // Copy systems for solving one by one
+  Cells cells;                                                  // Cells and coefs of all systems
+  for (int i=0; i<2; i++) evaluateBatch(systems, cells, fmm);   // Solve twice to reuse the arena
+  real_t dif = 0, nrm = 0;
+  for (int s=0; s<numSystems; s++) {                            // Loop over systems
+    if (systems2[s].empty()) continue;                          //  Skip empty system
+    Cells cells2 = buildTree(systems2[s], fmm);                 //  Build tree
+    upwardPass(cells2, fmm);                                    //  Upward pass for P2M, M2M
+    horizontalPass(cells2, cells2, fmm);                        //  Horizontal pass for M2L, P2P
+    downwardPass(cells2, fmm);                                  //  Downward pass for L2L, L2P
+    for (size_t b=0; b<systems[s].size(); b++) {                //  Loop over bodies
+      real_t p = systems[s][b].p / 2;                           //   Batch potential accumulated twice
+      dif += (p - systems2[s][b].p) * (p - systems2[s][b].p);   //   Difference of potential
+      nrm += systems2[s][b].p * systems2[s][b].p;               //   Value of potential
+    }                                                           //  End loop over bodies
+  }                                                             // End loop over systems
+  return sqrt(dif/nrm);
+}
+#endif
 #endif
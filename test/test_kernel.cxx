@@ -6,3 +6,13 @@ TEST(KernelTest, Accuracy) {
   EXPECT_GT(1e-6, test_kernel(20));
   EXPECT_GT(1e-9, test_kernel(30));
 }
+
+TEST(KernelTest, Order) {
+  EXPECT_GT(1e-12, test_order<4>());
+  EXPECT_GT(1e-12, test_order<10>());
+  EXPECT_GT(1e-12, test_order<20>());
+}
+
+TEST(KernelTest, Range) {
+  EXPECT_GT(1e-12, test_range());
+}
@@ -4,14 +4,16 @@
 #include "kernel.h"
 using namespace exafmm;
 real_t test_kernel(int p) {
-  P = p;
-  initKernel();
+  FMM fmm;
+  fmm.P = p;
+  initKernel(fmm);
 
   // P2M
   Bodies jbodies(1);
   for (int d=0; d<3; d++) jbodies[0].X[d] = 2;
   jbodies[0].q = 1;
   Cells cells(4);
+  initCoefs(cells, fmm);
   Cell * Cj = &cells[0];
   Cj->X[0] = 3;
   Cj->X[1] = 1;
@@ -19,8 +21,7 @@ real_t test_kernel(int p) {
   Cj->R = 1;
   Cj->BODY = &jbodies[0];
   Cj->NBODY = jbodies.size();
-  Cj->M.resize(NTERM, 0.0);
-  P2M(Cj);
+  P2M(Cj, fmm);
 
   // M2M
   Cell * CJ = &cells[1];
@@ -30,8 +31,7 @@ real_t test_kernel(int p) {
   CJ->X[1] = 0;
   CJ->X[2] = 0;
   CJ->R = 2;
-  CJ->M.resize(NTERM, 0.0);
-  M2M(CJ);
+  M2M(CJ, fmm);
 
   // M2L
   Cell * CI = &cells[2];
@@ -39,8 +39,7 @@ real_t test_kernel(int p) {
   CI->X[1] = 0;
   CI->X[2] = 0;
   CI->R = 2;
-  CI->L.resize(NTERM, 0.0);
-  M2L(CI, CJ);
+  M2L(CI, CJ, fmm);
 
   // L2L
   Cell * Ci = &cells[3];
@@ -50,8 +49,7 @@ real_t test_kernel(int p) {
   Ci->X[1] = 1;
   Ci->X[2] = 1;
   Ci->R = 1;
-  Ci->L.resize(NTERM, 0.0);
-  L2L(CI);
+  L2L(CI, fmm);
 
   // L2P
   Bodies bodies(1);
@@ -63,7 +61,7 @@ real_t test_kernel(int p) {
   for (int d=0; d<3; d++) bodies[0].F[d] = 0;
   Ci->BODY = &bodies[0];
   Ci->NBODY = bodies.size();
-  L2P(Ci);
+  L2P(Ci, fmm);
 
   // P2P
   Bodies bodies2(1);
@@ -92,4 +90,71 @@ real_t test_kernel(int p) {
   //printf("%-20s : %8.5e s\n","Rel. L2 Error (F)", sqrt(FDif/FNrm));
   return sqrt(pDif/pNrm);
 }
+
+//! Difference between the kernels instantiated for order Pt and the generic ones
+template<int Pt>
+real_t test_order() {
+  FMM fmm;
+  fmm.P = Pt;
+  initKernel(fmm);
+  Cells cells(4);
+  real_t X[4][3] = {{3, 1, 1}, {4, 0, 0}, {-4, 0, 0}, {-3, 1, 1}};
+  initCoefs(cells, fmm);
+  srand48(0);
+  for (int c=0; c<4; c++) {
+    for (int d=0; d<3; d++) cells[c].X[d] = X[c][d];
+    cells[c].R = c % 3 ? 2 : 1;
+    for (int n=0; n<fmm.NTERM; n++) cells[c].M[n] = complex_t(drand48(), drand48());
+  }
+  cells[1].CHILD = &cells[0];
+  cells[1].NCHILD = 1;
+  cells[2].CHILD = &cells[3];
+  cells[2].NCHILD = 1;
+  std::vector<complex_t> C[2];
+  for (int i=0; i<2; i++) {
+    std::fill(cells[1].M, cells[1].M + fmm.NTERM, 0.0);
+    std::fill(cells[2].L, cells[2].L + fmm.NTERM, 0.0);
+    std::fill(cells[3].L, cells[3].L + fmm.NTERM, 0.0);
+    if (i == 0) {
+      M2M<Pt>(&cells[1], fmm);
+      M2L<Pt>(&cells[2], &cells[1], fmm);
+      L2L<Pt>(&cells[2], fmm);
+    } else {
+      M2M<0>(&cells[1], fmm);
+      M2L<0>(&cells[2], &cells[1], fmm);
+      L2L<0>(&cells[2], fmm);
+    }
+    C[i].assign(cells[1].M, cells[1].M + fmm.NTERM);
+    C[i].insert(C[i].end(), cells[3].L, cells[3].L + fmm.NTERM);
+  }
+  real_t dif = 0, nrm = 0;
+  for (size_t n=0; n<C[0].size(); n++) {
+    dif += std::norm(C[0][n] - C[1][n]);
+    nrm += std::norm(C[1][n]);
+  }
+  return sqrt(dif/nrm);
+}
+
+//! Relative difference between the AVX2 and scalar block P2P for sources so near or far that their squared distance
+//! overflows or underflows float, 0 if the CPU has no AVX2
+real_t test_range() {
+  if (simdLevel() < 1) return 0;
+  alignas(64) real_t Xj[4], Yj[4], Zj[4], Qj[4];
+  real_t Xi[3] = {0, 0, 0};
+  real_t dist[] = {1e-30, 1e-20, 1e-19, 1, 1e19, 1e20, 1e30};
+  real_t dif = 0;
+  for (real_t r : dist) {
+    for (int j=0; j<4; j++) {
+      Xj[j] = j ? j + 1 : r;
+      Yj[j] = Zj[j] = 0;
+      Qj[j] = 1;
+    }
+    real_t p[2] = {0, 0}, F[2][3] = {{0, 0, 0}, {0, 0, 0}};
+    for (int i=0; i<2; i++)
+      P2P<POTENTIAL|FORCE>(1 - i, Xi, Xj, Yj, Zj, Qj, 4, &p[i], &F[i][0], &F[i][1], &F[i][2]);
+    dif += std::abs(p[0] - p[1]) / std::abs(p[1]);
+    dif += std::abs(F[0][0] - F[1][0]) / std::abs(F[1][0]);
+  }
+  return dif;
+}
 #endif
@@ -0,0 +1,22 @@
+#include "test_list.h"
+#include "gtest/gtest.h"
+
+TEST(ListTest, Consistency) {
+  EXPECT_EQ(0, test_list());
+}
+
+TEST(ListTest, Skin) {
+  bool reused;
+  EXPECT_GT(1e-3, test_skin(0.01, reused));
+  EXPECT_TRUE(reused);
+  EXPECT_GT(1e-3, test_skin(0.2, reused));
+  EXPECT_FALSE(reused);
+}
+
+TEST(ListTest, Stale) {
+  EXPECT_EQ(0, test_stale());
+}
+
+TEST(ListTest, Dataflow) {
+  EXPECT_GT(1e-12, test_dataflow());
+}
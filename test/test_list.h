@@ -0,0 +1,192 @@
+#ifndef TEST_LIST_H
+#define TEST_LIST_H
+
+#include "build_tree.h"
+#include "kernel.h"
+#include "traverse_lazy.h"
+#include "test_bodies.h"
+using namespace exafmm;
+
+int test_list() {
+  const int numBodies = 10000;                                  // Number of bodies
+  FMM fmm;                                                      // Parameters and lists of this solve
+  fmm.ncrit = 64;                                               // Number of bodies per leaf cell
+  fmm.theta = 0.4;                                              // Multipole acceptance criterion
+  fmm.skin = 0;                                                 // Verlet skin
+
+  //! Build tree and lists
+  Bodies bodies(numBodies);                                     // Initialize bodies
+  initBodies(bodies);                                           // Initialize positions and charges
+  Cells cells = buildTree(bodies, fmm);                         // Build tree
+  getList(cells, cells, fmm);                                   // Build interaction lists
+  std::vector<int> parent(cells.size(), -1);                    // Parent index of each cell
+  for (size_t c=0; c<cells.size(); c++) {                       // Loop over cells
+    for (Cell * Cc=cells[c].CHILD; Cc!=cells[c].CHILD+cells[c].NCHILD; Cc++) {// Loop over child cells
+      parent[Cc-&cells[0]] = c;                                 //   Set parent index
+    }                                                           //  End loop over child cells
+  }                                                             // End loop over cells
+
+  //! Count lists that are unsorted, out of range, or do not cover every body exactly once
+  const Lists & lists = fmm.lists;                              // Interaction lists
+  int errors = 0;
+  int ncell = cells.size();                                     // Number of cells
+  for (int i=0; i<ncell; i++) {                                 // Loop over cells
+    for (int k=lists.offsetM2L[i]; k<lists.offsetM2L[i+1]; k++) {// Loop over M2L list
+      if (lists.listM2L[k] < 0 || lists.listM2L[k] >= ncell) errors++;// Index out of range
+      if (k > lists.offsetM2L[i] && lists.listM2L[k] <= lists.listM2L[k-1]) errors++;// List not sorted
+    }                                                           //  End loop over M2L list
+    for (int k=lists.offsetP2P[i]; k<lists.offsetP2P[i+1]; k++) {// Loop over P2P list
+      if (lists.listP2P[k] < 0 || lists.listP2P[k] >= ncell) errors++;// Index out of range
+      if (k > lists.offsetP2P[i] && lists.listP2P[k] <= lists.listP2P[k-1]) errors++;// List not sorted
+    }                                                           //  End loop over P2P list
+    if (cells[i].NCHILD != 0) continue;                         //  Skip cells that are not leafs
+    int count = 0;                                              //  Number of bodies seen by this leaf
+    for (int k=lists.offsetP2P[i]; k<lists.offsetP2P[i+1]; k++) {// Loop over P2P list
+      count += cells[lists.listP2P[k]].NBODY;                   //   Count bodies of P2P sources
+    }                                                           //  End loop over P2P list
+    for (int c=i; c>=0; c=parent[c]) {                          //  Loop over leaf and its ancestors
+      for (int k=lists.offsetM2L[c]; k<lists.offsetM2L[c+1]; k++) {// Loop over M2L list
+        count += cells[lists.listM2L[k]].NBODY;                 //    Count bodies of M2L sources
+      }                                                         //   End loop over M2L list
+    }                                                           //  End loop over ancestors
+    if (count != numBodies) errors++;                           //  Every body must be seen once
+  }                                                             // End loop over cells
+
+  //! Count cells that are not sorted by the cost of their lists, or whose subtree cost does not add up
+  std::vector<int> order = sortCells(cells, cells, fmm);        // Cells in descending order of cost of their lists
+  std::vector<int> seen(ncell, 0);                              // Number of times each cell is in the order
+  real_t previous = 0;                                          // Cost of lists of previous cell in the order
+  for (int n=0; n<ncell; n++) {                                 // Loop over cells in order of cost
+    int i = order[n];                                           //  Cell index
+    seen[i]++;                                                  //  Count cell
+    real_t cost = (lists.offsetM2L[i+1] - lists.offsetM2L[i]) * costM2L(fmm);// Cost of M2L list
+    for (int k=lists.offsetP2P[i]; k<lists.offsetP2P[i+1]; k++) {// Loop over P2P list
+      cost += real_t(cells[i].NBODY) * cells[lists.listP2P[k]].NBODY;// Cost of P2P
+    }                                                           //  End loop over P2P list
+    real_t subtree = cost;                                      //  Cost of subtree
+    for (Cell * Cc=cells[i].CHILD; Cc!=cells[i].CHILD+cells[i].NCHILD; Cc++) subtree += Cc->COST;// Add child subtrees
+    if (std::abs(subtree - cells[i].COST) > 1e-12 * subtree) errors++;// Subtree cost does not add up
+    if (n > 0 && cost > previous) errors++;                     //  Order is not descending
+    previous = cost;                                            //  Update previous cost
+  }                                                             // End loop over cells in order of cost
+  for (int i=0; i<ncell; i++) {                                 // Loop over cells
+    if (seen[i] != 1) errors++;                                 //  Every cell must be in the order once
+  }                                                             // End loop over cells
+  return errors;
+}
+
+real_t test_skin(real_t dx, bool & reused) {
+  const int numBodies = 10000;                                  // Number of bodies
+  FMM fmm;                                                      // Parameters and lists of this solve
+  fmm.P = 8;                                                    // Order of expansions
+  fmm.ncrit = 64;                                               // Number of bodies per leaf cell
+  fmm.theta = 0.4;                                              // Multipole acceptance criterion
+  fmm.skin = 0.05;                                              // Verlet skin
+
+  //! FMM evaluation that builds lists with skin
+  Bodies bodies(numBodies);                                     // Initialize bodies
+  initBodies(bodies);                                           // Initialize positions and charges
+  Cells cells = buildTree(bodies, fmm);                         // Build tree
+  initKernel(fmm);                                              // Initialize kernel
+  upwardPass(cells, fmm);                                       // Upward pass for P2M, M2M
+  horizontalPass(cells, cells, fmm);                            // Horizontal pass for M2L, P2P
+  downwardPass(cells, fmm);                                     // Downward pass for L2L, L2P
+
+  //! Move bodies by at most dx and evaluate again on the same tree
+  for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
+    for (int d=0; d<3; d++) {                                   //  Loop over dimension
+      bodies[b].X[d] += (drand48() * 2 - 1) * dx / std::sqrt(3.);//  Random displacement
+    }                                                           //  End loop over dimension
+    bodies[b].p = 0;                                            //  Clear potential
+    for (int d=0; d<3; d++) bodies[b].F[d] = 0;                 //  Clear force
+  }                                                             // End loop over bodies
+  reused = reuseList(cells, cells, fmm);                        // Check if lists will be reused
+  upwardPass(cells, fmm);                                       // Upward pass for P2M, M2M
+  horizontalPass(cells, cells, fmm);                            // Horizontal pass for M2L, P2P
+  downwardPass(cells, fmm);                                     // Downward pass for L2L, L2P
+
+  //! Direct N-Body
+  const int numTargets = 10;                                    // Number of targets for checking answer
+  Bodies jbodies = bodies;                                      // Save bodies in jbodies
+  int stride = bodies.size() / numTargets;                      // Stride of sampling
+  for (int b=0; b<numTargets; b++) {                            // Loop over target samples
+    bodies[b] = bodies[b*stride];                               //  Sample targets
+  }                                                             // End loop over target samples
+  bodies.resize(numTargets);                                    // Resize bodies
+  Bodies bodies2 = bodies;                                      // Backup bodies
+  for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
+    bodies[b].p = 0;                                            //  Clear potential
+    for (int d=0; d<3; d++) bodies[b].F[d] = 0;                 //  Clear force
+  }                                                             // End loop over bodies
+  direct(bodies, jbodies);                                      // Direct N-Body
+
+  //! Verify result
+  real_t pDif = 0, pNrm = 0;
+  for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies & bodies2
+    pDif += (bodies[b].p - bodies2[b].p) * (bodies[b].p - bodies2[b].p);// Difference of potential
+    pNrm += bodies2[b].p * bodies2[b].p;                        //  Value of potential
+  }                                                             // End loop over bodies & bodies2
+  return sqrt(pDif/pNrm);
+}
+
+//! Number of trees whose lists are wrongly reused or not reused after the same, a refit and a rebuilt tree
+int test_stale() {
+  const int numBodies = 10000;                                  // Number of bodies
+  FMM fmm;                                                      // Parameters and lists of this solve
+  fmm.P = 8;                                                    // Order of expansions
+  fmm.ncrit = 64;                                               // Number of bodies per leaf cell
+  fmm.theta = 0.4;                                              // Multipole acceptance criterion
+  fmm.skin = 0.05;                                              // Verlet skin
+
+  //! FMM evaluation that builds lists with skin
+  Bodies bodies(numBodies);                                     // Initialize bodies
+  initBodies(bodies);                                           // Initialize positions and charges
+  Cells cells = buildTree(bodies, fmm);                         // Build tree
+  initKernel(fmm);                                              // Initialize kernel
+  upwardPass(cells, fmm);                                       // Upward pass for P2M, M2M
+  horizontalPass(cells, cells, fmm);                            // Horizontal pass for M2L, P2P
+
+  //! Count lists whose reuse does not match whether the tree changed
+  int errors = 0;
+  if (!reuseList(cells, cells, fmm)) errors++;                  // Same tree must reuse its lists
+  refitTree(cells, bodies, fmm);                                // Refit tree to the same bodies
+  if (reuseList(cells, cells, fmm)) errors++;                   // Refit tree must not reuse lists
+  horizontalPass(cells, cells, fmm);                            // Build lists for the refit tree
+  cells = buildTree(bodies, fmm);                               // Rebuild tree with as many cells
+  if (reuseList(cells, cells, fmm)) errors++;                   // Rebuilt tree must not reuse lists
+  return errors;
+}
+
+//! Relative L2 error of potential and force of the dataflow graph against the three passes
+real_t test_dataflow() {
+  const int numBodies = 10000;                                  // Number of bodies
+  FMM fmm;                                                      // Parameters and lists of this solve
+  fmm.P = 8;                                                    // Order of expansions
+  fmm.ncrit = 64;                                               // Number of bodies per leaf cell
+  fmm.theta = 0.4;                                              // Multipole acceptance criterion
+  initKernel(fmm);                                              // Initialize kernel
+
+  //! FMM evaluation by the three passes and by one dataflow graph
+  Bodies bodies(numBodies);                                     // Initialize bodies
+  initBodies(bodies);                                           // Initialize positions and charges
+  Bodies bodies2 = bodies;                                      // Copy bodies for dataflow evaluation
+  Cells cells = buildTree(bodies, fmm);                         // Build tree
+  upwardPass(cells, fmm);                                       // Upward pass for P2M, M2M
+  horizontalPass(cells, cells, fmm);                            // Horizontal pass for M2L, P2P
+  downwardPass(cells, fmm);                                     // Downward pass for L2L, L2P
+  Cells cells2 = buildTree(bodies2, fmm);                       // Build tree
+  dataflowPass(cells2, fmm);                                    // All passes as one graph of tasks
+
+  //! Verify result
+  real_t dif = 0, nrm = 0;
+  for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies & bodies2
+    dif += (bodies[b].p - bodies2[b].p) * (bodies[b].p - bodies2[b].p);// Difference of potential
+    nrm += bodies[b].p * bodies[b].p;                           //  Value of potential
+    for (int d=0; d<3; d++) {                                   //  Loop over dimension
+      dif += (bodies[b].F[d] - bodies2[b].F[d]) * (bodies[b].F[d] - bodies2[b].F[d]);// Difference of force
+      nrm += bodies[b].F[d] * bodies[b].F[d];                   //   Value of force
+    }                                                           //  End loop over dimension
+  }                                                             // End loop over bodies & bodies2
+  return sqrt(dif/nrm);
+}
+#endif
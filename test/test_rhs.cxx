@@ -0,0 +1,7 @@
+#include "test_rhs.h"
+#include "gtest/gtest.h"
+
+TEST(RHSTest, Accuracy) {
+  EXPECT_GT(1e-3, test_rhs(10));
+  EXPECT_GT(1e-5, test_rhs(20));
+}
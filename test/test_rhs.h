@@ -0,0 +1,57 @@
+#ifndef TEST_RHS_H
+#define TEST_RHS_H
+
+#include "build_tree.h"
+#include "kernel.h"
+#include "traverse_lazy.h"
+using namespace exafmm;
+
+//! Max relative L2 error over all right-hand sides of one FMM solve against a plain direct sum
+real_t test_rhs(int p) {
+  const int numBodies = 2000;                                   // Number of bodies
+  FMM fmm;                                                      // Parameters and tables of this solve
+  fmm.P = p;                                                    // Order of expansions
+  fmm.ncrit = 32;                                               // Number of bodies per leaf cell
+  fmm.theta = 0.4;                                              // Multipole acceptance criterion
+  Bodies bodies(numBodies);                                     // Initialize bodies
+  srand48(3);                                                   // Set seed for random number generator
+  for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
+    for (int d=0; d<3; d++) bodies[b].X[d] = drand48() * 2 - 1; //  Initialize positions
+    for (int k=0; k<NRHS; k++) {                                //  Loop over right-hand sides
+      bodies[b].q[k] = drand48() - .5;                          //   Independent charge vectors
+      bodies[b].p[k] = 0;                                       //   Clear potential
+      for (int d=0; d<3; d++) bodies[b].F[k][d] = 0;            //   Clear force
+    }                                                           //  End loop over right-hand sides
+    bodies[b].IBODY = b;                                        //  Initial body numbering
+  }                                                             // End loop over bodies
+  Cells cells = buildTree(bodies, fmm);                         // Build tree
+  initKernel(fmm);                                              // Initialize kernel
+  upwardPass(cells, fmm);                                       // Upward pass for P2M, M2M
+  horizontalPass(cells, cells, fmm);                            // Horizontal pass for M2L, P2P
+  downwardPass(cells, fmm);                                     // Downward pass for L2L, L2P
+  real_t err = 0;                                               // Max error over right-hand sides
+  for (int k=0; k<NRHS; k++) {                                  // Loop over right-hand sides
+    real_t pDif = 0, pNrm = 0, FDif = 0, FNrm = 0;
+    for (int i=0; i<numBodies; i+=20) {                         //  Loop over sampled targets
+      real_t pot = 0, F[3] = {0, 0, 0};                         //   Direct potential and force
+      for (int j=0; j<numBodies; j++) {                         //   Loop over sources
+        real_t dX[3];                                           //    Distance vector
+        for (int d=0; d<3; d++) dX[d] = bodies[i].X[d] - bodies[j].X[d];
+        real_t R2 = norm(dX);                                   //    Distance squared
+        if (R2 == 0) continue;                                  //    Skip self interaction
+        real_t invR = 1 / std::sqrt(R2);                        //    1 / R
+        pot += bodies[j].q[k] * invR;                           //    Potential
+        for (int d=0; d<3; d++) F[d] -= bodies[j].q[k] * dX[d] * invR * invR * invR;// Force
+      }                                                         //   End loop over sources
+      pDif += (bodies[i].p[k] - pot) * (bodies[i].p[k] - pot);  //   Difference of potential
+      pNrm += pot * pot;                                        //   Value of potential
+      for (int d=0; d<3; d++) {                                 //   Loop over dimension
+        FDif += (bodies[i].F[k][d] - F[d]) * (bodies[i].F[k][d] - F[d]);// Difference of force
+        FNrm += F[d] * F[d];                                    //    Value of force
+      }                                                         //   End loop over dimension
+    }                                                           //  End loop over sampled targets
+    err = std::max(err, std::max(sqrt(pDif/pNrm), sqrt(FDif/FNrm)));// Update max error
+  }                                                             // End loop over right-hand sides
+  return err;
+}
+#endif
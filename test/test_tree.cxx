@@ -0,0 +1,21 @@
+#include "test_tree.h"
+#include "gtest/gtest.h"
+
+TEST(TreeTest, Consistency) {
+  EXPECT_EQ(0, test_tree(false, false));
+  EXPECT_EQ(0, test_tree(true, false));
+  EXPECT_EQ(0, test_tree(true, true));
+}
+
+TEST(TreeTest, Refit) {
+  bool rebuilt;
+  EXPECT_EQ(0, test_refit(0.01, rebuilt));
+  EXPECT_FALSE(rebuilt);
+  EXPECT_EQ(0, test_refit(1.0, rebuilt));
+  EXPECT_TRUE(rebuilt);
+}
+
+TEST(TreeTest, Scatter) {
+  EXPECT_EQ(0, test_scatter(false));
+  EXPECT_EQ(0, test_scatter(true));
+}
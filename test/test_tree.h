@@ -0,0 +1,127 @@
+#ifndef TEST_TREE_H
+#define TEST_TREE_H
+
+#include "build_tree_key.h"
+using namespace exafmm;
+
+int test_tree(bool key, bool hilbert) {
+  const int numBodies = 10000;                                  // Number of bodies
+  FMM fmm;                                                      // Parameters of the tree
+  fmm.ncrit = 64;                                               // Number of bodies per leaf cell
+
+  //! Initialize bodies
+  Bodies bodies(numBodies);                                     // Initialize bodies
+  srand48(0);                                                   // Set seed for random number generator
+  for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
+    for (int d=0; d<3; d++) {                                   //  Loop over dimension
+      bodies[b].X[d] = drand48() * 2 * M_PI - M_PI;             //   Initialize positions
+    }                                                           //  End loop over dimension
+    bodies[b].q = drand48() - .5;                               //  Initialize charge
+  }                                                             // End loop over bodies
+
+  //! Build tree
+  Cells cells = key ? buildTreeKey(bodies, fmm, hilbert) : buildTree(bodies, fmm);// Build tree
+
+  //! Count cells that are inconsistent with their bodies or children
+  int errors = 0;
+  int numLeafBodies = 0;
+  int owner = 0;                                                // Owner of previous cell
+  if (cells.owners.empty() || cells.owners.back() != int(cells.size())) errors++;// Threads must own all cells
+  for (size_t c=0; c<cells.size(); c++) {                       // Loop over cells
+    Cell * C = &cells[c];
+    if (cells.owner(C) < owner || cells.owner(C) >= omp_get_max_threads()) errors++;// Owners must follow cell order
+    owner = cells.owner(C);                                     //  Owner of cell
+    for (Body * B=C->BODY; B!=C->BODY+C->NBODY; B++) {          //  Loop over bodies in cell
+      for (int d=0; d<3; d++) {                                 //   Loop over dimension
+        if (std::abs(B->X[d] - C->X[d]) > C->R * (1 + 1e-12)) errors++;// Body outside of cell
+      }                                                         //   End loop over dimension
+    }                                                           //  End loop over bodies in cell
+    if (C->NCHILD == 0) numLeafBodies += C->NBODY;              //  Count bodies in leafs
+    Body * B = C->BODY;                                         //  Expected first body of next child
+    for (Cell * Cc=C->CHILD; Cc!=C->CHILD+C->NCHILD; Cc++) {    //  Loop over child cells
+      if (Cc->BODY != B) errors++;                              //   Children must cover contiguous bodies
+      if (Cc->R != C->R / 2) errors++;                          //   Child radius must be half of parent
+      B += Cc->NBODY;                                           //   Increment expected body
+    }                                                           //  End loop over child cells
+    if (C->NCHILD != 0 && B != C->BODY + C->NBODY) errors++;    //  Children must cover all bodies
+  }                                                             // End loop over cells
+  if (numLeafBodies != numBodies) errors++;                     // Every body must be in one leaf
+  return errors;
+}
+
+int test_refit(real_t dx, bool & rebuilt) {
+  const int numBodies = 10000;                                  // Number of bodies
+  FMM fmm;                                                      // Parameters of the tree
+  fmm.ncrit = 64;                                               // Number of bodies per leaf cell
+
+  //! Initialize bodies
+  Bodies bodies(numBodies);                                     // Initialize bodies
+  srand48(0);                                                   // Set seed for random number generator
+  for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
+    for (int d=0; d<3; d++) {                                   //  Loop over dimension
+      bodies[b].X[d] = drand48() * 2 * M_PI - M_PI;             //   Initialize positions
+    }                                                           //  End loop over dimension
+    bodies[b].q = drand48() - .5;                               //  Initialize charge
+  }                                                             // End loop over bodies
+
+  //! Build tree, move bodies and refit tree
+  Cells cells = buildTree(bodies, fmm);                         // Build tree
+  Body * B0 = &bodies[0];                                       // Pointer of first body before refit
+  for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
+    for (int d=0; d<3; d++) {                                   //  Loop over dimension
+      bodies[b].X[d] += (drand48() * 2 - 1) * dx;               //   Move bodies
+    }                                                           //  End loop over dimension
+  }                                                             // End loop over bodies
+  rebuilt = refitTree(cells, bodies, fmm);                      // Refit tree
+
+  //! Count bodies outside of their cells
+  int errors = 0;
+  if (!rebuilt && &bodies[0] != B0) errors++;                   // Refit must keep body storage
+  for (size_t c=0; c<cells.size(); c++) {                       // Loop over cells
+    Cell * C = &cells[c];
+    for (Body * B=C->BODY; B!=C->BODY+C->NBODY; B++) {          //  Loop over bodies in cell
+      for (int d=0; d<3; d++) {                                 //   Loop over dimension
+        if (std::abs(B->X[d] - C->X[d]) > C->R * (1 + 1e-12)) errors++;// Body outside of cell
+      }                                                         //   End loop over dimension
+    }                                                           //  End loop over bodies in cell
+  }                                                             // End loop over cells
+  return errors;
+}
+
+int test_scatter(bool key) {
+  const int numBodies = 10000;                                  // Number of bodies
+  FMM fmm;                                                      // Parameters of the tree
+  fmm.ncrit = 64;                                               // Number of bodies per leaf cell
+
+  //! Initialize bodies
+  Bodies bodies(numBodies);                                     // Initialize bodies
+  srand48(0);                                                   // Set seed for random number generator
+  for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
+    for (int d=0; d<3; d++) {                                   //  Loop over dimension
+      bodies[b].X[d] = drand48() * 2 * M_PI - M_PI;             //   Initialize positions
+    }                                                           //  End loop over dimension
+    bodies[b].q = drand48() - .5;                               //  Initialize charge
+    bodies[b].IBODY = b;                                        //  Initial body numbering
+  }                                                             // End loop over bodies
+  Bodies bodies0 = bodies;                                      // Save bodies in initial order
+
+  //! Build tree, use positions as results and scatter them back
+  Cells cells = key ? buildTreeKey(bodies, fmm) : buildTree(bodies, fmm);// Build tree
+  for (size_t b=0; b<bodies.size(); b++) {                      // Loop over bodies
+    bodies[b].p = bodies[b].q;                                  //  Use charge as potential
+    for (int d=0; d<3; d++) bodies[b].F[d] = bodies[b].X[d];    //  Use position as force
+  }                                                             // End loop over bodies
+  std::vector<real_t> p(numBodies), F(3*numBodies);             // Results in initial order
+  scatterBodies(bodies, &p[0], &F[0]);                          // Scatter results back to initial order
+
+  //! Count results that do not match their initial body
+  int errors = 0;
+  for (size_t b=0; b<bodies0.size(); b++) {                     // Loop over bodies in initial order
+    if (p[b] != bodies0[b].q) errors++;                         //  Potential must come from same body
+    for (int d=0; d<3; d++) {                                   //  Loop over dimension
+      if (F[3*b+d] != bodies0[b].X[d]) errors++;                //   Force must come from same body
+    }                                                           //  End loop over dimension
+  }                                                             // End loop over bodies
+  return errors;
+}
+#endif